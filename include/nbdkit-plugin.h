@@ -47,8 +47,32 @@ extern "C" {
 #define NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS    1
 #define NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS        2
 #define NBDKIT_THREAD_MODEL_PARALLEL                  3
+#define NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING     4
+#define NBDKIT_THREAD_MODEL_SERIALIZE_WRITES          5
 
+/* Plugins which use the version 2 API (which passes flags to the
+ * data callbacks) must define NBDKIT_API_VERSION to 2 before
+ * including this header.
+ */
+#ifndef NBDKIT_API_VERSION
 #define NBDKIT_API_VERSION                            1
+#elif NBDKIT_API_VERSION < 1 || NBDKIT_API_VERSION > 2
+#error NBDKIT_API_VERSION must be 1 or 2
+#endif
+
+#define NBDKIT_FLAG_MAY_TRIM  (1<<0) /* zero: may punch a hole */
+#define NBDKIT_FLAG_FUA       (1<<1) /* write: force unit access */
+#define NBDKIT_FLAG_REQ_ONE   (1<<2) /* only one extent is needed */
+#define NBDKIT_FLAG_FAST_ZERO (1<<3) /* zero: fail if it would be slow */
+
+#define NBDKIT_FUA_NONE       0 /* FUA is not supported */
+#define NBDKIT_FUA_EMULATE    1 /* nbdkit calls .flush after the write */
+#define NBDKIT_FUA_NATIVE     2 /* the plugin handles NBDKIT_FLAG_FUA */
+
+#define NBDKIT_EXTENT_HOLE    (1<<0) /* unallocated */
+#define NBDKIT_EXTENT_ZERO    (1<<1) /* reads as zeroes */
+
+struct nbdkit_extents;
 
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
@@ -86,14 +110,57 @@ struct nbdkit_plugin {
   int (*is_rotational) (void *handle);
   int (*can_trim) (void *handle);
 
+#if NBDKIT_API_VERSION == 1
   int (*pread) (void *handle, void *buf, uint32_t count, uint64_t offset);
   int (*pwrite) (void *handle, const void *buf, uint32_t count, uint64_t offset);
   int (*flush) (void *handle);
   int (*trim) (void *handle, uint32_t count, uint64_t offset);
   int (*zero) (void *handle, uint32_t count, uint64_t offset, int may_trim);
+#else
+  int (*_pread_old) (void *, void *, uint32_t, uint64_t);
+  int (*_pwrite_old) (void *, const void *, uint32_t, uint64_t);
+  int (*_flush_old) (void *);
+  int (*_trim_old) (void *, uint32_t, uint64_t);
+  int (*_zero_old) (void *, uint32_t, uint64_t, int);
+#endif
 
   int errno_is_preserved;
 
+  int (*pread_fd) (void *handle, uint32_t count, uint64_t offset,
+                   int *fd, uint64_t *fd_offset);
+  int (*pwrite_fd) (void *handle, uint32_t count, uint64_t offset,
+                    int *fd, uint64_t *fd_offset);
+
+  int (*can_extents) (void *handle);
+  int (*extents) (void *handle, uint32_t count, uint64_t offset,
+                  uint32_t flags, struct nbdkit_extents *extents);
+
+  int (*block_size) (void *handle, uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
+
+  int (*can_multi_conn) (void *handle);
+
+#if NBDKIT_API_VERSION == 1
+  int (*_unused1) (void *);
+  int (*_unused2) (void *, void *, uint32_t, uint64_t, uint32_t);
+  int (*_unused3) (void *, const void *, uint32_t, uint64_t, uint32_t);
+  int (*_unused4) (void *, uint32_t);
+  int (*_unused5) (void *, uint32_t, uint64_t, uint32_t);
+  int (*_unused6) (void *, uint32_t, uint64_t, uint32_t);
+#else
+  int (*can_fua) (void *handle);
+  int (*pread) (void *handle, void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags);
+  int (*pwrite) (void *handle, const void *buf, uint32_t count,
+                 uint64_t offset, uint32_t flags);
+  int (*flush) (void *handle, uint32_t flags);
+  int (*trim) (void *handle, uint32_t count, uint64_t offset, uint32_t flags);
+  int (*zero) (void *handle, uint32_t count, uint64_t offset, uint32_t flags);
+#endif
+
+  int (*cache) (void *handle, uint32_t count, uint64_t offset, uint32_t flags);
+  int (*can_fast_zero) (void *handle);
+
   /* int (*set_exportname) (void *handle, const char *exportname); */
 };
 
@@ -108,6 +175,8 @@ extern void nbdkit_vdebug (const char *msg, va_list args);
 extern char *nbdkit_absolute_path (const char *path);
 extern int64_t nbdkit_parse_size (const char *str);
 extern int nbdkit_read_password (const char *value, char **password);
+extern int nbdkit_add_extent (struct nbdkit_extents *,
+                              uint64_t offset, uint64_t length, uint32_t type);
 
 #ifdef __cplusplus
 #define NBDKIT_CXX_LANG_C extern "C"
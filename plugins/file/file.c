@@ -36,13 +36,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <errno.h>
 
+#define NBDKIT_API_VERSION 2
+
 #include <nbdkit-plugin.h>
 
 #ifndef O_CLOEXEC
@@ -200,7 +204,7 @@ file_close (void *handle)
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
@@ -232,7 +236,8 @@ file_get_size (void *handle)
 
 /* Read data from the file. */
 static int
-file_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
 {
   struct handle *h = handle;
 
@@ -256,16 +261,89 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+/* Ask the kernel to read ahead the range into the page cache. */
+static int
+file_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+#ifdef HAVE_POSIX_FADVISE
+  struct handle *h = handle;
+  int r;
+
+  r = posix_fadvise (h->fd, offset, count, POSIX_FADV_WILLNEED);
+  if (r) {
+    errno = r;
+    nbdkit_error ("posix_fadvise: %m");
+    return -1;
+  }
+  return 0;
+#else
+  /* Let nbdkit read the data instead. */
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+/* Let nbdkit send data straight from the file to the client. */
+static int
+file_pread_fd (void *handle, uint32_t count, uint64_t offset,
+               int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+
+  read_delay ();
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 0;
+}
+
+/* FUA is implemented by syncing just the data that was written. */
+static int
+file_can_fua (void *handle)
+{
+  return NBDKIT_FUA_NATIVE;
+}
+
+/* pwrite which does not return until the data is on stable storage.
+ * With RWF_DSYNC the kernel only has to flush this range rather than
+ * every dirty page of the file.  *need_sync is set if that isn't
+ * supported, and the caller must call fdatasync afterwards instead.
+ */
+static ssize_t
+pwrite_dsync (int fd, const void *buf, size_t count, uint64_t offset,
+              int *need_sync)
+{
+#if defined(HAVE_PWRITEV2) && defined(RWF_DSYNC)
+  if (!*need_sync) {
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+    ssize_t r = pwritev2 (fd, &iov, 1, offset, RWF_DSYNC);
+
+    if (r >= 0 || (errno != ENOSYS && errno != EOPNOTSUPP))
+      return r;
+  }
+#endif
+
+  *need_sync = 1;
+  return pwrite (fd, buf, count, offset);
+}
+
 /* Write data to the file. */
 static int
-file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags)
 {
   struct handle *h = handle;
+  int need_sync = 0;
 
   write_delay ();
 
   while (count > 0) {
-    ssize_t r = pwrite (h->fd, buf, count, offset);
+    ssize_t r;
+
+    if (flags & NBDKIT_FLAG_FUA)
+      r = pwrite_dsync (h->fd, buf, count, offset, &need_sync);
+    else
+      r = pwrite (h->fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -275,22 +353,48 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
     offset += r;
   }
 
+  if (need_sync && fdatasync (h->fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    return -1;
+  }
+
   return 0;
 }
 
+/* Let nbdkit write data straight from the client into the file. */
+static int
+file_pwrite_fd (void *handle, uint32_t count, uint64_t offset,
+                int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+
+  write_delay ();
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 0;
+}
+
+/* Zeroing only uses fallocate, which changes metadata without
+ * writing data, or fails so that the client can be told.
+ */
+static int
+file_can_fast_zero (void *handle)
+{
+  return 1;
+}
+
 /* Write data to the file. */
 static int
-file_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
+file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
-#if defined(FALLOC_FL_PUNCH_HOLE) || defined(FALLOC_FL_ZERO_RANGE)
   struct handle *h = handle;
-#endif
   int r = -1;
 
   write_delay ();
 
 #ifdef FALLOC_FL_PUNCH_HOLE
-  if (may_trim) {
+  if (flags & NBDKIT_FLAG_MAY_TRIM) {
     r = fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
 		   offset, count);
     if (r == -1 && errno != EOPNOTSUPP) {
@@ -298,7 +402,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
     }
     /* PUNCH_HOLE is older; if it is not supported, it is likely that
        ZERO_RANGE will not work either, so fall back to write. */
-    return r;
+    goto out;
   }
 #endif
 
@@ -312,12 +416,33 @@ file_zero (void *handle, uint32_t count, uint64_t offset, int may_trim)
   errno = EOPNOTSUPP;
 #endif
 
+#ifdef FALLOC_FL_PUNCH_HOLE
+ out:
+#endif
+  /* If this fails with EOPNOTSUPP nbdkit writes zeroes through
+   * .pwrite instead, passing on the FUA flag.
+   */
+  if (r == 0 && (flags & NBDKIT_FLAG_FUA) && fdatasync (h->fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    return -1;
+  }
+
   return r;
 }
 
+/* Every connection opens the same file, and fdatasync flushes all
+ * writes to the file whichever descriptor they were made through, so
+ * clients can safely spread requests over several connections.
+ */
+static int
+file_can_multi_conn (void *handle)
+{
+  return 1;
+}
+
 /* Flush the file to disk. */
 static int
-file_flush (void *handle)
+file_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
 
@@ -329,6 +454,72 @@ file_flush (void *handle)
   return 0;
 }
 
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+/* Does the file support SEEK_DATA/SEEK_HOLE? */
+static int
+file_can_extents (void *handle)
+{
+  struct handle *h = handle;
+
+  /* ENXIO means offset 0 is in a hole at the end of the file, which
+   * is fine.  Anything else (usually EINVAL) means it isn't supported.
+   */
+  if (lseek (h->fd, 0, SEEK_DATA) == -1 && errno != ENXIO) {
+    nbdkit_debug ("extents disabled: lseek: SEEK_DATA: %m");
+    return 0;
+  }
+  return 1;
+}
+
+/* Report holes and data using SEEK_DATA/SEEK_HOLE.  Holes in the
+ * file read as zeroes.
+ */
+static int
+file_extents (void *handle, uint32_t count, uint64_t offset,
+              uint32_t flags, struct nbdkit_extents *extents)
+{
+  struct handle *h = handle;
+  uint64_t end = offset + count;
+  off_t pos;
+
+  while (offset < end) {
+    pos = lseek (h->fd, offset, SEEK_DATA);
+    if (pos == -1) {
+      if (errno != ENXIO) {
+        nbdkit_error ("lseek: SEEK_DATA: %" PRIu64 ": %m", offset);
+        return -1;
+      }
+      /* Hole to the end of the file. */
+      return nbdkit_add_extent (extents, offset, end - offset,
+                                NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO);
+    }
+    if ((uint64_t) pos > offset) {
+      if (nbdkit_add_extent (extents, offset, pos - offset,
+                             NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+        return -1;
+      if (flags & NBDKIT_FLAG_REQ_ONE)
+        return 0;
+      offset = pos;
+      if (offset >= end)
+        break;
+    }
+
+    pos = lseek (h->fd, offset, SEEK_HOLE);
+    if (pos == -1) {
+      nbdkit_error ("lseek: SEEK_HOLE: %" PRIu64 ": %m", offset);
+      return -1;
+    }
+    if (nbdkit_add_extent (extents, offset, pos - offset, 0) == -1)
+      return -1;
+    if (flags & NBDKIT_FLAG_REQ_ONE)
+      return 0;
+    offset = pos;
+  }
+
+  return 0;
+}
+#endif
+
 static struct nbdkit_plugin plugin = {
   .name              = "file",
   .longname          = "nbdkit file plugin",
@@ -341,10 +532,20 @@ static struct nbdkit_plugin plugin = {
   .close             = file_close,
   .get_size          = file_get_size,
   .pread             = file_pread,
+  .cache             = file_cache,
   .pwrite            = file_pwrite,
   .zero              = file_zero,
+  .can_fast_zero     = file_can_fast_zero,
   .flush             = file_flush,
+  .can_multi_conn    = file_can_multi_conn,
+  .can_fua           = file_can_fua,
   .errno_is_preserved = 1,
+  .pread_fd          = file_pread_fd,
+  .pwrite_fd         = file_pwrite_fd,
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  .can_extents       = file_can_extents,
+  .extents           = file_extents,
+#endif
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
@@ -164,7 +164,10 @@ virt_close (void *handle)
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* The libvirt connection is thread-safe, so reads on the same handle
+ * can happen in parallel.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_WRITES
 
 /* Get the file size. */
 static int64_t
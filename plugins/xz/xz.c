@@ -243,6 +243,50 @@ xz_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+/* Decompress the blocks covering the range into the cache, so that
+ * the following reads don't have to wait for them.  Stop when the
+ * cache is full, since any more blocks would only evict these.
+ */
+static int
+xz_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct xz_handle *h = handle;
+  char *data;
+  uint64_t start, size, end = offset + count;
+  size_t n;
+
+  for (n = 0; offset < end && n < maxdepth; ++n) {
+    data = get_block (h->c, offset, &start, &size);
+    if (!data) {
+      data = xzfile_read_block (h->xz, offset, &start, &size);
+      if (data == NULL)
+        return -1;
+      put_block (h->c, start, size, data);
+    }
+    offset = start + size;
+  }
+
+  return 0;
+}
+
+/* Prefer requests the size of an xz block, so that clients don't
+ * make us decompress the same block several times.
+ */
+static int
+xz_block_size (void *handle,
+               uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  struct xz_handle *h = handle;
+  uint64_t size = xzfile_max_uncompressed_block_size (h->xz);
+
+  /* This has to be a power of 2, so round down. */
+  *preferred = 4096;
+  while (*preferred < 32 * 1024 * 1024 && (uint64_t) *preferred * 2 <= size)
+    *preferred *= 2;
+
+  return 0;
+}
+
 static struct nbdkit_plugin plugin = {
   .name              = "xz",
   .version           = PACKAGE_VERSION,
@@ -254,6 +298,8 @@ static struct nbdkit_plugin plugin = {
   .close             = xz_close,
   .get_size          = xz_get_size,
   .pread             = xz_pread,
+  .cache             = xz_cache,
+  .block_size        = xz_block_size,
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
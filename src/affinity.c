@@ -0,0 +1,312 @@
+/* nbdkit
+ * Copyright (C) 2018 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* CPU and NUMA placement (--cpus and --numa).
+ *
+ * The allowed CPUs are applied to the main thread before any server
+ * threads are started, so every connection, worker and accept thread
+ * inherits them.  With --numa, request buffers are also placed on the
+ * NUMA node of the thread which allocates them (see bufpool.c), so
+ * that a connection's socket processing, plugin calls and buffers
+ * stay on one node.  When several nodes are listed, each connection
+ * thread is pinned to the CPUs of one of them (its worker threads
+ * inherit this), unless --listen-shards already does that.
+ *
+ * The NUMA topology is read from sysfs.  On machines without it every
+ * CPU is treated as belonging to node 0.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sched.h>
+
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+#ifdef HAVE_SCHED_GETAFFINITY
+
+/* Node of each CPU. */
+static int cpu_node[CPU_SETSIZE];
+
+/* With --numa, the usable CPUs of each selected node which has any. */
+static cpu_set_t *numa_node_cpus;
+static size_t nr_numa_nodes;
+
+/* Parse a list such as "0-3,8,10-11" into a set.  Returns -1 if it
+ * can't be parsed.
+ */
+static int
+parse_list (const char *str, cpu_set_t *set)
+{
+  unsigned long first, last;
+  char *end;
+
+  CPU_ZERO (set);
+  for (;;) {
+    errno = 0;
+    first = last = strtoul (str, &end, 10);
+    if (errno || end == str)
+      return -1;
+    if (*end == '-') {
+      str = end + 1;
+      last = strtoul (str, &end, 10);
+      if (errno || end == str || last < first)
+        return -1;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; ++first)
+      CPU_SET (first, set);
+    if (*end == '\0' || *end == '\n')
+      return 0;
+    if (*end != ',')
+      return -1;
+    str = end + 1;
+  }
+}
+
+/* Read the CPUs of a NUMA node.  Returns -1 if there is no such node. */
+static int
+read_node_cpus (int node, cpu_set_t *set)
+{
+  char path[64], line[4096];
+  FILE *fp;
+  int r;
+
+  snprintf (path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+            node);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return -1;
+  CPU_ZERO (set);
+  if (fgets (line, sizeof line, fp) == NULL)
+    r = -1;
+  else if (line[0] == '\n')   /* Node with memory but no CPUs. */
+    r = 0;
+  else
+    r = parse_list (line, set);
+  fclose (fp);
+  return r;
+}
+
+static void
+read_cpu_nodes (void)
+{
+  DIR *dir;
+  struct dirent *d;
+  cpu_set_t set;
+  int node, cpu;
+
+  dir = opendir ("/sys/devices/system/node");
+  if (dir == NULL)
+    return;
+  while ((d = readdir (dir)) != NULL) {
+    if (sscanf (d->d_name, "node%d", &node) != 1 ||
+        read_node_cpus (node, &set) == -1)
+      continue;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET (cpu, &set))
+        cpu_node[cpu] = node;
+  }
+  closedir (dir);
+}
+
+void
+affinity_init (void)
+{
+  cpu_set_t allowed, set, nodes, node_cpus;
+  int node;
+
+  read_cpu_nodes ();
+
+  if (cpus == NULL && numa == NULL)
+    return;
+
+  if (sched_getaffinity (0, sizeof allowed, &allowed) == -1) {
+    perror ("sched_getaffinity");
+    exit (EXIT_FAILURE);
+  }
+
+  if (cpus) {
+    if (parse_list (cpus, &set) == -1) {
+      fprintf (stderr, "%s: --cpus: cannot parse CPU list '%s'\n",
+               program_name, cpus);
+      exit (EXIT_FAILURE);
+    }
+    CPU_AND (&allowed, &allowed, &set);
+  }
+
+  if (numa) {
+    cpu_set_t numa_cpus;
+
+    if (parse_list (numa, &nodes) == -1) {
+      fprintf (stderr, "%s: --numa: cannot parse node list '%s'\n",
+               program_name, numa);
+      exit (EXIT_FAILURE);
+    }
+    CPU_ZERO (&numa_cpus);
+    for (node = 0; node < CPU_SETSIZE; ++node) {
+      if (!CPU_ISSET (node, &nodes))
+        continue;
+      if (read_node_cpus (node, &node_cpus) == -1) {
+        fprintf (stderr, "%s: --numa: no such NUMA node: %d\n",
+                 program_name, node);
+        exit (EXIT_FAILURE);
+      }
+      CPU_OR (&numa_cpus, &numa_cpus, &node_cpus);
+    }
+    CPU_AND (&allowed, &allowed, &numa_cpus);
+  }
+
+  if (CPU_COUNT (&allowed) == 0) {
+    fprintf (stderr, "%s: --cpus/--numa: no usable CPUs selected\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  if (sched_setaffinity (0, sizeof allowed, &allowed) == -1) {
+    perror ("sched_setaffinity");
+    exit (EXIT_FAILURE);
+  }
+  debug ("running on %d CPU(s)", CPU_COUNT (&allowed));
+
+  if (numa) {
+    numa_node_cpus = calloc (CPU_COUNT (&nodes), sizeof *numa_node_cpus);
+    if (numa_node_cpus == NULL) {
+      perror ("calloc");
+      exit (EXIT_FAILURE);
+    }
+    for (node = 0; node < CPU_SETSIZE; ++node) {
+      if (!CPU_ISSET (node, &nodes))
+        continue;
+      read_node_cpus (node, &node_cpus);
+      CPU_AND (&node_cpus, &node_cpus, &allowed);
+      if (CPU_COUNT (&node_cpus) > 0)
+        numa_node_cpus[nr_numa_nodes++] = node_cpus;
+    }
+  }
+}
+
+/* Keep the calling connection thread on one of the --numa nodes,
+ * spreading connections over the nodes in turn.
+ */
+void
+affinity_pin_connection (size_t instance_num)
+{
+  cpu_set_t *set;
+
+  if (nr_numa_nodes <= 1)
+    return;
+  set = &numa_node_cpus[instance_num % nr_numa_nodes];
+  if (sched_setaffinity (0, sizeof *set, set) == -1)
+    perror ("sched_setaffinity");
+}
+
+int
+affinity_cpu_node (int cpu)
+{
+  return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+#else /* !HAVE_SCHED_GETAFFINITY */
+
+void
+affinity_init (void)
+{
+  if (cpus || numa) {
+    fprintf (stderr, "%s: --cpus and --numa are not supported on this platform\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+void
+affinity_pin_connection (size_t instance_num)
+{
+}
+
+int
+affinity_cpu_node (int cpu)
+{
+  return 0;
+}
+
+#endif /* !HAVE_SCHED_GETAFFINITY */
+
+/* Returns the NUMA node the calling thread is running on, or -1 if
+ * buffers should not be placed explicitly.
+ */
+int
+affinity_current_node (void)
+{
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(HAVE_LINUX_MEMPOLICY_H)
+  int cpu;
+
+  if (numa == NULL)
+    return -1;
+  cpu = sched_getcpu ();
+  return cpu >= 0 ? affinity_cpu_node (cpu) : -1;
+#else
+  return -1;
+#endif
+}
+
+/* Ask the kernel to place the pages of a new mapping on the given
+ * node.  This is only a preference, so failure is harmless.
+ */
+void
+affinity_place_memory (void *addr, size_t len, int node)
+{
+#ifdef HAVE_LINUX_MEMPOLICY_H
+  unsigned long mask[CPU_SETSIZE / (8 * sizeof (unsigned long))];
+
+  if (node < 0 || node >= CPU_SETSIZE)
+    return;
+  memset (mask, 0, sizeof mask);
+  mask[node / (8 * sizeof mask[0])] |= 1UL << (node % (8 * sizeof mask[0]));
+  if (syscall (SYS_mbind, addr, len, MPOL_PREFERRED,
+               mask, 8 * sizeof mask, 0) == -1)
+    debug ("mbind: %m");
+#endif
+}
@@ -0,0 +1,348 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Pool of request buffers.
+ *
+ * Read and write requests need a buffer of up to MAX_REQUEST_SIZE
+ * bytes.  Calling malloc and free for each one means glibc mmaps and
+ * munmaps large buffers every time, and every request then takes
+ * page faults to touch the fresh pages.  Instead each thread keeps
+ * one free buffer per power-of-2 size class and reuses it for later
+ * requests.  Since a thread only processes one request at a time,
+ * that is all it needs.
+ *
+ * Buffers are mapped with mmap so they are page-aligned.  Large ones
+ * are aligned to the huge page size and marked with MADV_HUGEPAGE
+ * where available, so that they can be backed by transparent huge
+ * pages.  The total size
+ * of free buffers held by all threads is capped at BUFPOOL_MAX_BYTES,
+ * beyond which buffers are simply unmapped when they are freed.
+ *
+ * With --numa, new buffers are placed on the NUMA node the thread is
+ * running on, and a free buffer is only reused on the same node.
+ *
+ * The epoll event loop allocates the buffers for write data but the
+ * worker threads free them, so a per-thread pool would never be
+ * refilled.  Instead the event loop calls bufpool_share, after which
+ * its buffers go back to a shared pool whichever thread frees them.
+ * The shared pool keeps a list of free buffers per size class, since
+ * many requests can be in flight at once.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+/* Size classes run from 4K to 64M. */
+#define BUFPOOL_MIN_SHIFT 12
+#define BUFPOOL_NR_CLASSES 15
+
+/* Maximum total size of free buffers held in all pools. */
+#define BUFPOOL_MAX_BYTES (256 * 1024 * 1024)
+
+/* Use transparent huge pages for buffers at least this large. */
+#define BUFPOOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Each buffer is preceded by one page holding this header, which
+ * keeps the buffer itself aligned.  For large buffers the header page
+ * is the last page before a huge page boundary.
+ */
+struct header {
+  size_t size;                  /* Usable size of the buffer. */
+  int class;                    /* Size class or -1 if not pooled. */
+  int node;                     /* NUMA node or -1 if not placed. */
+  bool shared;                  /* Belongs to the shared pool. */
+  char *next;                   /* Next free buffer in the shared pool. */
+};
+
+struct pool {
+  char *free[BUFPOOL_NR_CLASSES];
+  uint64_t hits, misses;
+};
+
+static pthread_key_t pool_key;
+static size_t page_size;
+
+/* The shared pool is never freed, since buffers may be returned to
+ * it after the thread which allocated them has exited.  This lock
+ * protects its free lists.
+ */
+static struct pool shared_pool;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Updated atomically. */
+static size_t pooled_bytes;
+static uint64_t total_hits, total_misses;
+
+static void
+print_stats (const char *what, uint64_t hits, uint64_t misses)
+{
+  if (hits + misses > 0)
+    debug ("%s: %" PRIu64 " buffer allocations, %.1f%% from the pool",
+           what, hits + misses, 100.0 * hits / (hits + misses));
+}
+
+static void
+unmap_buffer (char *buf)
+{
+  struct header *h = (struct header *) (buf - page_size);
+
+  munmap (h, page_size + h->size);
+}
+
+static void
+free_pool (void *poolv)
+{
+  struct pool *pool = poolv;
+  size_t i;
+
+  if (pool == &shared_pool)
+    return;
+
+  for (i = 0; i < BUFPOOL_NR_CLASSES; ++i) {
+    if (pool->free[i]) {
+      __atomic_sub_fetch (&pooled_bytes,
+                          (size_t) 1 << (BUFPOOL_MIN_SHIFT + i),
+                          __ATOMIC_RELAXED);
+      unmap_buffer (pool->free[i]);
+    }
+  }
+
+  print_stats ("thread buffer pool", pool->hits, pool->misses);
+  free (pool);
+}
+
+void
+bufpool_init (void)
+{
+  int err;
+
+  page_size = sysconf (_SC_PAGESIZE);
+
+  err = pthread_key_create (&pool_key, free_pool);
+  if (err != 0) {
+    fprintf (stderr, "%s: pthread_key_create: %s\n",
+             program_name, strerror (err));
+    exit (EXIT_FAILURE);
+  }
+}
+
+void
+bufpool_cleanup (void)
+{
+  print_stats ("shared buffer pool", shared_pool.hits, shared_pool.misses);
+  print_stats ("buffer pool",
+               __atomic_load_n (&total_hits, __ATOMIC_RELAXED),
+               __atomic_load_n (&total_misses, __ATOMIC_RELAXED));
+}
+
+/* Returns the pool for the current thread, creating it if needed.
+ * This can return NULL, in which case buffers are not pooled.
+ */
+static struct pool *
+get_pool (void)
+{
+  struct pool *pool = pthread_getspecific (pool_key);
+
+  if (pool == NULL) {
+    pool = calloc (1, sizeof *pool);
+    if (pool == NULL)
+      return NULL;
+    if (pthread_setspecific (pool_key, pool) != 0) {
+      free (pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+/* Make the buffers allocated by the current thread go back to the
+ * shared pool when they are freed, by any thread.
+ */
+void
+bufpool_share (void)
+{
+  if (pthread_setspecific (pool_key, &shared_pool) != 0)
+    debug ("pthread_setspecific failed, buffers will not be shared");
+}
+
+/* Take a buffer of the given class from the pool, or return NULL. */
+static char *
+take_free (struct pool *pool, int class)
+{
+  struct header *h;
+  char *buf;
+
+  if (pool != &shared_pool) {
+    buf = pool->free[class];
+    pool->free[class] = NULL;
+    return buf;
+  }
+
+  pthread_mutex_lock (&shared_lock);
+  buf = pool->free[class];
+  if (buf) {
+    h = (struct header *) (buf - page_size);
+    pool->free[class] = h->next;
+  }
+  pthread_mutex_unlock (&shared_lock);
+  return buf;
+}
+
+static int
+size_class (size_t size)
+{
+  int class = 0;
+
+  while (class < BUFPOOL_NR_CLASSES &&
+         ((size_t) 1 << (BUFPOOL_MIN_SHIFT + class)) < size)
+    class++;
+  return class < BUFPOOL_NR_CLASSES ? class : -1;
+}
+
+/* Allocate a buffer of at least 'size' bytes.  Returns NULL with
+ * errno set on failure.  It must be freed with bufpool_free.
+ */
+void *
+bufpool_alloc (size_t size)
+{
+  int class = size_class (size);
+  int node = affinity_current_node ();
+  struct pool *pool = get_pool ();
+  struct header *h;
+  char *buf, *map, *end;
+  size_t align, len;
+
+  if (class >= 0) {
+    size = (size_t) 1 << (BUFPOOL_MIN_SHIFT + class);
+
+    if (pool && (buf = take_free (pool, class)) != NULL) {
+      __atomic_sub_fetch (&pooled_bytes, size, __ATOMIC_RELAXED);
+      h = (struct header *) (buf - page_size);
+      if (h->node == node) {
+        pool->hits++;
+        __atomic_add_fetch (&total_hits, 1, __ATOMIC_RELAXED);
+        return buf;
+      }
+      /* The thread has moved to another node since. */
+      unmap_buffer (buf);
+    }
+  }
+  else
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+  if (pool)
+    pool->misses++;
+  __atomic_add_fetch (&total_misses, 1, __ATOMIC_RELAXED);
+
+  /* Map enough extra to be able to align the buffer, then unmap
+   * whatever is left over at either end.
+   */
+  align = size >= BUFPOOL_HUGEPAGE_SIZE ? BUFPOOL_HUGEPAGE_SIZE : page_size;
+  len = size + align;
+  map = mmap (NULL, len, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  buf = (char *) (((uintptr_t) map + page_size + align - 1) & ~(align - 1));
+  h = (struct header *) (buf - page_size);
+  end = map + len;
+  if ((char *) h > map)
+    munmap (map, (char *) h - map);
+  if (buf + size < end)
+    munmap (buf + size, end - (buf + size));
+
+  if (node >= 0)
+    affinity_place_memory (h, page_size + size, node);
+  h->size = size;
+  h->class = class;
+  h->node = node;
+  h->shared = class >= 0 && pool == &shared_pool;
+  h->next = NULL;
+
+#ifdef MADV_HUGEPAGE
+  if (size >= BUFPOOL_HUGEPAGE_SIZE)
+    madvise (buf, size, MADV_HUGEPAGE);
+#endif
+
+  return buf;
+}
+
+void
+bufpool_free (void *bufv)
+{
+  char *buf = bufv;
+  struct header *h;
+  struct pool *pool;
+
+  if (buf == NULL)
+    return;
+
+  h = (struct header *) (buf - page_size);
+  if (h->shared) {
+    if (__atomic_add_fetch (&pooled_bytes, h->size, __ATOMIC_RELAXED) <=
+        BUFPOOL_MAX_BYTES) {
+      pthread_mutex_lock (&shared_lock);
+      h->next = shared_pool.free[h->class];
+      shared_pool.free[h->class] = buf;
+      pthread_mutex_unlock (&shared_lock);
+      return;
+    }
+    __atomic_sub_fetch (&pooled_bytes, h->size, __ATOMIC_RELAXED);
+  }
+  else if (h->class >= 0) {
+    pool = get_pool ();
+    if (pool && pool != &shared_pool && pool->free[h->class] == NULL) {
+      if (__atomic_add_fetch (&pooled_bytes, h->size, __ATOMIC_RELAXED) <=
+          BUFPOOL_MAX_BYTES) {
+        pool->free[h->class] = buf;
+        return;
+      }
+      __atomic_sub_fetch (&pooled_bytes, h->size, __ATOMIC_RELAXED);
+    }
+  }
+
+  unmap_buffer (buf);
+}
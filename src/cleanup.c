@@ -46,3 +46,15 @@ cleanup_free (void *ptr)
 {
   free (* (void **) ptr);
 }
+
+void
+cleanup_bufpool_free (void *ptr)
+{
+  bufpool_free (* (void **) ptr);
+}
+
+void
+cleanup_extents_free (void *ptr)
+{
+  extents_free (* (void **) ptr);
+}
@@ -40,7 +40,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <endian.h>
+#include <time.h>
 #include <sys/types.h>
 #include <stddef.h>
 
@@ -53,40 +56,122 @@
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Writes larger than this are received and passed to the plugin in
+ * chunks of this size (see handle_write_streaming).
+ */
+#define WRITE_CHUNK_SIZE (1024 * 1024)
+
 /* Maximum number of client options we allow before giving up. */
 #define MAX_NR_OPTIONS 32
 
 /* Maximum length of any option data (bytes). */
 #define MAX_OPTION_LENGTH 4096
 
+/* Preferred block size we advertise if the plugin doesn't say. */
+#define DEFAULT_PREFERRED_BLOCK_SIZE 4096
+
+/* Context ID of "base:allocation" when the client selects it. */
+#define BASE_ALLOCATION_ID 1
+
 /* Connection structure. */
 struct connection {
   pthread_mutex_t request_lock;
+  pthread_rwlock_t request_rwlock;
+  pthread_mutex_t read_lock;
+  pthread_mutex_t write_lock;
+  pthread_mutex_t status_lock;
+  int status; /* 1 for more I/O with client, 0 for shutdown, -1 on error */
   void *handle;
   void *crypto_session;
+  void *uring_session;
+  struct flush_state *flush;
+  size_t nworkers;
 
   uint64_t exportsize;
   int readonly;
   int can_flush;
+  int can_fua;
+  int can_fast_zero;
   int is_rotational;
   int can_trim;
+  int can_extents;
   int using_tls;
+  int structured_replies;
+  int extended_headers;
+  int meta_context_base_allocation;
+
+  /* Connections served by the event loop (see eventloop.c) are given
+   * each message from the client complete, and while one is being
+   * processed msg_recv reads from it instead of the socket.
+   */
+  int handshake;                /* HANDSHAKE_*, only for the event loop */
+  uint32_t cflags;
+  size_t nr_options;
+  struct message *msg;
+  uint64_t msg_pos;
 
   int sockin, sockout;
   connection_recv_function recv;
   connection_send_function send;
+  connection_sendv_function sendv;
   connection_close_function close;
+  connection_sendfile_function sendfile; /* NULL if not supported */
+  connection_recvfile_function recvfile; /* NULL if not supported */
+  bool sockout_not_socket;      /* Used by raw_sendv. */
+
+  /* Receive buffer used by raw_recv after the handshake.  Data
+   * between recv_head and recv_tail has been read from the client but
+   * not yet consumed.
+   */
+  char *recv_buf;
+  size_t recv_head, recv_tail;
+
+  /* Busy polling (--busy-poll) in raw_recv, and how often reads found
+   * data at once, found it while spinning, or had to block.
+   */
+  bool busy_poll;
+  uint64_t busy_poll_ready, busy_poll_hits, busy_poll_misses;
+
+  /* Helper which writes chunks of large writes (see
+   * handle_write_streaming), or NULL if it hasn't been started.
+   */
+  struct write_stream *write_stream;
 };
 
-static struct connection *new_connection (int sockin, int sockout);
+/* Handshake states of connections served by the event loop. */
+#define HANDSHAKE_DONE 0
+#define HANDSHAKE_FLAGS 1
+#define HANDSHAKE_OPTIONS 2
+
+/* Size of the receive buffer.  This is large enough to hold many
+ * pipelined request headers and small write payloads, which can then
+ * be read with a single system call.
+ */
+#define RECV_BUFFER_SIZE (256 * 1024)
+
+static struct connection *new_connection (int sockin, int sockout,
+                                          size_t nworkers);
 static void free_connection (struct connection *conn);
+static void setup_busy_poll (struct connection *conn);
+static void stop_write_stream (struct write_stream *s);
 static int negotiate_handshake (struct connection *conn);
-static int recv_request_send_reply (struct connection *conn);
+static int _negotiate_handshake_oldstyle (struct connection *conn);
+static int _negotiate_handshake_newstyle_greeting (struct connection *conn);
+static int _negotiate_handshake_newstyle_flags (struct connection *conn);
+static int _negotiate_handshake_newstyle_options (struct connection *conn);
+static int recv_request_send_reply (struct connection *conn,
+                                    struct message *msg);
 
 /* Don't call these raw socket functions directly.  Use conn->recv etc. */
 static int raw_recv (struct connection *, void *buf, size_t len);
 static int raw_send (struct connection *, const void *buf, size_t len);
+static int raw_sendv (struct connection *, const struct iovec *iov, int iovcnt, int flags);
 static void raw_close (struct connection *);
+static int msg_recv (struct connection *, void *buf, size_t len);
+#ifdef HAVE_SPLICE
+static int raw_sendfile (struct connection *, int pipefd, size_t len, int flags);
+static int raw_recvfile (struct connection *, int pipefd, size_t len, size_t *moved);
+#endif
 
 /* Accessors for public fields in the connection structure.
  * Everything else is private to this file.
@@ -109,6 +194,12 @@ connection_get_request_lock (struct connection *conn)
   return &conn->request_lock;
 }
 
+pthread_rwlock_t *
+connection_get_request_rwlock (struct connection *conn)
+{
+  return &conn->request_rwlock;
+}
+
 void
 connection_set_crypto_session (struct connection *conn, void *session)
 {
@@ -121,9 +212,22 @@ connection_get_crypto_session (struct connection *conn)
   return conn->crypto_session;
 }
 
-/* The code in crypto.c uses these three functions to replace the
- * recv, send and close callbacks when a connection is upgraded to
- * TLS.
+void
+connection_set_uring_session (struct connection *conn, void *session)
+{
+  conn->uring_session = session;
+}
+
+void *
+connection_get_uring_session (struct connection *conn)
+{
+  return conn->uring_session;
+}
+
+/* The code in crypto.c and uring.c uses these functions to replace
+ * the recv, send, sendv, close, sendfile and recvfile
+ * callbacks when a connection is upgraded to TLS or switched to
+ * io_uring.
  */
 void
 connection_set_recv (struct connection *conn, connection_recv_function recv)
@@ -137,20 +241,188 @@ connection_set_send (struct connection *conn, connection_send_function send)
   conn->send = send;
 }
 
+void
+connection_set_sendv (struct connection *conn, connection_sendv_function sendv)
+{
+  conn->sendv = sendv;
+}
+
 void
 connection_set_close (struct connection *conn, connection_close_function close)
 {
   conn->close = close;
 }
 
+void
+connection_set_sendfile (struct connection *conn,
+                         connection_sendfile_function sendfile)
+{
+  conn->sendfile = sendfile;
+}
+
+void
+connection_set_recvfile (struct connection *conn,
+                         connection_recvfile_function recvfile)
+{
+  conn->recvfile = recvfile;
+}
+
 static int
-_handle_single_connection (int sockin, int sockout)
+get_status (struct connection *conn)
 {
   int r;
-  struct connection *conn = new_connection (sockin, sockout);
 
+  if (conn->nworkers)
+    pthread_mutex_lock (&conn->status_lock);
+  r = conn->status;
+  if (conn->nworkers)
+    pthread_mutex_unlock (&conn->status_lock);
+  return r;
+}
+
+/* Update the status if the new value is lower than the existing value.
+ * For convenience, return the incoming value.
+ */
+static int
+set_status (struct connection *conn, int value)
+{
+  if (conn->nworkers)
+    pthread_mutex_lock (&conn->status_lock);
+  if (value < conn->status)
+    conn->status = value;
+  if (conn->nworkers)
+    pthread_mutex_unlock (&conn->status_lock);
+  return value;
+}
+
+struct worker_data {
+  struct connection *conn;
+  size_t instance_num;
+  char *name;
+};
+
+static void *
+connection_worker (void *data)
+{
+  struct worker_data *worker = data;
+  struct connection *conn = worker->conn;
+  char *name = worker->name;
+
+  debug ("starting worker thread %s", name);
+  threadlocal_new_server_thread ();
+  threadlocal_set_name (name);
+  threadlocal_set_instance_num (worker->instance_num);
+  free (worker);
+
+  while (!quit && get_status (conn) > 0)
+    recv_request_send_reply (conn, NULL);
+  debug ("exiting worker thread %s", threadlocal_get_name ());
+  free (name);
+  return NULL;
+}
+
+static int
+_handle_single_connection (int sockin, int sockout)
+{
+  int ret;
+  struct connection *conn;
+  size_t nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
+  pthread_t *workers = NULL;
+
+  /* Only plugins which can cope with parallel requests on a single
+   * handle benefit from a pool of worker threads.
+   */
+  if (plugin_thread_model () < NBDKIT_THREAD_MODEL_PARALLEL || nworkers == 1)
+    nworkers = 0;
+  conn = connection_open (sockin, sockout, nworkers);
   if (!conn)
-    goto err;
+    return -1;
+
+  if (!nworkers) {
+    /* No need for a separate thread. */
+    debug ("handshake complete, processing requests serially");
+    while (!quit && get_status (conn) > 0)
+      recv_request_send_reply (conn, NULL);
+  }
+  else {
+    /* Create thread pool to process requests. */
+    debug ("handshake complete, processing requests with %zu threads",
+           nworkers);
+    workers = calloc (nworkers, sizeof *workers);
+    if (!workers) {
+      perror ("malloc");
+      free_connection (conn);
+      return -1;
+    }
+
+    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
+      struct worker_data *worker = malloc (sizeof *worker);
+      int err;
+
+      if (!worker) {
+        perror ("malloc");
+        set_status (conn, -1);
+        goto wait;
+      }
+      if (asprintf (&worker->name, "%s.%zu", plugin_name (), nworkers) < 0) {
+        perror ("asprintf");
+        set_status (conn, -1);
+        free (worker);
+        goto wait;
+      }
+      worker->conn = conn;
+      worker->instance_num = threadlocal_get_instance_num ();
+      err = pthread_create (&workers[nworkers], NULL, connection_worker,
+                            worker);
+      if (err) {
+        errno = err;
+        perror ("pthread_create");
+        set_status (conn, -1);
+        free (worker->name);
+        free (worker);
+        goto wait;
+      }
+    }
+
+  wait:
+    while (nworkers)
+      pthread_join (workers[--nworkers], NULL);
+    free (workers);
+  }
+
+  ret = get_status (conn);
+  free_connection (conn);
+  return ret;
+}
+
+int
+handle_single_connection (int sockin, int sockout)
+{
+  int r;
+
+  plugin_lock_connection ();
+  r = _handle_single_connection (sockin, sockout);
+  plugin_unlock_connection ();
+
+  return r;
+}
+
+/* Open the plugin and perform the handshake on a new connection.  On
+ * failure the connection (including the sockets) is freed and this
+ * returns NULL.  'nworkers' is non-zero if more than one thread might
+ * process requests for this connection.
+ */
+struct connection *
+connection_open (int sockin, int sockout, size_t nworkers)
+{
+  struct connection *conn = new_connection (sockin, sockout, nworkers);
+
+  if (!conn) {
+    close (sockin);
+    if (sockout != sockin)
+      close (sockout);
+    return NULL;
+  }
 
   if (plugin_open (conn, readonly) == -1)
     goto err;
@@ -161,39 +433,252 @@ _handle_single_connection (int sockin, int sockout)
   if (negotiate_handshake (conn) == -1)
     goto err;
 
-  /* Process requests.  XXX Allow these to be dispatched in parallel using
-   * a thread pool.
+  /* TLS connections keep using GnuTLS for I/O. */
+  if (io_uring && !conn->crypto_session) {
+    if (uring_setup_connection (conn, conn->sockin, conn->sockout) == 0)
+      debug ("using io_uring for this connection");
+  }
+
+  /* Plain connections read ahead into a buffer.  This is only done
+   * after the handshake so that nothing the client sends after
+   * NBD_OPT_STARTTLS can end up in our buffer instead of GnuTLS's.
    */
-  while (!quit) {
-    r = recv_request_send_reply (conn);
-    if (r == -1)
-      goto err;
-    if (r == 0)
-      break;
+  if (conn->recv == raw_recv) {
+    conn->recv_buf = malloc (RECV_BUFFER_SIZE);
+    if (conn->recv_buf == NULL)
+      debug ("malloc: %m (continuing without a receive buffer)");
   }
 
+  /* The event loop waits for requests in epoll_wait instead. */
+  if (busy_poll > 0 && engine == ENGINE_THREADS && conn->recv == raw_recv)
+    setup_busy_poll (conn);
+
+  return conn;
+
+ err:
   free_connection (conn);
-  return 0;
+  return NULL;
+}
+
+static void
+setup_busy_poll (struct connection *conn)
+{
+#ifdef SO_BUSY_POLL
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+#endif
+  int type;
+  socklen_t typelen = sizeof type;
+
+  /* Not a socket, eg. -s mode. */
+  if (getsockopt (conn->sockin, SOL_SOCKET, SO_TYPE, &type, &typelen) == -1)
+    return;
+  conn->busy_poll = true;
+
+#ifdef SO_BUSY_POLL
+  /* Also ask the network driver to busy poll for TCP connections.
+   * Raising this above the net.core.busy_read sysctl needs
+   * CAP_NET_ADMIN, so failure is not an error.
+   */
+  if (getsockname (conn->sockin, (struct sockaddr *) &addr, &addrlen) == 0 &&
+      (addr.ss_family == AF_INET || addr.ss_family == AF_INET6)) {
+    int usecs = busy_poll;
+
+    if (setsockopt (conn->sockin, SOL_SOCKET, SO_BUSY_POLL,
+                    &usecs, sizeof usecs) == -1)
+      debug ("setsockopt: SO_BUSY_POLL: %m");
+  }
+#endif
+}
+
+/* The functions below are used by the event loop (see eventloop.c),
+ * which multiplexes many connections over a shared pool of threads
+ * rather than dedicating threads to each connection.  The event loop
+ * reads each message from the client without blocking, and only once
+ * it is complete hands it to a thread which calls
+ * connection_handle_message, so no thread waits for the client to
+ * send a request.  Replies are still sent with blocking writes.
+ */
+
+/* Open the plugin and start the handshake on a new connection.  On
+ * failure the connection (including the socket) is freed and this
+ * returns NULL.
+ */
+struct connection *
+connection_start (int sock, size_t nworkers)
+{
+  struct connection *conn = new_connection (sock, sock, nworkers);
+  int r;
+
+  if (!conn) {
+    close (sock);
+    return NULL;
+  }
+
+  /* Data from the client only ever comes from the event loop. */
+  conn->recv = msg_recv;
+  conn->recvfile = NULL;
+
+  if (plugin_open (conn, readonly) == -1)
+    goto err;
+
+  threadlocal_set_name (plugin_name ());
+
+  plugin_lock_request (conn, NULL);
+  if (!newstyle) {
+    r = _negotiate_handshake_oldstyle (conn);
+    conn->handshake = HANDSHAKE_DONE;
+  }
+  else {
+    r = _negotiate_handshake_newstyle_greeting (conn);
+    conn->handshake = HANDSHAKE_FLAGS;
+  }
+  plugin_unlock_request (conn, NULL);
+  if (r == -1)
+    goto err;
+
+  return conn;
 
  err:
   free_connection (conn);
-  return -1;
+  return NULL;
 }
 
+/* Returns true until the handshake has finished.  Handshake messages
+ * must be processed one at a time, since each can change how the
+ * next one is read.
+ */
+bool
+connection_negotiating (struct connection *conn)
+{
+  return conn->handshake != HANDSHAKE_DONE;
+}
+
+/* Returns the size of the header of the next message from the
+ * client, which is never more than MAX_MESSAGE_HEADER.
+ */
+size_t
+connection_header_size (struct connection *conn)
+{
+  switch (conn->handshake) {
+  case HANDSHAKE_FLAGS:
+    return sizeof (uint32_t);
+  case HANDSHAKE_OPTIONS:
+    return sizeof (struct new_option);
+  default:
+    return conn->extended_headers
+      ? sizeof (struct request_ext) : sizeof (struct request);
+  }
+}
+
+/* Given the header of a message, set *len to the length of the data
+ * which follows it.  Returns 1 if the data should be kept for
+ * connection_handle_message, 0 if it will be ignored (so it can be
+ * discarded as it is read), or -1 if the connection must be closed.
+ */
 int
-handle_single_connection (int sockin, int sockout)
+connection_data_size (struct connection *conn, const void *hdr,
+                      uint64_t *len)
+{
+  const struct new_option *new_option = hdr;
+  const struct request *request = hdr;
+  const struct request_ext *request_ext = hdr;
+  uint32_t cmd;
+
+  *len = 0;
+  switch (conn->handshake) {
+  case HANDSHAKE_FLAGS:
+    return 1;
+
+  case HANDSHAKE_OPTIONS:
+    *len = be32toh (new_option->optlen);
+    if (*len > MAX_OPTION_LENGTH) {
+      nbdkit_error ("client option data too long (%" PRIu64 ")", *len);
+      return -1;
+    }
+    return 1;
+
+  default:
+    /* The magic is checked later by recv_request_send_reply. */
+    if (conn->extended_headers) {
+      cmd = be32toh (request_ext->type) & NBD_CMD_MASK_COMMAND;
+      if (cmd == NBD_CMD_WRITE)
+        *len = be64toh (request_ext->count);
+    }
+    else {
+      cmd = be32toh (request->type) & NBD_CMD_MASK_COMMAND;
+      if (cmd == NBD_CMD_WRITE)
+        *len = be32toh (request->count);
+    }
+    /* Oversized writes are rejected by validate_request. */
+    return *len <= MAX_REQUEST_SIZE;
+  }
+}
+
+/* Process one complete message from the client, and for requests send
+ * the reply.  msg->data is freed (or taken over).  Returns the
+ * connection status: 1 if the connection is alive, 0 on disconnect,
+ * -1 on error.
+ */
+int
+connection_handle_message (struct connection *conn, struct message *msg)
 {
   int r;
 
-  plugin_lock_connection ();
-  r = _handle_single_connection (sockin, sockout);
-  plugin_unlock_connection ();
+  if (conn->handshake == HANDSHAKE_DONE)
+    recv_request_send_reply (conn, msg);
+  else {
+    conn->msg = msg;
+    conn->msg_pos = 0;
+    plugin_lock_request (conn, NULL);
+    if (conn->handshake == HANDSHAKE_FLAGS) {
+      r = _negotiate_handshake_newstyle_flags (conn);
+      conn->handshake = HANDSHAKE_OPTIONS;
+    }
+    else {
+      r = _negotiate_handshake_newstyle_options (conn);
+      if (r == 1) {
+        debug ("handshake complete, waiting for requests");
+        conn->handshake = HANDSHAKE_DONE;
+      }
+    }
+    plugin_unlock_request (conn, NULL);
+    conn->msg = NULL;
+    if (r == -1)
+      set_status (conn, -1);
+  }
 
-  return r;
+  bufpool_free (msg->data);
+  msg->data = NULL;
+  return get_status (conn);
+}
+
+void
+connection_free (struct connection *conn)
+{
+  free_connection (conn);
+}
+
+/* Used by NBDKIT_THREAD_MODEL_SERIALIZE_WRITES.  Writers are
+ * preferred where the C library allows it, so that a steady stream of
+ * reads cannot hold off a write indefinitely.
+ */
+static void
+init_request_rwlock (pthread_rwlock_t *rwlock)
+{
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init (&attr);
+#if HAVE_DECL_PTHREAD_RWLOCKATTR_SETKIND_NP
+  pthread_rwlockattr_setkind_np (&attr,
+                                 PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init (rwlock, &attr);
+  pthread_rwlockattr_destroy (&attr);
 }
 
 static struct connection *
-new_connection (int sockin, int sockout)
+new_connection (int sockin, int sockout, size_t nworkers)
 {
   struct connection *conn;
 
@@ -203,13 +688,29 @@ new_connection (int sockin, int sockout)
     return NULL;
   }
 
+  conn->status = 1;
+  conn->nworkers = nworkers;
   conn->sockin = sockin;
   conn->sockout = sockout;
+  conn->flush = flush_state_new ();
+  if (conn->flush == NULL) {
+    free (conn);
+    return NULL;
+  }
   pthread_mutex_init (&conn->request_lock, NULL);
+  init_request_rwlock (&conn->request_rwlock);
+  pthread_mutex_init (&conn->read_lock, NULL);
+  pthread_mutex_init (&conn->write_lock, NULL);
+  pthread_mutex_init (&conn->status_lock, NULL);
 
   conn->recv = raw_recv;
   conn->send = raw_send;
+  conn->sendv = raw_sendv;
   conn->close = raw_close;
+#ifdef HAVE_SPLICE
+  conn->sendfile = raw_sendfile;
+  conn->recvfile = raw_recvfile;
+#endif
 
   return conn;
 }
@@ -222,11 +723,24 @@ free_connection (struct connection *conn)
 
   conn->close (conn);
 
+  stop_write_stream (conn->write_stream);
+
+  if (conn->busy_poll)
+    debug ("busy poll: %" PRIu64 " reads ready at once, "
+           "%" PRIu64 " found data while spinning, %" PRIu64 " blocked",
+           conn->busy_poll_ready, conn->busy_poll_hits,
+           conn->busy_poll_misses);
+
   pthread_mutex_destroy (&conn->request_lock);
+  pthread_rwlock_destroy (&conn->request_rwlock);
+  pthread_mutex_destroy (&conn->read_lock);
+  pthread_mutex_destroy (&conn->write_lock);
+  pthread_mutex_destroy (&conn->status_lock);
 
   if (conn->handle)
     plugin_close (conn);
 
+  flush_state_free (conn->flush);
   free (conn);
 }
 
@@ -270,6 +784,14 @@ _negotiate_handshake_oldstyle (struct connection *conn)
   }
   if (!conn->readonly) {
     eflags |= NBD_FLAG_SEND_WRITE_ZEROES;
+
+    fl = plugin_can_fast_zero (conn);
+    if (fl == -1)
+      return -1;
+    if (fl) {
+      eflags |= NBD_FLAG_SEND_FAST_ZERO;
+      conn->can_fast_zero = 1;
+    }
   }
 
 
@@ -277,10 +799,18 @@ _negotiate_handshake_oldstyle (struct connection *conn)
   if (fl == -1)
     return -1;
   if (fl) {
-    eflags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+    eflags |= NBD_FLAG_SEND_FLUSH;
     conn->can_flush = 1;
   }
 
+  fl = plugin_can_fua (conn);
+  if (fl == -1)
+    return -1;
+  if (fl != NBDKIT_FUA_NONE) {
+    eflags |= NBD_FLAG_SEND_FUA;
+    conn->can_fua = fl;
+  }
+
   fl = plugin_is_rotational (conn);
   if (fl == -1)
     return -1;
@@ -297,6 +827,21 @@ _negotiate_handshake_oldstyle (struct connection *conn)
     conn->can_trim = 1;
   }
 
+  /* Plugins without .cache read the data, which has the same
+   * effect on the backing store.
+   */
+  eflags |= NBD_FLAG_SEND_CACHE;
+
+  fl = plugin_can_multi_conn (conn);
+  if (fl == -1)
+    return -1;
+  if (fl) {
+    eflags |= NBD_FLAG_CAN_MULTI_CONN;
+    /* A flush on any connection covers writes on all of them. */
+    flush_state_free (conn->flush);
+    conn->flush = flush_state_shared ();
+  }
+
   debug ("oldstyle negotiation: flags: global 0x%x export 0x%x",
          gflags, eflags);
 
@@ -346,25 +891,58 @@ send_newstyle_option_reply_exportname (struct connection *conn,
   struct fixed_new_option_reply fixed_new_option_reply;
   size_t name_len = strlen (exportname);
   uint32_t len;
+  struct iovec iov[3];
 
   fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
   fixed_new_option_reply.option = htobe32 (option);
   fixed_new_option_reply.reply = htobe32 (reply);
   fixed_new_option_reply.replylen = htobe32 (name_len + sizeof (len));
+  len = htobe32 (name_len);
 
-  if (conn->send (conn,
-                  &fixed_new_option_reply,
-                  sizeof fixed_new_option_reply) == -1) {
-    nbdkit_error ("write: %m");
-    return -1;
-  }
+  iov[0].iov_base = &fixed_new_option_reply;
+  iov[0].iov_len = sizeof fixed_new_option_reply;
+  iov[1].iov_base = &len;
+  iov[1].iov_len = sizeof len;
+  iov[2].iov_base = (char *) exportname;
+  iov[2].iov_len = name_len;
 
-  len = htobe32 (name_len);
-  if (conn->send (conn, &len, sizeof len) == -1) {
+  /* This is never the final reply to an option, so hold it back
+   * until the rest of the replies are sent.
+   */
+  if (conn->sendv (conn, iov, 3, SEND_MORE) == -1) {
     nbdkit_error ("write: %m");
     return -1;
   }
-  if (conn->send (conn, exportname, name_len) == -1) {
+
+  return 0;
+}
+
+static int
+send_newstyle_option_reply_meta_context (struct connection *conn,
+                                         uint32_t option, uint32_t reply,
+                                         uint32_t context_id,
+                                         const char *name)
+{
+  struct fixed_new_option_reply fixed_new_option_reply;
+  struct fixed_new_option_reply_meta_context context;
+  size_t name_len = strlen (name);
+  struct iovec iov[3];
+
+  fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
+  fixed_new_option_reply.option = htobe32 (option);
+  fixed_new_option_reply.reply = htobe32 (reply);
+  fixed_new_option_reply.replylen = htobe32 (sizeof context + name_len);
+  context.context_id = htobe32 (context_id);
+
+  iov[0].iov_base = &fixed_new_option_reply;
+  iov[0].iov_len = sizeof fixed_new_option_reply;
+  iov[1].iov_base = &context;
+  iov[1].iov_len = sizeof context;
+  iov[2].iov_base = (char *) name;
+  iov[2].iov_len = name_len;
+
+  /* Always followed by NBD_REP_ACK. */
+  if (conn->sendv (conn, iov, 3, SEND_MORE) == -1) {
     nbdkit_error ("write: %m");
     return -1;
   }
@@ -372,213 +950,71 @@ send_newstyle_option_reply_exportname (struct connection *conn,
   return 0;
 }
 
+/* Parse the option data of NBD_OPT_LIST_META_CONTEXT or
+ * NBD_OPT_SET_META_CONTEXT.  The only context we know about is
+ * "base:allocation".  Sets *base_allocation if the client asked for
+ * it (or, when listing, asked for all contexts or all "base:"
+ * contexts).  Returns -1 if the data is malformed.
+ */
 static int
-_negotiate_handshake_newstyle_options (struct connection *conn)
+parse_meta_context_queries (uint32_t option, const char *data,
+                            uint32_t optlen, bool *base_allocation)
 {
-  struct new_option new_option;
-  size_t nr_options;
-  uint64_t version;
-  uint32_t option;
-  uint32_t optlen;
-  char data[MAX_OPTION_LENGTH+1];
+  uint32_t pos, len, nr_queries;
 
-  for (nr_options = 0; nr_options < MAX_NR_OPTIONS; ++nr_options) {
-    if (conn->recv (conn, &new_option, sizeof new_option) == -1) {
-      nbdkit_error ("read: %m");
-      return -1;
-    }
+  *base_allocation = false;
 
-    version = be64toh (new_option.version);
-    if (version != NEW_VERSION) {
-      nbdkit_error ("unknown option version %" PRIx64
-                    ", expecting %" PRIx64,
-                    version, NEW_VERSION);
-      return -1;
-    }
+  /* Export name, which we ignore. */
+  if (optlen < sizeof len)
+    return -1;
+  memcpy (&len, data, sizeof len);
+  len = be32toh (len);
+  if (len > optlen - sizeof len)
+    return -1;
+  pos = sizeof len + len;
 
-    /* There is a maximum option length we will accept, regardless
-     * of the option type.
-     */
-    optlen = be32toh (new_option.optlen);
-    if (optlen > MAX_OPTION_LENGTH) {
-      nbdkit_error ("client option data too long (%" PRIu32 ")", optlen);
-      return -1;
-    }
+  if (optlen - pos < sizeof nr_queries)
+    return -1;
+  memcpy (&nr_queries, &data[pos], sizeof nr_queries);
+  nr_queries = be32toh (nr_queries);
+  pos += sizeof nr_queries;
 
-    option = be32toh (new_option.option);
+  if (nr_queries == 0 && option == NBD_OPT_LIST_META_CONTEXT)
+    *base_allocation = true;
 
-    /* In --tls=require / FORCEDTLS mode the only options allowed
-     * before TLS negotiation are NBD_OPT_ABORT and NBD_OPT_STARTTLS.
-     */
-    if (tls == 2 && !conn->using_tls &&
-        !(option == NBD_OPT_ABORT || option == NBD_OPT_STARTTLS)) {
-      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_TLS_REQD))
-        return -1;
-      continue;
-    }
+  while (nr_queries-- > 0) {
+    if (optlen - pos < sizeof len)
+      return -1;
+    memcpy (&len, &data[pos], sizeof len);
+    len = be32toh (len);
+    pos += sizeof len;
+    if (len > optlen - pos)
+      return -1;
 
-    switch (option) {
-    case NBD_OPT_EXPORT_NAME:
-      if (conn->recv (conn, data, optlen) == -1) {
-        nbdkit_error ("read: %m");
-        return -1;
-      }
-      /* Apart from printing it, ignore the export name. */
-      data[optlen] = '\0';
-      debug ("newstyle negotiation: client requested export '%s' (ignored)",
-             data);
-      break;
-
-    case NBD_OPT_ABORT:
-      if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
-        return -1;
-      nbdkit_error ("client sent NBD_OPT_ABORT to abort the connection");
-      return -1;
-
-    case NBD_OPT_LIST:
-      if (optlen != 0) {
-        if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
-            == -1)
-          return -1;
-        if (conn->recv (conn, data, optlen) == -1) {
-          nbdkit_error ("read: %m");
-          return -1;
-        }
-        continue;
-      }
-
-      /* Send back the exportname. */
-      debug ("newstyle negotiation: advertising export '%s'", exportname);
-      if (send_newstyle_option_reply_exportname (conn, option, NBD_REP_SERVER,
-                                                 exportname) == -1)
-        return -1;
-
-      if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
-        return -1;
-      break;
-
-    case NBD_OPT_STARTTLS:
-      if (optlen != 0) {
-        if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
-            == -1)
-          return -1;
-        if (conn->recv (conn, data, optlen) == -1) {
-          nbdkit_error ("read: %m");
-          return -1;
-        }
-        continue;
-      }
-
-      if (tls == 0) {           /* --tls=off (NOTLS mode). */
-#ifdef HAVE_GNUTLS
-#define NO_TLS_REPLY NBD_REP_ERR_POLICY
-#else
-#define NO_TLS_REPLY NBD_REP_ERR_UNSUP
-#endif
-        if (send_newstyle_option_reply (conn, option, NO_TLS_REPLY) == -1)
-          return -1;
-      }
-      else /* --tls=on or --tls=require */ {
-        /* We can't upgrade to TLS twice on the same connection. */
-        if (conn->using_tls) {
-          if (send_newstyle_option_reply (conn, option,
-                                          NBD_REP_ERR_INVALID) == -1)
-            return -1;
-          continue;
-        }
-
-        /* We have to send the (unencrypted) reply before starting
-         * the handshake.
-         */
-        if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
-          return -1;
-
-        /* Upgrade the connection to TLS.  Also performs access control. */
-        if (crypto_negotiate_tls (conn, conn->sockin, conn->sockout) == -1)
-          return -1;
-        conn->using_tls = 1;
-        debug ("using TLS on this connection");
-      }
-      break;
-
-    default:
-      /* Unknown option. */
-      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_UNSUP) == -1)
-        return -1;
-      if (conn->recv (conn, data, optlen) == -1) {
-        nbdkit_error ("read: %m");
-        return -1;
-      }
-    }
-
-    /* Note, since it's not very clear from the protocol doc, that the
-     * client must send NBD_OPT_EXPORT_NAME last, and that ends option
-     * negotiation.
-     */
-    if (option == NBD_OPT_EXPORT_NAME)
-      break;
-  }
-
-  if (nr_options >= MAX_NR_OPTIONS) {
-    nbdkit_error ("client exceeded maximum number of options (%d)",
-                  MAX_NR_OPTIONS);
-    return -1;
-  }
-
-  /* In --tls=require / FORCEDTLS mode, we must have upgraded to TLS
-   * by the time we finish option negotiation.  If not, give up.
-   */
-  if (tls == 2 && !conn->using_tls) {
-    nbdkit_error ("non-TLS client tried to connect in --tls=require mode");
-    return -1;
+    debug ("newstyle negotiation: client queried meta context '%.*s'",
+           (int) len, &data[pos]);
+    if ((len == 15 && memcmp (&data[pos], "base:allocation", 15) == 0) ||
+        (len == 5 && memcmp (&data[pos], "base:", 5) == 0 &&
+         option == NBD_OPT_LIST_META_CONTEXT))
+      *base_allocation = true;
+    pos += len;
   }
 
-  return 0;
+  return pos == optlen ? 0 : -1;
 }
 
+/* Ask the plugin about the export, setting the connection fields
+ * and returning the export flags in *eflags_ret.  With NBD_OPT_INFO
+ * this may be called several times on the same connection.
+ */
 static int
-_negotiate_handshake_newstyle (struct connection *conn)
+get_newstyle_export_info (struct connection *conn, uint16_t *eflags_ret)
 {
-  struct new_handshake handshake;
-  uint16_t gflags;
-  uint32_t cflags;
-  struct new_handshake_finish handshake_finish;
   int64_t r;
   uint64_t exportsize;
   uint16_t eflags;
   int fl;
 
-  gflags = NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES;
-
-  debug ("newstyle negotiation: flags: global 0x%x", gflags);
-
-  memcpy (handshake.nbdmagic, "NBDMAGIC", 8);
-  handshake.version = htobe64 (NEW_VERSION);
-  handshake.gflags = htobe16 (gflags);
-
-  if (conn->send (conn, &handshake, sizeof handshake) == -1) {
-    nbdkit_error ("write: %m");
-    return -1;
-  }
-
-  /* Client now sends us its 32 bit flags word ... */
-  if (conn->recv (conn, &cflags, sizeof cflags) == -1) {
-    nbdkit_error ("read: %m");
-    return -1;
-  }
-  cflags = be32toh (cflags);
-  /* ... which we check for accuracy. */
-  debug ("newstyle negotiation: client flags: 0x%x", cflags);
-  if (cflags & ~gflags) {
-    nbdkit_error ("client requested unknown flags 0x%x", cflags);
-    return -1;
-  }
-
-  /* Receive newstyle options. */
-  if (_negotiate_handshake_newstyle_options (conn) == -1)
-    return -1;
-
-  /* Finish the newstyle handshake. */
   r = plugin_get_size (conn);
   if (r == -1)
     return -1;
@@ -601,16 +1037,32 @@ _negotiate_handshake_newstyle (struct connection *conn)
   }
   if (!conn->readonly) {
     eflags |= NBD_FLAG_SEND_WRITE_ZEROES;
+
+    fl = plugin_can_fast_zero (conn);
+    if (fl == -1)
+      return -1;
+    if (fl) {
+      eflags |= NBD_FLAG_SEND_FAST_ZERO;
+      conn->can_fast_zero = 1;
+    }
   }
 
   fl = plugin_can_flush (conn);
   if (fl == -1)
     return -1;
   if (fl) {
-    eflags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+    eflags |= NBD_FLAG_SEND_FLUSH;
     conn->can_flush = 1;
   }
 
+  fl = plugin_can_fua (conn);
+  if (fl == -1)
+    return -1;
+  if (fl != NBDKIT_FUA_NONE) {
+    eflags |= NBD_FLAG_SEND_FUA;
+    conn->can_fua = fl;
+  }
+
   fl = plugin_is_rotational (conn);
   if (fl == -1)
     return -1;
@@ -627,352 +1079,1902 @@ _negotiate_handshake_newstyle (struct connection *conn)
     conn->can_trim = 1;
   }
 
-  debug ("newstyle negotiation: flags: export 0x%x", eflags);
-
-  memset (&handshake_finish, 0, sizeof handshake_finish);
-  handshake_finish.exportsize = htobe64 (exportsize);
-  handshake_finish.eflags = htobe16 (eflags);
+  /* Plugins without .cache read the data, which has the same
+   * effect on the backing store.
+   */
+  eflags |= NBD_FLAG_SEND_CACHE;
 
-  if (conn->send (conn,
-                  &handshake_finish,
-                  (cflags & NBD_FLAG_NO_ZEROES)
-                  ? offsetof (struct new_handshake_finish, zeroes)
-                  : sizeof handshake_finish) == -1) {
-    nbdkit_error ("write: %m");
+  fl = plugin_can_multi_conn (conn);
+  if (fl == -1)
     return -1;
+  if (fl) {
+    eflags |= NBD_FLAG_CAN_MULTI_CONN;
+    /* A flush on any connection covers writes on all of them. */
+    flush_state_free (conn->flush);
+    conn->flush = flush_state_shared ();
   }
 
+  if (conn->structured_replies)
+    eflags |= NBD_FLAG_SEND_DF;
+
+  if (conn->meta_context_base_allocation) {
+    fl = plugin_can_extents (conn);
+    if (fl == -1)
+      return -1;
+    conn->can_extents = fl;
+  }
+
+  debug ("newstyle negotiation: flags: export 0x%x", eflags);
+
+  *eflags_ret = eflags;
   return 0;
 }
 
+static inline bool
+is_power_of_2 (uint32_t v)
+{
+  return v != 0 && (v & (v - 1)) == 0;
+}
+
+/* Get the block size constraints from the plugin, using defaults for
+ * any which it leaves as 0.
+ */
 static int
-negotiate_handshake (struct connection *conn)
+get_block_size (struct connection *conn,
+                uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
 {
-  int r;
+  if (plugin_block_size (conn, minimum, preferred, maximum) == -1)
+    return -1;
 
-  plugin_lock_request (conn);
-  if (!newstyle)
-    r = _negotiate_handshake_oldstyle (conn);
-  else
-    r = _negotiate_handshake_newstyle (conn);
-  plugin_unlock_request (conn);
+  if (*minimum == 0)
+    *minimum = 1;
+  if (*preferred == 0)
+    *preferred = *minimum > DEFAULT_PREFERRED_BLOCK_SIZE
+      ? *minimum : DEFAULT_PREFERRED_BLOCK_SIZE;
+  if (*maximum == 0 || *maximum > MAX_REQUEST_SIZE)
+    *maximum = MAX_REQUEST_SIZE;
+
+  if (!is_power_of_2 (*minimum) || *minimum > 65536 ||
+      !is_power_of_2 (*preferred) || *preferred < *minimum ||
+      *maximum < *minimum || *maximum % *minimum != 0) {
+    nbdkit_error (".block_size function returned invalid values "
+                  "(minimum %" PRIu32 ", preferred %" PRIu32
+                  ", maximum %" PRIu32 ")",
+                  *minimum, *preferred, *maximum);
+    return -1;
+  }
 
-  return r;
+  debug ("newstyle negotiation: block size: "
+         "minimum %" PRIu32 " preferred %" PRIu32 " maximum %" PRIu32,
+         *minimum, *preferred, *maximum);
+  return 0;
 }
 
+/* Send one NBD_REP_INFO reply.  'info' points to the payload, which
+ * starts with the NBD_INFO_* type.
+ */
 static int
-valid_range (struct connection *conn, uint64_t offset, uint32_t count)
+send_newstyle_option_reply_info (struct connection *conn, uint32_t option,
+                                 const void *info, size_t len)
 {
-  uint64_t exportsize = conn->exportsize;
+  struct fixed_new_option_reply fixed_new_option_reply;
+  struct iovec iov[2];
+
+  fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
+  fixed_new_option_reply.option = htobe32 (option);
+  fixed_new_option_reply.reply = htobe32 (NBD_REP_INFO);
+  fixed_new_option_reply.replylen = htobe32 (len);
+
+  iov[0].iov_base = &fixed_new_option_reply;
+  iov[0].iov_len = sizeof fixed_new_option_reply;
+  iov[1].iov_base = (void *) info;
+  iov[1].iov_len = len;
+
+  /* Always followed by NBD_REP_ACK. */
+  if (conn->sendv (conn, iov, 2, SEND_MORE) == -1) {
+    nbdkit_error ("write: %m");
+    return -1;
+  }
 
-  return count > 0 && offset <= exportsize && offset + count <= exportsize;
+  return 0;
 }
 
+/* Parse the option data of NBD_OPT_INFO or NBD_OPT_GO.  The export
+ * name is ignored.  Sets *block_size if the client asked for
+ * NBD_INFO_BLOCK_SIZE.  Returns -1 if the data is malformed.
+ */
 static int
-validate_request (struct connection *conn,
-                  uint32_t cmd, uint32_t flags, uint64_t offset, uint32_t count,
-                  uint32_t *error)
+parse_info_requests (const char *data, uint32_t optlen, bool *block_size)
 {
-  int r;
+  uint32_t pos, len;
+  uint16_t nr_infos, info;
 
-  /* Validate cmd, offset, count. */
-  switch (cmd) {
-  case NBD_CMD_READ:
-  case NBD_CMD_WRITE:
-  case NBD_CMD_TRIM:
-  case NBD_CMD_WRITE_ZEROES:
-    r = valid_range (conn, offset, count);
-    if (r == -1)
-      return -1;
-    if (r == 0) {
-      /* XXX Allow writes to extend the disk? */
-      nbdkit_error ("invalid request: offset and length are out of range");
-      *error = EIO;
-      return 0;
-    }
-    break;
+  *block_size = false;
 
-  case NBD_CMD_FLUSH:
-    if (offset != 0 || count != 0) {
-      nbdkit_error ("invalid flush request: expecting offset and length == 0");
-      *error = EINVAL;
-      return 0;
-    }
-    break;
+  if (optlen < sizeof len)
+    return -1;
+  memcpy (&len, data, sizeof len);
+  len = be32toh (len);
+  if (len > optlen - sizeof len)
+    return -1;
+  debug ("newstyle negotiation: client requested export '%.*s' (ignored)",
+         (int) len, &data[sizeof len]);
+  pos = sizeof len + len;
 
-  default:
-    nbdkit_error ("invalid request: unknown command (%" PRIu32 ") ignored",
-                  cmd);
-    *error = EINVAL;
-    return 0;
-  }
+  if (optlen - pos < sizeof nr_infos)
+    return -1;
+  memcpy (&nr_infos, &data[pos], sizeof nr_infos);
+  nr_infos = be16toh (nr_infos);
+  pos += sizeof nr_infos;
+  if (optlen - pos != nr_infos * sizeof info)
+    return -1;
 
-  /* Validate flags */
-  if (flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
-    nbdkit_error ("invalid request: unknown flag (0x%x)", flags);
-    *error = EINVAL;
-    return 0;
-  }
-  if ((flags & NBD_CMD_FLAG_NO_HOLE) &&
-      cmd != NBD_CMD_WRITE_ZEROES) {
-    nbdkit_error ("invalid request: NO_HOLE flag needs WRITE_ZEROES request");
-    *error = EINVAL;
-    return 0;
+  while (nr_infos-- > 0) {
+    memcpy (&info, &data[pos], sizeof info);
+    info = be16toh (info);
+    pos += sizeof info;
+    if (info == NBD_INFO_BLOCK_SIZE)
+      *block_size = true;
   }
 
-  /* Refuse over-large read and write requests. */
-  if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
-      count > MAX_REQUEST_SIZE) {
-    nbdkit_error ("invalid request: data request is too large (%" PRIu32
-                  " > %d)", count, MAX_REQUEST_SIZE);
-    *error = ENOMEM;
-    return 0;
+  return 0;
+}
+
+/* Receive and process one option.  Returns -1 on error, 0 if option
+ * negotiation continues, or 1 if it has finished.
+ */
+static int
+_negotiate_handshake_newstyle_option (struct connection *conn,
+                                      uint32_t cflags)
+{
+  struct new_option new_option;
+  uint64_t version;
+  uint32_t option;
+  uint32_t optlen;
+  char data[MAX_OPTION_LENGTH+1];
+  bool base_allocation, block_size, go = false;
+  uint16_t eflags;
+  struct new_handshake_finish handshake_finish;
+  struct fixed_new_option_reply_info_export export;
+  struct fixed_new_option_reply_info_block_size block_size_info;
+
+  if (conn->recv (conn, &new_option, sizeof new_option) == -1) {
+    nbdkit_error ("read: %m");
+    return -1;
   }
 
-  /* Readonly connection? */
-  if (conn->readonly &&
-      (cmd == NBD_CMD_WRITE || cmd == NBD_CMD_FLUSH ||
-       cmd == NBD_CMD_TRIM || cmd == NBD_CMD_WRITE_ZEROES)) {
-    nbdkit_error ("invalid request: write request on readonly connection");
-    *error = EROFS;
-    return 0;
+  version = be64toh (new_option.version);
+  if (version != NEW_VERSION) {
+    nbdkit_error ("unknown option version %" PRIx64
+                  ", expecting %" PRIx64,
+                  version, NEW_VERSION);
+    return -1;
   }
 
-  /* Flush allowed? */
-  if (!conn->can_flush && cmd == NBD_CMD_FLUSH) {
-    nbdkit_error ("invalid request: flush operation not supported");
-    *error = EINVAL;
-    return 0;
+  /* There is a maximum option length we will accept, regardless
+   * of the option type.
+   */
+  optlen = be32toh (new_option.optlen);
+  if (optlen > MAX_OPTION_LENGTH) {
+    nbdkit_error ("client option data too long (%" PRIu32 ")", optlen);
+    return -1;
   }
 
-  /* Trim allowed? */
-  if (!conn->can_trim && cmd == NBD_CMD_TRIM) {
-    nbdkit_error ("invalid request: trim operation not supported");
-    *error = EINVAL;
+  option = be32toh (new_option.option);
+
+  /* In --tls=require / FORCEDTLS mode the only options allowed
+   * before TLS negotiation are NBD_OPT_ABORT and NBD_OPT_STARTTLS.
+   */
+  if (tls == 2 && !conn->using_tls &&
+      !(option == NBD_OPT_ABORT || option == NBD_OPT_STARTTLS)) {
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_TLS_REQD))
+      return -1;
+    if (conn->recv (conn, data, optlen) == -1) {
+      nbdkit_error ("read: %m");
+      return -1;
+    }
     return 0;
   }
 
-  return 1;                     /* Commands validates. */
-}
+  switch (option) {
+  case NBD_OPT_EXPORT_NAME:
+    if (conn->recv (conn, data, optlen) == -1) {
+      nbdkit_error ("read: %m");
+      return -1;
+    }
+    /* Apart from printing it, ignore the export name. */
+    data[optlen] = '\0';
+    debug ("newstyle negotiation: client requested export '%s' (ignored)",
+           data);
 
-/* Grab the appropriate error value.
- */
-static int
-get_error (struct connection *conn)
-{
-  int ret = threadlocal_get_error ();
+    /* Finish the newstyle handshake. */
+    if (get_newstyle_export_info (conn, &eflags) == -1)
+      return -1;
 
-  if (!ret && plugin_errno_is_preserved ())
-    ret = errno;
-  return ret ? ret : EIO;
-}
+    memset (&handshake_finish, 0, sizeof handshake_finish);
+    handshake_finish.exportsize = htobe64 (conn->exportsize);
+    handshake_finish.eflags = htobe16 (eflags);
 
-/* This is called with the request lock held to actually execute the
- * request (by calling the plugin).  Note that the request fields have
- * been validated already in 'validate_request' so we don't have to
- * check them again.  'buf' is either the data to be written or the
- * data to be returned, and points to a buffer of size 'count' bytes.
- *
- * Only returns -1 if there is a fatal error and the connection cannot
- * continue.
- *
- * On read/write errors, sets *error appropriately and returns 0.
- */
-static int
-_handle_request (struct connection *conn,
-                 uint32_t cmd, uint32_t flags, uint64_t offset, uint32_t count,
-                 void *buf,
-                 uint32_t *error)
-{
-  bool flush_after_command;
-  int r;
+    if (conn->send (conn,
+                    &handshake_finish,
+                    (cflags & NBD_FLAG_NO_ZEROES)
+                    ? offsetof (struct new_handshake_finish, zeroes)
+                    : sizeof handshake_finish) == -1) {
+      nbdkit_error ("write: %m");
+      return -1;
+    }
+    break;
 
-  /* Flush after command performed? */
-  flush_after_command = (flags & NBD_CMD_FLAG_FUA) != 0;
-  if (!conn->can_flush || conn->readonly)
-    flush_after_command = false;
+  case NBD_OPT_ABORT:
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
+    nbdkit_error ("client sent NBD_OPT_ABORT to abort the connection");
+    return -1;
 
-  /* The plugin should call nbdkit_set_error() to request a particular
-     error, otherwise we fallback to errno or EIO. */
-  threadlocal_set_error (0);
+  case NBD_OPT_LIST:
+    if (optlen != 0) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
+      if (conn->recv (conn, data, optlen) == -1) {
+        nbdkit_error ("read: %m");
+        return -1;
+      }
+      return 0;
+    }
 
-  switch (cmd) {
-  case NBD_CMD_READ:
-    r = plugin_pread (conn, buf, count, offset);
-    if (r == -1) {
-      *error = get_error (conn);
+    /* Send back the exportname. */
+    debug ("newstyle negotiation: advertising export '%s'", exportname);
+    if (send_newstyle_option_reply_exportname (conn, option, NBD_REP_SERVER,
+                                               exportname) == -1)
+      return -1;
+
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
+    break;
+
+  case NBD_OPT_STARTTLS:
+    if (optlen != 0) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
+      if (conn->recv (conn, data, optlen) == -1) {
+        nbdkit_error ("read: %m");
+        return -1;
+      }
       return 0;
     }
+
+    if (tls == 0) {           /* --tls=off (NOTLS mode). */
+#ifdef HAVE_GNUTLS
+#define NO_TLS_REPLY NBD_REP_ERR_POLICY
+#else
+#define NO_TLS_REPLY NBD_REP_ERR_UNSUP
+#endif
+      if (send_newstyle_option_reply (conn, option, NO_TLS_REPLY) == -1)
+        return -1;
+    }
+    else /* --tls=on or --tls=require */ {
+      /* We can't upgrade to TLS twice on the same connection. */
+      if (conn->using_tls) {
+        if (send_newstyle_option_reply (conn, option,
+                                        NBD_REP_ERR_INVALID) == -1)
+          return -1;
+        return 0;
+      }
+
+      /* We have to send the (unencrypted) reply before starting
+       * the handshake.
+       */
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+        return -1;
+
+      /* Upgrade the connection to TLS.  Also performs access control. */
+      if (crypto_negotiate_tls (conn, conn->sockin, conn->sockout) == -1)
+        return -1;
+      conn->using_tls = 1;
+      debug ("using TLS on this connection");
+    }
     break;
 
-  case NBD_CMD_WRITE:
-    r = plugin_pwrite (conn, buf, count, offset);
-    if (r == -1) {
-      *error = get_error (conn);
+  case NBD_OPT_STRUCTURED_REPLY:
+    if (optlen != 0) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
+      if (conn->recv (conn, data, optlen) == -1) {
+        nbdkit_error ("read: %m");
+        return -1;
+      }
       return 0;
     }
+
+    debug ("newstyle negotiation: client requested structured replies");
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
+    conn->structured_replies = 1;
     break;
 
-  case NBD_CMD_FLUSH:
-    r = plugin_flush (conn);
-    if (r == -1) {
-      *error = get_error (conn);
+  case NBD_OPT_EXTENDED_HEADERS:
+    if (optlen != 0) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
+      if (conn->recv (conn, data, optlen) == -1) {
+        nbdkit_error ("read: %m");
+        return -1;
+      }
       return 0;
     }
+
+    /* Extended headers imply structured replies. */
+    debug ("newstyle negotiation: client requested extended headers");
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
+    conn->extended_headers = 1;
+    conn->structured_replies = 1;
     break;
 
-  case NBD_CMD_TRIM:
-    r = plugin_trim (conn, count, offset);
-    if (r == -1) {
-      *error = get_error (conn);
+  case NBD_OPT_INFO:
+  case NBD_OPT_GO:
+    if (conn->recv (conn, data, optlen) == -1) {
+      nbdkit_error ("read: %m");
+      return -1;
+    }
+    if (parse_info_requests (data, optlen, &block_size) == -1) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
+      return 0;
+    }
+
+    /* All the NBD_REP_INFO replies and the final NBD_REP_ACK are
+     * corked so they leave together.
+     */
+    if (get_newstyle_export_info (conn, &eflags) == -1)
+      return -1;
+    export.info = htobe16 (NBD_INFO_EXPORT);
+    export.exportsize = htobe64 (conn->exportsize);
+    export.eflags = htobe16 (eflags);
+    if (send_newstyle_option_reply_info (conn, option,
+                                         &export, sizeof export) == -1)
+      return -1;
+
+    if (block_size) {
+      uint32_t minimum, preferred, maximum;
+
+      if (get_block_size (conn, &minimum, &preferred, &maximum) == -1)
+        return -1;
+      block_size_info.info = htobe16 (NBD_INFO_BLOCK_SIZE);
+      block_size_info.minimum = htobe32 (minimum);
+      block_size_info.preferred = htobe32 (preferred);
+      block_size_info.maximum = htobe32 (maximum);
+      if (send_newstyle_option_reply_info (conn, option,
+                                           &block_size_info,
+                                           sizeof block_size_info) == -1)
+        return -1;
+    }
+
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
+
+    if (option == NBD_OPT_GO)
+      go = true;
+    break;
+
+  case NBD_OPT_LIST_META_CONTEXT:
+  case NBD_OPT_SET_META_CONTEXT:
+    if (conn->recv (conn, data, optlen) == -1) {
+      nbdkit_error ("read: %m");
+      return -1;
+    }
+
+    /* Block status replies are structured, so meta contexts can
+     * only be used once structured replies have been negotiated.
+     */
+    if (!conn->structured_replies ||
+        parse_meta_context_queries (option, data, optlen,
+                                    &base_allocation) == -1) {
+      if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_INVALID)
+          == -1)
+        return -1;
       return 0;
     }
+
+    if (base_allocation &&
+        send_newstyle_option_reply_meta_context (conn, option,
+                                                 NBD_REP_META_CONTEXT,
+                                                 BASE_ALLOCATION_ID,
+                                                 "base:allocation") == -1)
+      return -1;
+    if (option == NBD_OPT_SET_META_CONTEXT)
+      conn->meta_context_base_allocation = base_allocation;
+
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ACK) == -1)
+      return -1;
     break;
 
+  default:
+    /* Unknown option. */
+    if (send_newstyle_option_reply (conn, option, NBD_REP_ERR_UNSUP) == -1)
+      return -1;
+    if (conn->recv (conn, data, optlen) == -1) {
+      nbdkit_error ("read: %m");
+      return -1;
+    }
+  }
+
+  /* Note, since it's not very clear from the protocol doc, that the
+   * client must send NBD_OPT_EXPORT_NAME last, and that ends option
+   * negotiation.  A successful NBD_OPT_GO also ends it.
+   */
+  if (option == NBD_OPT_EXPORT_NAME || go)
+    return 1;
+  return 0;
+}
+
+/* Receive one option, and check the result once option negotiation
+ * has finished.  Returns -1 on error, 0 if option negotiation
+ * continues, or 1 if it has finished.
+ */
+static int
+_negotiate_handshake_newstyle_options (struct connection *conn)
+{
+  int r;
+
+  r = _negotiate_handshake_newstyle_option (conn, conn->cflags);
+  if (r == -1)
+    return -1;
+
+  conn->nr_options++;
+  if (r == 0 && conn->nr_options >= MAX_NR_OPTIONS) {
+    nbdkit_error ("client exceeded maximum number of options (%d)",
+                  MAX_NR_OPTIONS);
+    return -1;
+  }
+
+  /* In --tls=require / FORCEDTLS mode, we must have upgraded to TLS
+   * by the time we finish option negotiation.  If not, give up.
+   */
+  if (r == 1 && tls == 2 && !conn->using_tls) {
+    nbdkit_error ("non-TLS client tried to connect in --tls=require mode");
+    return -1;
+  }
+
+  return r;
+}
+
+#define NEWSTYLE_GFLAGS (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES)
+
+static int
+_negotiate_handshake_newstyle_greeting (struct connection *conn)
+{
+  struct new_handshake handshake;
+  uint16_t gflags;
+
+  gflags = NEWSTYLE_GFLAGS;
+
+  debug ("newstyle negotiation: flags: global 0x%x", gflags);
+
+  memcpy (handshake.nbdmagic, "NBDMAGIC", 8);
+  handshake.version = htobe64 (NEW_VERSION);
+  handshake.gflags = htobe16 (gflags);
+
+  if (conn->send (conn, &handshake, sizeof handshake) == -1) {
+    nbdkit_error ("write: %m");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+_negotiate_handshake_newstyle_flags (struct connection *conn)
+{
+  uint32_t cflags;
+
+  /* Client now sends us its 32 bit flags word ... */
+  if (conn->recv (conn, &cflags, sizeof cflags) == -1) {
+    nbdkit_error ("read: %m");
+    return -1;
+  }
+  cflags = be32toh (cflags);
+  /* ... which we check for accuracy. */
+  debug ("newstyle negotiation: client flags: 0x%x", cflags);
+  if (cflags & ~NEWSTYLE_GFLAGS) {
+    nbdkit_error ("client requested unknown flags 0x%x", cflags);
+    return -1;
+  }
+  conn->cflags = cflags;
+
+  return 0;
+}
+
+static int
+_negotiate_handshake_newstyle (struct connection *conn)
+{
+  int r;
+
+  if (_negotiate_handshake_newstyle_greeting (conn) == -1 ||
+      _negotiate_handshake_newstyle_flags (conn) == -1)
+    return -1;
+
+  /* Receive newstyle options. */
+  do
+    r = _negotiate_handshake_newstyle_options (conn);
+  while (r == 0);
+
+  return r == -1 ? -1 : 0;
+}
+
+static int
+negotiate_handshake (struct connection *conn)
+{
+  int r;
+
+  plugin_lock_request (conn, NULL);
+  if (!newstyle)
+    r = _negotiate_handshake_oldstyle (conn);
+  else
+    r = _negotiate_handshake_newstyle (conn);
+  plugin_unlock_request (conn, NULL);
+
+  return r;
+}
+
+static int
+valid_range (struct connection *conn, uint64_t offset, uint64_t count)
+{
+  uint64_t exportsize = conn->exportsize;
+
+  return count > 0 && offset <= exportsize && count <= exportsize - offset;
+}
+
+static int
+validate_request (struct connection *conn,
+                  uint32_t cmd, uint32_t flags, uint64_t offset, uint64_t count,
+                  uint32_t *error)
+{
+  int r;
+
+  /* Validate cmd, offset, count. */
+  switch (cmd) {
+  case NBD_CMD_READ:
+  case NBD_CMD_WRITE:
+  case NBD_CMD_TRIM:
   case NBD_CMD_WRITE_ZEROES:
-    r = plugin_zero (conn, count, offset, !(flags & NBD_CMD_FLAG_NO_HOLE));
-    if (r == -1) {
-      *error = get_error (conn);
+  case NBD_CMD_CACHE:
+  case NBD_CMD_BLOCK_STATUS:
+    r = valid_range (conn, offset, count);
+    if (r == -1)
+      return -1;
+    if (r == 0) {
+      /* XXX Allow writes to extend the disk? */
+      nbdkit_error ("invalid request: offset and length are out of range");
+      *error = EIO;
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_FLUSH:
+    if (offset != 0 || count != 0) {
+      nbdkit_error ("invalid flush request: expecting offset and length == 0");
+      *error = EINVAL;
       return 0;
     }
     break;
 
   default:
-    abort ();
+    nbdkit_error ("invalid request: unknown command (%" PRIu32 ") ignored",
+                  cmd);
+    *error = EINVAL;
+    return 0;
+  }
+
+  /* Validate flags */
+  if (flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE | NBD_CMD_FLAG_DF |
+                NBD_CMD_FLAG_REQ_ONE | NBD_CMD_FLAG_FAST_ZERO)) {
+    nbdkit_error ("invalid request: unknown flag (0x%x)", flags);
+    *error = EINVAL;
+    return 0;
+  }
+  if ((flags & NBD_CMD_FLAG_NO_HOLE) &&
+      cmd != NBD_CMD_WRITE_ZEROES) {
+    nbdkit_error ("invalid request: NO_HOLE flag needs WRITE_ZEROES request");
+    *error = EINVAL;
+    return 0;
+  }
+  if ((flags & NBD_CMD_FLAG_DF) &&
+      (cmd != NBD_CMD_READ || !conn->structured_replies)) {
+    nbdkit_error ("invalid request: DF flag needs READ request "
+                  "and structured replies");
+    *error = EINVAL;
+    return 0;
+  }
+  if ((flags & NBD_CMD_FLAG_REQ_ONE) &&
+      cmd != NBD_CMD_BLOCK_STATUS) {
+    nbdkit_error ("invalid request: REQ_ONE flag needs BLOCK_STATUS request");
+    *error = EINVAL;
+    return 0;
+  }
+  if ((flags & NBD_CMD_FLAG_FAST_ZERO) &&
+      (cmd != NBD_CMD_WRITE_ZEROES || !conn->can_fast_zero)) {
+    nbdkit_error ("invalid request: FAST_ZERO flag needs WRITE_ZEROES request "
+                  "and fast zero support");
+    *error = EINVAL;
+    return 0;
+  }
+
+  /* Refuse over-large read and write requests. */
+  if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
+      count > MAX_REQUEST_SIZE) {
+    nbdkit_error ("invalid request: data request is too large (%" PRIu64
+                  " > %d)", count, MAX_REQUEST_SIZE);
+    *error = ENOMEM;
+    return 0;
+  }
+
+  /* Readonly connection? */
+  if (conn->readonly &&
+      (cmd == NBD_CMD_WRITE || cmd == NBD_CMD_FLUSH ||
+       cmd == NBD_CMD_TRIM || cmd == NBD_CMD_WRITE_ZEROES)) {
+    nbdkit_error ("invalid request: write request on readonly connection");
+    *error = EROFS;
+    return 0;
+  }
+
+  /* Flush allowed? */
+  if (!conn->can_flush && cmd == NBD_CMD_FLUSH) {
+    nbdkit_error ("invalid request: flush operation not supported");
+    *error = EINVAL;
+    return 0;
+  }
+
+  /* Trim allowed? */
+  if (!conn->can_trim && cmd == NBD_CMD_TRIM) {
+    nbdkit_error ("invalid request: trim operation not supported");
+    *error = EINVAL;
+    return 0;
+  }
+
+  /* Block status allowed? */
+  if (!conn->meta_context_base_allocation && cmd == NBD_CMD_BLOCK_STATUS) {
+    nbdkit_error ("invalid request: "
+                  "block status requested without selecting a meta context");
+    *error = EINVAL;
+    return 0;
+  }
+
+  return 1;                     /* Commands validates. */
+}
+
+/* Grab the appropriate error value.
+ */
+static int
+get_error (struct connection *conn)
+{
+  int ret = threadlocal_get_error ();
+
+  if (!ret && plugin_errno_is_preserved ())
+    ret = errno;
+  return ret ? ret : EIO;
+}
+
+/* This is called with the request lock held to actually execute the
+ * request (by calling the plugin).  Note that the request fields have
+ * been validated already in 'validate_request' so we don't have to
+ * check them again.  'buf' is either the data to be written or the
+ * data to be returned, and points to a buffer of size 'count' bytes.
+ *
+ * Only returns -1 if there is a fatal error and the connection cannot
+ * continue.
+ *
+ * On read/write errors, sets *error appropriately and returns 0.
+ */
+static int
+_handle_request (struct connection *conn,
+                 uint32_t cmd, uint32_t flags, uint64_t offset, uint64_t count,
+                 void *buf, struct nbdkit_extents *extents, uint32_t *error)
+{
+  bool flush_after_command;
+  uint32_t f = 0;
+  int r;
+
+  /* Either pass FUA down to the plugin, or emulate it by flushing
+   * after the command has been performed.
+   */
+  flush_after_command = false;
+  if ((flags & NBD_CMD_FLAG_FUA) && !conn->readonly) {
+    if (conn->can_fua == NBDKIT_FUA_NATIVE)
+      f |= NBDKIT_FLAG_FUA;
+    else if (conn->can_fua == NBDKIT_FUA_EMULATE)
+      flush_after_command = true;
+  }
+
+  /* The plugin should call nbdkit_set_error() to request a particular
+     error, otherwise we fallback to errno or EIO. */
+  threadlocal_set_error (0);
+
+  switch (cmd) {
+  case NBD_CMD_READ:
+    r = plugin_pread (conn, buf, count, offset);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_WRITE:
+    r = plugin_pwrite (conn, buf, count, offset, f);
+    flush_mark_dirty (conn->flush);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_FLUSH:
+    r = flush_wait (conn->flush, conn);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_TRIM:
+    r = plugin_trim (conn, count, offset, f);
+    flush_mark_dirty (conn->flush);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_WRITE_ZEROES:
+    if (!(flags & NBD_CMD_FLAG_NO_HOLE))
+      f |= NBDKIT_FLAG_MAY_TRIM;
+    if (flags & NBD_CMD_FLAG_FAST_ZERO)
+      f |= NBDKIT_FLAG_FAST_ZERO;
+    r = plugin_zero (conn, count, offset, f);
+    flush_mark_dirty (conn->flush);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_CACHE:
+    r = plugin_cache (conn, count, offset);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  case NBD_CMD_BLOCK_STATUS:
+    if (conn->can_extents)
+      r = plugin_extents (conn, count, offset,
+                          (flags & NBD_CMD_FLAG_REQ_ONE)
+                          ? NBDKIT_FLAG_REQ_ONE : 0,
+                          extents);
+    else
+      /* Report the whole range as allocated data. */
+      r = nbdkit_add_extent (extents, offset, count, 0);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+    break;
+
+  default:
+    abort ();
+  }
+
+  if (flush_after_command) {
+    r = flush_wait (conn->flush, conn);
+    if (r == -1) {
+      *error = get_error (conn);
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+static int
+handle_request (struct connection *conn,
+                uint32_t cmd, uint32_t flags, uint64_t offset, uint64_t count,
+                void *buf, struct nbdkit_extents *extents, uint32_t *error)
+{
+  struct request_range range = { .offset = offset, .count = count };
+  int r;
+
+  switch (cmd) {
+  case NBD_CMD_READ:
+  case NBD_CMD_CACHE:
+    range.read = true;
+    break;
+  case NBD_CMD_WRITE:
+  case NBD_CMD_TRIM:
+  case NBD_CMD_WRITE_ZEROES:
+    range.write = true;
+    break;
+  case NBD_CMD_FLUSH:
+    /* Order flushes against all writes, but let concurrent flushes
+     * proceed together so that they can be grouped.
+     */
+    range.count = UINT64_MAX;
+    break;
+  }
+
+  plugin_lock_request (conn, &range);
+  r = _handle_request (conn, cmd, flags, offset, count, buf, extents, error);
+  plugin_unlock_request (conn, &range);
+
+  return r;
+}
+
+/* This must go through conn->recv rather than reading the socket
+ * directly, since TLS and io_uring connections may have already
+ * buffered part of the data.
+ */
+static void
+skip_over_write_buffer (struct connection *conn, uint64_t count)
+{
+  char buf[BUFSIZ];
+  size_t n;
+  int r;
+
+  while (count > 0) {
+    n = count > BUFSIZ ? BUFSIZ : count;
+    r = conn->recv (conn, buf, n);
+    if (r == -1) {
+      nbdkit_error ("skipping write buffer: %m");
+      return;
+    }
+    if (r == 0)
+      return;
+    count -= n;
+  }
+}
+
+/* Convert a system errno to an NBD_E* error code.  NBD_ENOTSUP is
+ * only sent in reply to a fast zero request, since older clients
+ * don't know it.
+ */
+static int
+nbd_errno (int error, uint32_t flags)
+{
+  switch (error) {
+  case 0:
+    return NBD_SUCCESS;
+  case EROFS:
+  case EPERM:
+    return NBD_EPERM;
+  case EIO:
+    return NBD_EIO;
+  case ENOMEM:
+    return NBD_ENOMEM;
+#ifdef EDQUOT
+  case EDQUOT:
+#endif
+  case EFBIG:
+  case ENOSPC:
+    return NBD_ENOSPC;
+#ifdef ESHUTDOWN
+  case ESHUTDOWN:
+    return NBD_ESHUTDOWN;
+#endif
+  case ENOTSUP:
+#if ENOTSUP != EOPNOTSUPP
+  case EOPNOTSUPP:
+#endif
+    if (flags & NBD_CMD_FLAG_FAST_ZERO)
+      return NBD_ENOTSUP;
+    return NBD_EINVAL;
+  case EINVAL:
+  default:
+    return NBD_EINVAL;
+  }
+}
+
+/* Number of structured reply chunks gathered into each call to
+ * conn->sendv.
+ */
+#define CHUNKS_PER_SEND 64
+
+/* Reads are checked for zeroes in blocks of this size (aligned to
+ * the export), and runs of zero blocks are sent as holes.
+ */
+#define HOLE_GRANULARITY 4096
+
+/* Returns true if the buffer contains only zero bytes. */
+static bool
+is_zero (const char *buf, size_t size)
+{
+  size_t i, n = size < 16 ? size : 16;
+
+  for (i = 0; i < n; ++i)
+    if (buf[i])
+      return false;
+
+  /* The first 16 bytes are zero, so if every byte is the same as the
+   * byte 16 places before it, the whole buffer is zero.
+   */
+  return size <= 16 || memcmp (buf, buf + 16, size - 16) == 0;
+}
+
+/* Largest structured reply chunk header. */
+#define MAX_CHUNK_HEADER sizeof (struct structured_reply_ext)
+
+/* Fill in the header of a structured reply chunk at hdr, using the
+ * extended format if extended headers have been negotiated.  'offset'
+ * is the offset of the request.  Returns the length of the header.
+ */
+static size_t
+set_chunk_header (struct connection *conn, char *hdr, uint64_t handle,
+                  uint16_t flags, uint16_t type,
+                  uint64_t offset, uint64_t length)
+{
+  if (conn->extended_headers) {
+    struct structured_reply_ext *reply = (struct structured_reply_ext *) hdr;
+
+    reply->magic = htobe32 (NBD_EXTENDED_REPLY_MAGIC);
+    reply->flags = htobe16 (flags);
+    reply->type = htobe16 (type);
+    reply->handle = handle;
+    reply->offset = htobe64 (offset);
+    reply->length = htobe64 (length);
+    return sizeof *reply;
+  }
+  else {
+    struct structured_reply *reply = (struct structured_reply *) hdr;
+
+    reply->magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    reply->flags = htobe16 (flags);
+    reply->type = htobe16 (type);
+    reply->handle = handle;
+    reply->length = htobe32 (length);
+    return sizeof *reply;
+  }
+}
+
+/* Send the reply to a successful read when structured replies have
+ * been negotiated.  Zero blocks in the buffer are sent as
+ * NBD_REPLY_TYPE_OFFSET_HOLE chunks so they don't have to go over the
+ * wire, unless the client asked for a single chunk with
+ * NBD_CMD_FLAG_DF.  Must be called with the write lock held.
+ */
+static int
+send_structured_reply_read (struct connection *conn, uint64_t handle,
+                            uint32_t flags, uint64_t offset, uint32_t count,
+                            const char *buf)
+{
+  /* Each chunk header is followed by the start of its payload. */
+  struct chunk {
+    char hdr[MAX_CHUNK_HEADER +
+             sizeof (struct structured_reply_offset_hole)];
+  } chunks[CHUNKS_PER_SEND], *c;
+  struct structured_reply_offset_data *data;
+  struct structured_reply_offset_hole *hole;
+  struct iovec iov[2 * CHUNKS_PER_SEND];
+  size_t n = 0, hlen;
+  int niov = 0;
+  uint32_t pos = 0, len, end;
+  bool zero, block_zero, last;
+
+  while (pos < count) {
+    /* Find the next run of blocks which are either all zero or all
+     * data.
+     */
+    if (flags & NBD_CMD_FLAG_DF) {
+      zero = false;
+      len = count;
+    }
+    else {
+      len = 0;
+      do {
+        end = pos + len;
+        end += HOLE_GRANULARITY - (offset + end) % HOLE_GRANULARITY;
+        if (end > count)
+          end = count;
+        block_zero = is_zero (&buf[pos + len], end - (pos + len));
+        if (len == 0)
+          zero = block_zero;
+        else if (block_zero != zero)
+          break;
+        len = end - pos;
+      } while (pos + len < count);
+    }
+    last = pos + len == count;
+
+    c = &chunks[n++];
+    if (zero) {
+      hlen = set_chunk_header (conn, c->hdr, handle,
+                               last ? NBD_REPLY_FLAG_DONE : 0,
+                               NBD_REPLY_TYPE_OFFSET_HOLE,
+                               offset, sizeof *hole);
+      hole = (struct structured_reply_offset_hole *) &c->hdr[hlen];
+      hole->offset = htobe64 (offset + pos);
+      hole->length = htobe32 (len);
+      iov[niov].iov_base = c->hdr;
+      iov[niov].iov_len = hlen + sizeof *hole;
+      niov++;
+    }
+    else {
+      hlen = set_chunk_header (conn, c->hdr, handle,
+                               last ? NBD_REPLY_FLAG_DONE : 0,
+                               NBD_REPLY_TYPE_OFFSET_DATA,
+                               offset, sizeof *data + len);
+      data = (struct structured_reply_offset_data *) &c->hdr[hlen];
+      data->offset = htobe64 (offset + pos);
+      iov[niov].iov_base = c->hdr;
+      iov[niov].iov_len = hlen + sizeof *data;
+      niov++;
+      iov[niov].iov_base = (char *) &buf[pos];
+      iov[niov].iov_len = len;
+      niov++;
+    }
+    pos += len;
+
+    if (last || n == CHUNKS_PER_SEND) {
+      if (conn->sendv (conn, iov, niov, last ? 0 : SEND_MORE) == -1)
+        return -1;
+      n = 0;
+      niov = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* Send the reply to a successful NBD_CMD_BLOCK_STATUS.  Must be
+ * called with the write lock held.
+ */
+static int
+send_structured_reply_block_status (struct connection *conn,
+                                    uint64_t handle, uint32_t flags,
+                                    uint64_t offset,
+                                    struct nbdkit_extents *extents)
+{
+  char hdr[MAX_CHUNK_HEADER];
+  struct structured_reply_block_status block_status;
+  struct structured_reply_block_status_ext block_status_ext;
+  CLEANUP_FREE struct block_descriptor *blocks = NULL;
+  CLEANUP_FREE struct block_descriptor_ext *blocks_ext = NULL;
+  struct extent e;
+  struct iovec iov[3];
+  size_t i, nr_blocks;
+  uint32_t status;
+
+  nr_blocks = extents_count (extents);
+  if (flags & NBD_CMD_FLAG_REQ_ONE)
+    nr_blocks = 1;
+
+  if (conn->extended_headers)
+    blocks_ext = malloc (nr_blocks * sizeof *blocks_ext);
+  else
+    blocks = malloc (nr_blocks * sizeof *blocks);
+  if (blocks == NULL && blocks_ext == NULL)
+    return -1;
+  for (i = 0; i < nr_blocks; ++i) {
+    e = extents_get (extents, i);
+    status = (e.type & NBDKIT_EXTENT_HOLE ? NBD_STATE_HOLE : 0) |
+      (e.type & NBDKIT_EXTENT_ZERO ? NBD_STATE_ZERO : 0);
+    if (blocks_ext) {
+      blocks_ext[i].length = htobe64 (e.length);
+      blocks_ext[i].status_flags = htobe64 (status);
+    }
+    else {
+      blocks[i].length = htobe32 (e.length);
+      blocks[i].status_flags = htobe32 (status);
+    }
+  }
+
+  if (conn->extended_headers) {
+    block_status_ext.context_id = htobe32 (BASE_ALLOCATION_ID);
+    block_status_ext.count = htobe32 (nr_blocks);
+    iov[1].iov_base = &block_status_ext;
+    iov[1].iov_len = sizeof block_status_ext;
+    iov[2].iov_base = blocks_ext;
+    iov[2].iov_len = nr_blocks * sizeof *blocks_ext;
+  }
+  else {
+    block_status.context_id = htobe32 (BASE_ALLOCATION_ID);
+    iov[1].iov_base = &block_status;
+    iov[1].iov_len = sizeof block_status;
+    iov[2].iov_base = blocks;
+    iov[2].iov_len = nr_blocks * sizeof *blocks;
+  }
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len =
+    set_chunk_header (conn, hdr, handle, NBD_REPLY_FLAG_DONE,
+                      conn->extended_headers
+                      ? NBD_REPLY_TYPE_BLOCK_STATUS_EXT
+                      : NBD_REPLY_TYPE_BLOCK_STATUS,
+                      offset, iov[1].iov_len + iov[2].iov_len);
+  return conn->sendv (conn, iov, 3, 0);
+}
+
+/* Send an error as a structured reply.  Must be called with the write
+ * lock held.
+ */
+static int
+send_structured_reply_error (struct connection *conn, uint64_t handle,
+                             uint32_t flags, uint64_t offset, uint32_t error)
+{
+  char hdr[MAX_CHUNK_HEADER];
+  struct structured_reply_error error_data;
+  struct iovec iov[2];
+
+  error_data.error = htobe32 (nbd_errno (error, flags));
+  error_data.len = htobe16 (0);
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = set_chunk_header (conn, hdr, handle, NBD_REPLY_FLAG_DONE,
+                                     NBD_REPLY_TYPE_ERROR,
+                                     offset, sizeof error_data);
+  iov[1].iov_base = &error_data;
+  iov[1].iov_len = sizeof error_data;
+  return conn->sendv (conn, iov, 2, 0);
+}
+
+/* Send the reply to a successful request which returns no data, once
+ * extended headers have been negotiated (since simple replies can't
+ * be used then).  Must be called with the write lock held.
+ */
+static int
+send_structured_reply_none (struct connection *conn, uint64_t handle,
+                            uint64_t offset)
+{
+  char hdr[MAX_CHUNK_HEADER];
+  size_t hlen;
+
+  hlen = set_chunk_header (conn, hdr, handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_NONE, offset, 0);
+  return conn->send (conn, hdr, hlen);
+}
+
+#ifdef HAVE_SPLICE
+/* Move len bytes of fd starting at *off into the pipe, which must
+ * have room for them.  On error returns -1 with errno set (EIO if the
+ * file is too short).
+ */
+static int
+fill_pipe (int fd, loff_t *off, int wfd, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = splice (fd, off, wfd, NULL, len, SPLICE_F_MOVE);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;              /* unexpected end of file */
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif
+
+/* Send the reply to a read straight from the plugin's file
+ * descriptor.  The whole thing happens inside the request lock, so
+ * the data can't be changed by a later write while it is being sent.
+ *
+ * The data is spliced from the file into a pipe before the reply
+ * header is sent, so if reading fails an error can still be sent to
+ * the client.  Reads which don't fit in the pipe are sent as several
+ * chunks when structured replies are in use, ending with an error
+ * chunk if a later piece can't be read, or else go through a buffer.
+ *
+ * Returns 1 if the reply has been sent, 0 if the caller must read into
+ * a buffer instead (or send an error reply, if *error is set), or -1
+ * if the connection failed.
+ */
+static int
+handle_read_spliced (struct connection *conn, uint64_t handle,
+                     uint32_t flags, uint64_t offset, uint32_t count,
+                     uint32_t *error)
+{
+#ifdef HAVE_SPLICE
+  struct request_range range =
+    { .offset = offset, .count = count, .read = true };
+  bool structured = conn->structured_replies || conn->extended_headers;
+  struct reply reply;
+  struct structured_reply_offset_data data;
+  char hdr[MAX_CHUNK_HEADER];
+  struct iovec iov[2];
+  int fd, rfd, wfd, r, ret = 0;
+  uint64_t fd_offset;
+  loff_t off;
+  size_t pipe_size;
+  uint32_t pos, len;
+
+  if (threadlocal_get_pipe (&rfd, &wfd, &pipe_size) == -1)
+    return 0;
+  if (count > pipe_size && !structured)
+    return 0;
+
+  plugin_lock_request (conn, &range);
+  threadlocal_set_error (0);
+  r = plugin_pread_fd (conn, count, offset, &fd, &fd_offset);
+  if (r == -1) {
+    *error = get_error (conn);
+    goto out;
+  }
+  if (fd == -1)
+    goto out;
+
+  /* Read the first piece before committing to this reply. */
+  off = fd_offset;
+  len = count > pipe_size ? pipe_size : count;
+  if (fill_pipe (fd, &off, wfd, len) == -1) {
+    threadlocal_discard_pipe ();
+    /* If the file doesn't support splice, use .pread instead. */
+    if (errno != EINVAL && errno != ENOSYS) {
+      nbdkit_error ("pread_fd: %m");
+      *error = errno;
+    }
+    goto out;
+  }
+
+  pthread_mutex_lock (&conn->write_lock);
+  for (pos = 0;;) {
+    if (structured) {
+      iov[0].iov_base = hdr;
+      iov[0].iov_len =
+        set_chunk_header (conn, hdr, handle,
+                          pos + len == count ? NBD_REPLY_FLAG_DONE : 0,
+                          NBD_REPLY_TYPE_OFFSET_DATA,
+                          offset, sizeof data + len);
+      data.offset = htobe64 (offset + pos);
+      iov[1].iov_base = &data;
+      iov[1].iov_len = sizeof data;
+      r = conn->sendv (conn, iov, 2, SEND_MORE);
+    }
+    else {
+      reply.magic = htobe32 (NBD_REPLY_MAGIC);
+      reply.handle = handle;
+      reply.error = htobe32 (0);
+      iov[0].iov_base = &reply;
+      iov[0].iov_len = sizeof reply;
+      r = conn->sendv (conn, iov, 1, SEND_MORE);
+    }
+    if (r == 0)
+      r = conn->sendfile (conn, rfd, len,
+                          pos + len < count ? SEND_MORE : 0);
+    if (r == -1) {
+      nbdkit_error ("write data: %m");
+      threadlocal_discard_pipe ();
+      ret = -1;
+      break;
+    }
+    pos += len;
+    if (pos == count) {
+      ret = 1;
+      break;
+    }
+
+    len = count - pos > pipe_size ? pipe_size : count - pos;
+    if (fill_pipe (fd, &off, wfd, len) == -1) {
+      int err = errno;
+
+      threadlocal_discard_pipe ();
+      nbdkit_error ("pread_fd: %m");
+      debug ("sending error reply: %s", strerror (err));
+      if (send_structured_reply_error (conn, handle, flags,
+                                       offset, err) == -1) {
+        nbdkit_error ("write reply: %m");
+        ret = -1;
+      }
+      else
+        ret = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&conn->write_lock);
+
+ out:
+  plugin_unlock_request (conn, &range);
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+/* Read exactly len bytes, which must already be in the pipe. */
+static int
+read_pipe (int rfd, char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (rfd, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Receive the payload of a write request into this thread's pipe,
+ * so that handle_write_from_pipe can splice it into the plugin's file
+ * descriptor later without holding the read lock.  This is called
+ * with the read lock held.  Returns 0 if the payload can't go through
+ * the pipe (and nothing has been read), 1 if it has been received, or
+ * -1 if the connection failed.  If the pipe filled up early the
+ * payload is received into a buffer returned in *bufp instead.
+ */
+static int
+recv_write_to_pipe (struct connection *conn, uint32_t count,
+                    char **bufp, uint32_t *error)
+{
+  int rfd, wfd, r;
+  size_t pipe_size, moved;
+  char *buf;
+
+  if (threadlocal_get_pipe (&rfd, &wfd, &pipe_size) == -1 ||
+      count > pipe_size)
+    return 0;
+
+  r = conn->recvfile (conn, wfd, count, &moved);
+  if (r == -1) {
+    nbdkit_error ("read data: %m");
+    threadlocal_discard_pipe ();
+    return -1;
+  }
+  if (r == 1)
+    return 1;
+
+  /* Data from a socket can take up more room in a pipe than its
+   * length, so the rest has to be received into a buffer.
+   */
+  buf = bufpool_alloc (count);
+  if (buf == NULL) {
+    perror ("bufpool_alloc");
+    *error = ENOMEM;
+    threadlocal_discard_pipe ();
+    skip_over_write_buffer (conn, count - moved);
+    return 1;
+  }
+  if (read_pipe (rfd, buf, moved) == -1) {
+    nbdkit_error ("read: %m");
+    bufpool_free (buf);
+    threadlocal_discard_pipe ();
+    return -1;
+  }
+  r = conn->recv (conn, &buf[moved], count - moved);
+  if (r <= 0) {
+    if (r == 0)
+      errno = EBADMSG;          /* partial record read */
+    nbdkit_error ("read data: %m");
+    bufpool_free (buf);
+    return -1;
+  }
+  *bufp = buf;
+  return 1;
+}
+
+#ifdef HAVE_SPLICE
+/* Move len bytes from the pipe into fd at *off.  On error returns -1
+ * with errno set.
+ */
+static int
+drain_pipe (int rfd, int fd, loff_t *off, size_t len)
+{
+  bool use_splice = true;
+  char buf[BUFSIZ];
+  ssize_t r, w, done;
+
+  while (len > 0) {
+    if (use_splice) {
+      r = splice (rfd, NULL, fd, off, len, SPLICE_F_MOVE);
+      if (r == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        /* The file doesn't support splice, copy the rest. */
+        use_splice = false;
+        continue;
+      }
+    }
+    else {
+      r = read (rfd, buf, len > BUFSIZ ? BUFSIZ : len);
+      for (done = 0; r > 0 && done < r; done += w) {
+        w = pwrite (fd, buf + done, r - done, *off + done);
+        if (w == -1) {
+          if (errno == EINTR) {
+            w = 0;
+            continue;
+          }
+          return -1;
+        }
+      }
+      if (r > 0)
+        *off += r;
+    }
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif
+
+/* Write the payload which recv_write_to_pipe left in this thread's
+ * pipe.  This takes the request lock but is called without the read
+ * lock, so the next request can be received in the meantime.  Returns
+ * -1 only if there is a fatal error, and otherwise sets *error if the
+ * write failed.
+ */
+static int
+handle_write_from_pipe (struct connection *conn, uint32_t flags,
+                        uint64_t offset, uint32_t count, uint32_t *error)
+{
+#ifdef HAVE_SPLICE
+  struct request_range range =
+    { .offset = offset, .count = count, .write = true };
+  CLEANUP_BUFPOOL_FREE char *buf = NULL;
+  int fd, rfd, wfd, r = 0;
+  uint64_t fd_offset;
+  size_t pipe_size;
+  loff_t off;
+
+  if (threadlocal_get_pipe (&rfd, &wfd, &pipe_size) == -1)
+    abort ();                   /* recv_write_to_pipe already made it */
+
+  plugin_lock_request (conn, &range);
+  threadlocal_set_error (0);
+  r = plugin_pwrite_fd (conn, count, offset, &fd, &fd_offset);
+  if (r == -1) {
+    *error = get_error (conn);
+    threadlocal_discard_pipe ();
+    r = 0;
+    goto out;
+  }
+
+  if (fd == -1) {
+    /* The plugin can't map this range, so use .pwrite after all. */
+    buf = bufpool_alloc (count);
+    if (buf == NULL) {
+      perror ("bufpool_alloc");
+      *error = ENOMEM;
+      threadlocal_discard_pipe ();
+      goto out;
+    }
+    if (read_pipe (rfd, buf, count) == -1) {
+      nbdkit_error ("read: %m");
+      *error = EIO;
+      threadlocal_discard_pipe ();
+      goto out;
+    }
+    r = _handle_request (conn, NBD_CMD_WRITE, flags, offset, count, buf,
+                         NULL, error);
+    goto out;
+  }
+
+  off = fd_offset;
+  if (drain_pipe (rfd, fd, &off, count) == -1) {
+    nbdkit_error ("pwrite_fd: %m");
+    *error = errno;
+    threadlocal_discard_pipe ();
+  }
+  flush_mark_dirty (conn->flush);
+  if (*error == 0 && (flags & NBD_CMD_FLAG_FUA) &&
+      conn->can_fua == NBDKIT_FUA_EMULATE) {
+    if (flush_wait (conn->flush, conn) == -1)
+      *error = get_error (conn);
+  }
+
+ out:
+  plugin_unlock_request (conn, &range);
+  return r;
+#else
+  abort ();
+#endif
+}
+
+/* Large writes are received by the thread reading the request and
+ * passed to the plugin by a helper thread, one chunk at a time, so
+ * that receiving the next chunk overlaps writing the previous one.
+ * Each connection starts its helper the first time it streams a
+ * write and keeps it, and its two chunk buffers, until the connection
+ * is closed.  Only one write per connection is streamed at a time,
+ * since the whole payload is received with the read lock held.
+ */
+struct write_stream {
+  struct connection *conn;
+  const char *name;
+  size_t instance_num;
+  pthread_t thread;
+  char *bufs[2];                /* Chunk buffers. */
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *buf;                    /* Chunk being written, or NULL. */
+  uint32_t len;
+  uint64_t offset;
+  uint32_t flags;               /* Flags for plugin_pwrite. */
+  uint32_t error;               /* First error from the plugin. */
+  bool exit;                    /* The connection is being closed. */
+};
+
+static void *
+write_stream_thread (void *data)
+{
+  struct write_stream *s = data;
+  struct request_range range = { .write = true };
+  int r;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name (s->name);
+  threadlocal_set_instance_num (s->instance_num);
+
+  pthread_mutex_lock (&s->lock);
+  for (;;) {
+    while (s->buf == NULL && !s->exit)
+      pthread_cond_wait (&s->cond, &s->lock);
+    if (s->buf == NULL)
+      break;
+
+    /* Once a chunk has failed, the rest are discarded.  The request
+     * lock is only held while each chunk is written, never while
+     * waiting for the client to send the next one.
+     */
+    if (s->error == 0) {
+      range.offset = s->offset;
+      range.count = s->len;
+      pthread_mutex_unlock (&s->lock);
+      threadlocal_set_error (0);
+      plugin_lock_request (s->conn, &range);
+      r = plugin_pwrite (s->conn, s->buf, s->len, s->offset, s->flags);
+      flush_mark_dirty (s->conn->flush);
+      plugin_unlock_request (s->conn, &range);
+      pthread_mutex_lock (&s->lock);
+      if (r == -1)
+        s->error = get_error (s->conn);
+    }
+    s->buf = NULL;
+    pthread_cond_signal (&s->cond);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return NULL;
+}
+
+static struct write_stream *
+start_write_stream (struct connection *conn)
+{
+  struct write_stream *s;
+  int err;
+
+  s = calloc (1, sizeof *s);
+  if (s == NULL)
+    return NULL;
+  s->bufs[0] = bufpool_alloc (WRITE_CHUNK_SIZE);
+  s->bufs[1] = bufpool_alloc (WRITE_CHUNK_SIZE);
+  if (s->bufs[0] == NULL || s->bufs[1] == NULL) {
+    bufpool_free (s->bufs[0]);
+    bufpool_free (s->bufs[1]);
+    free (s);
+    errno = ENOMEM;
+    return NULL;
   }
-
-  if (flush_after_command) {
-    r = plugin_flush (conn);
-    if (r == -1) {
-      *error = get_error (conn);
-      return 0;
-    }
+  s->conn = conn;
+  s->name = threadlocal_get_name ();
+  s->instance_num = threadlocal_get_instance_num ();
+  pthread_mutex_init (&s->lock, NULL);
+  pthread_cond_init (&s->cond, NULL);
+
+  err = pthread_create (&s->thread, NULL, write_stream_thread, s);
+  if (err) {
+    pthread_mutex_destroy (&s->lock);
+    pthread_cond_destroy (&s->cond);
+    bufpool_free (s->bufs[0]);
+    bufpool_free (s->bufs[1]);
+    free (s);
+    errno = err;
+    return NULL;
   }
+  return s;
+}
 
-  return 0;
+static void
+stop_write_stream (struct write_stream *s)
+{
+  if (s == NULL)
+    return;
+
+  pthread_mutex_lock (&s->lock);
+  s->exit = true;
+  pthread_cond_signal (&s->cond);
+  pthread_mutex_unlock (&s->lock);
+  pthread_join (s->thread, NULL);
+
+  pthread_mutex_destroy (&s->lock);
+  pthread_cond_destroy (&s->cond);
+  bufpool_free (s->bufs[0]);
+  bufpool_free (s->bufs[1]);
+  free (s);
 }
 
+/* Receive the payload of a large write request in chunks, passing
+ * each chunk to the plugin (through the connection's write stream
+ * helper) while the next one is received, so that at most two chunks
+ * are held in memory at a time.  This is called with the read lock
+ * held.  FUA is passed to the plugin on every chunk, or emulated by a
+ * single flush at the end.  Returns 0 if the request must be handled
+ * the normal way (and nothing has been read), 1 if the request has
+ * been handled (with *error set if it failed), or -1 if the
+ * connection failed.
+ */
 static int
-handle_request (struct connection *conn,
-                uint32_t cmd, uint32_t flags, uint64_t offset, uint32_t count,
-                void *buf,
-                uint32_t *error)
+handle_write_streaming (struct connection *conn, uint32_t flags,
+                        uint64_t offset, uint32_t count, uint32_t *error)
 {
-  int r;
+  struct write_stream *s;
+  uint32_t plugin_flags = 0;
+  bool flush_after_command = false;
+  uint32_t n;
+  int i = 0, err, r = 1;
+
+  if (quit) {
+    skip_over_write_buffer (conn, count);
+    *error = ESHUTDOWN;
+    return 1;
+  }
 
-  plugin_lock_request (conn);
-  r = _handle_request (conn, cmd, flags, offset, count, buf, error);
-  plugin_unlock_request (conn);
+  if ((flags & NBD_CMD_FLAG_FUA) && !conn->readonly) {
+    if (conn->can_fua == NBDKIT_FUA_NATIVE)
+      plugin_flags |= NBDKIT_FLAG_FUA;
+    else if (conn->can_fua == NBDKIT_FUA_EMULATE)
+      flush_after_command = true;
+  }
 
-  return r;
-}
+  if (conn->write_stream == NULL) {
+    conn->write_stream = start_write_stream (conn);
+    if (conn->write_stream == NULL) {
+      debug ("start_write_stream: %m (receiving the write in one buffer)");
+      return 0;
+    }
+  }
+  s = conn->write_stream;
 
-static void
-skip_over_write_buffer (int sock, size_t count)
-{
-  char buf[BUFSIZ];
-  ssize_t r;
+  /* The helper is idle, since the previous streamed write waited for
+   * it to finish.
+   */
+  pthread_mutex_lock (&s->lock);
+  s->flags = plugin_flags;
+  s->error = 0;
+  pthread_mutex_unlock (&s->lock);
 
   while (count > 0) {
-    r = read (sock, buf, count > BUFSIZ ? BUFSIZ : count);
-    if (r == -1) {
-      nbdkit_error ("skipping write buffer: %m");
-      return;
+    n = count > WRITE_CHUNK_SIZE ? WRITE_CHUNK_SIZE : count;
+    err = conn->recv (conn, s->bufs[i], n);
+    if (err == -1) {
+      nbdkit_error ("read data: %m");
+      r = -1;
+      break;
     }
-    if (r == 0)
-      return;
-    count -= r;
+    if (err == 0) {
+      nbdkit_error ("read data: client closed input unexpectedly");
+      r = -1;
+      break;
+    }
+
+    /* Wait until the helper has finished the previous chunk, which
+     * also means that the other buffer is free.
+     */
+    pthread_mutex_lock (&s->lock);
+    while (s->buf != NULL)
+      pthread_cond_wait (&s->cond, &s->lock);
+    if (s->error) {
+      pthread_mutex_unlock (&s->lock);
+      skip_over_write_buffer (conn, count - n);
+      break;
+    }
+    s->buf = s->bufs[i];
+    s->len = n;
+    s->offset = offset;
+    pthread_cond_signal (&s->cond);
+    pthread_mutex_unlock (&s->lock);
+
+    i ^= 1;
+    offset += n;
+    count -= n;
   }
-}
 
-/* Convert a system errno to an NBD_E* error code. */
-static int
-nbd_errno (int error)
-{
-  switch (error) {
-  case 0:
-    return NBD_SUCCESS;
-  case EROFS:
-  case EPERM:
-    return NBD_EPERM;
-  case EIO:
-    return NBD_EIO;
-  case ENOMEM:
-    return NBD_ENOMEM;
-#ifdef EDQUOT
-  case EDQUOT:
-#endif
-  case EFBIG:
-  case ENOSPC:
-    return NBD_ENOSPC;
-#ifdef ESHUTDOWN
-  case ESHUTDOWN:
-    return NBD_ESHUTDOWN;
-#endif
-  case EINVAL:
-  default:
-    return NBD_EINVAL;
+  /* Wait for the last chunk to be written. */
+  pthread_mutex_lock (&s->lock);
+  while (s->buf != NULL)
+    pthread_cond_wait (&s->cond, &s->lock);
+  if (r == 1 && s->error)
+    *error = s->error;
+  pthread_mutex_unlock (&s->lock);
+
+  if (r == 1 && *error == 0 && flush_after_command) {
+    /* Ordered like a flush request against other requests. */
+    struct request_range range = { .count = UINT64_MAX };
+
+    threadlocal_set_error (0);
+    plugin_lock_request (conn, &range);
+    if (flush_wait (conn->flush, conn) == -1)
+      *error = get_error (conn);
+    plugin_unlock_request (conn, &range);
   }
+
+  return r;
 }
 
+/* 'msg' is the request already read by the event loop, or NULL to
+ * read it from the client.
+ */
 static int
-recv_request_send_reply (struct connection *conn)
+recv_request_send_reply (struct connection *conn, struct message *msg)
 {
   int r;
   struct request request;
+  struct request_ext request_ext;
   struct reply reply;
-  uint32_t magic, cmd, flags, count, error = 0;
-  uint64_t offset;
-  CLEANUP_FREE char *buf = NULL;
-
-  /* Read the request packet. */
-  r = conn->recv (conn, &request, sizeof request);
+  uint32_t magic, cmd, flags, error = 0;
+  uint64_t handle, offset, count;
+  CLEANUP_BUFPOOL_FREE char *buf = NULL;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  bool zero_copy = false;
+  bool spliced = false;
+  bool written = false;
+  struct iovec iov[2];
+
+  /* Read the request packet.  Only one thread at a time may read from
+   * the client, but once the request (and any write data) has been
+   * received another thread can start reading the next request.
+   */
+  pthread_mutex_lock (&conn->read_lock);
+  r = get_status (conn);
+  if (r <= 0) {
+    pthread_mutex_unlock (&conn->read_lock);
+    return r;
+  }
+  conn->msg = msg;
+  conn->msg_pos = 0;
+  if (conn->extended_headers)
+    r = conn->recv (conn, &request_ext, sizeof request_ext);
+  else
+    r = conn->recv (conn, &request, sizeof request);
   if (r == -1) {
     nbdkit_error ("read request: %m");
-    return -1;
+    pthread_mutex_unlock (&conn->read_lock);
+    return set_status (conn, -1);
   }
   if (r == 0) {
     debug ("client closed input socket, closing connection");
-    return 0;                   /* disconnect */
+    pthread_mutex_unlock (&conn->read_lock);
+    return set_status (conn, 0); /* disconnect */
   }
 
-  magic = be32toh (request.magic);
-  if (magic != NBD_REQUEST_MAGIC) {
-    nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)", magic);
-    return -1;
+  if (conn->extended_headers) {
+    magic = be32toh (request_ext.magic);
+    if (magic != NBD_EXTENDED_REQUEST_MAGIC) {
+      nbdkit_error ("invalid extended request: "
+                    "'magic' field is incorrect (0x%x)", magic);
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, -1);
+    }
+    cmd = be32toh (request_ext.type);
+    handle = request_ext.handle;
+    offset = be64toh (request_ext.offset);
+    count = be64toh (request_ext.count);
+  }
+  else {
+    magic = be32toh (request.magic);
+    if (magic != NBD_REQUEST_MAGIC) {
+      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                    magic);
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, -1);
+    }
+    cmd = be32toh (request.type);
+    handle = request.handle;
+    offset = be64toh (request.offset);
+    count = be32toh (request.count);
   }
 
-  cmd = be32toh (request.type);
   flags = cmd & ~NBD_CMD_MASK_COMMAND;
   cmd &= NBD_CMD_MASK_COMMAND;
 
-  offset = be64toh (request.offset);
-  count = be32toh (request.count);
-
   if (cmd == NBD_CMD_DISC) {
     debug ("client sent disconnect command, closing connection");
-    return 0;                   /* disconnect */
+    pthread_mutex_unlock (&conn->read_lock);
+    return set_status (conn, 0); /* disconnect */
   }
 
   /* Validate the request. */
   r = validate_request (conn, cmd, flags, offset, count, &error);
-  if (r == -1)
-    return -1;
+  if (r == -1) {
+    pthread_mutex_unlock (&conn->read_lock);
+    return set_status (conn, -1);
+  }
   if (r == 0) {                 /* request not valid */
     if (cmd == NBD_CMD_WRITE)
-      skip_over_write_buffer (conn->sockin, count);
-    goto send_reply;
+      skip_over_write_buffer (conn, count);
+    goto done_reading;
+  }
+
+  /* Writes to plugins which can give us a file descriptor are spliced
+   * from the socket into a pipe here, and from the pipe into the file
+   * once the read lock has been released.  FUA writes to plugins
+   * which handle FUA natively go through .pwrite instead, so the
+   * plugin sees the flag.
+   */
+  if (cmd == NBD_CMD_WRITE && conn->recvfile && plugin_has_pwrite_fd () &&
+      !((flags & NBD_CMD_FLAG_FUA) && conn->can_fua == NBDKIT_FUA_NATIVE)) {
+    r = recv_write_to_pipe (conn, count, &buf, &error);
+    if (r == -1) {
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, -1);
+    }
+    if (r == 1) {
+      spliced = buf == NULL;
+      goto done_reading;
+    }
+  }
+
+  /* Large writes are passed to the plugin as they arrive rather than
+   * being received into one buffer first.
+   */
+  if (cmd == NBD_CMD_WRITE && count > WRITE_CHUNK_SIZE && msg == NULL) {
+    r = handle_write_streaming (conn, flags, offset, count, &error);
+    if (r == -1) {
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, -1);
+    }
+    if (r == 1) {
+      written = true;
+      goto done_reading;
+    }
+  }
+
+  /* Reads from plugins which can give us a file descriptor are sent
+   * straight from the file to the socket, so don't need a buffer.
+   */
+  zero_copy = cmd == NBD_CMD_READ && conn->sendfile && plugin_has_pread_fd ();
+
+  /* The event loop has already read the write data into a buffer. */
+  if (cmd == NBD_CMD_WRITE && msg) {
+    buf = msg->data;
+    msg->data = NULL;
+    goto done_reading;
   }
 
   /* Allocate the data buffer used for either read or write requests. */
-  if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-    buf = malloc (count);
+  if ((cmd == NBD_CMD_READ && !zero_copy) || cmd == NBD_CMD_WRITE) {
+    buf = bufpool_alloc (count);
     if (buf == NULL) {
-      perror ("malloc");
+      perror ("bufpool_alloc");
       error = ENOMEM;
       if (cmd == NBD_CMD_WRITE)
-        skip_over_write_buffer (conn->sockin, count);
-      goto send_reply;
+        skip_over_write_buffer (conn, count);
+      goto done_reading;
     }
   }
 
@@ -981,24 +2983,74 @@ recv_request_send_reply (struct connection *conn)
     r = conn->recv (conn, buf, count);
     if (r == -1) {
       nbdkit_error ("read data: %m");
-      return -1;
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, -1);
     }
     if (r == 0) {
       debug ("client closed input unexpectedly, closing connection");
-      return 0;                 /* disconnect */
+      pthread_mutex_unlock (&conn->read_lock);
+      return set_status (conn, 0); /* disconnect */
     }
   }
 
-  /* Perform the request.  Only this part happens inside the request lock. */
-  r = handle_request (conn, cmd, flags, offset, count, buf, &error);
-  if (r == -1)
-    return -1;
+ done_reading:
+  pthread_mutex_unlock (&conn->read_lock);
+
+  if (error != 0 || written)
+    goto send_reply;
+
+  /* Zero copy reads send their own reply if they can. */
+  if (zero_copy && !quit) {
+    r = handle_read_spliced (conn, handle, flags, offset, count, &error);
+    if (r == -1)
+      return set_status (conn, -1);
+    if (r == 1)
+      return 1;
+    if (error != 0)
+      goto send_reply;
+    buf = bufpool_alloc (count);
+    if (buf == NULL) {
+      perror ("bufpool_alloc");
+      error = ENOMEM;
+      goto send_reply;
+    }
+  }
+
+  if (cmd == NBD_CMD_BLOCK_STATUS) {
+    extents = extents_new (offset, offset + count);
+    if (extents == NULL) {
+      error = ENOMEM;
+      goto send_reply;
+    }
+  }
+
+  /* Perform the request.  The request lock is taken around the calls
+   * into the plugin (see handle_request).
+   */
+  if (quit) {
+    if (spliced)
+      threadlocal_discard_pipe ();
+    error = ESHUTDOWN;
+  }
+  else if (spliced) {
+    r = handle_write_from_pipe (conn, flags, offset, count, &error);
+    if (r == -1)
+      return set_status (conn, -1);
+  }
+  else {
+    r = handle_request (conn, cmd, flags, offset, count, buf,
+                        extents, &error);
+    if (r == -1)
+      return set_status (conn, -1);
+  }
 
   /* Send the reply packet. */
  send_reply:
+  if (get_status (conn) < 0)
+    return -1;
   reply.magic = htobe32 (NBD_REPLY_MAGIC);
-  reply.handle = request.handle;
-  reply.error = htobe32 (nbd_errno (error));
+  reply.handle = handle;
+  reply.error = htobe32 (nbd_errno (error, flags));
 
   if (error != 0) {
     /* Since we're about to send only the limited NBD_E* errno to the
@@ -1009,20 +3061,55 @@ recv_request_send_reply (struct connection *conn)
     debug ("sending error reply: %s", strerror (error));
   }
 
-  r = conn->send (conn, &reply, sizeof reply);
-  if (r == -1) {
-    nbdkit_error ("write reply: %m");
-    return -1;
+  /* Replies may be sent in any order, but each reply (and its data)
+   * must not be interleaved with any other.
+   */
+  pthread_mutex_lock (&conn->write_lock);
+  if (((cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS) &&
+       conn->structured_replies) ||
+      conn->extended_headers) {
+    /* Reads must always have structured replies once they have been
+     * negotiated, and block status can only be sent that way.  Once
+     * extended headers are negotiated every reply is structured.
+     */
+    if (!error && cmd == NBD_CMD_READ)
+      r = send_structured_reply_read (conn, handle, flags,
+                                      offset, count, buf);
+    else if (!error && cmd == NBD_CMD_BLOCK_STATUS)
+      r = send_structured_reply_block_status (conn, handle, flags,
+                                              offset, extents);
+    else if (!error)
+      r = send_structured_reply_none (conn, handle, offset);
+    else
+      r = send_structured_reply_error (conn, handle, flags, offset, error);
+    if (r == -1) {
+      nbdkit_error ("write reply: %m");
+      pthread_mutex_unlock (&conn->write_lock);
+      return set_status (conn, -1);
+    }
   }
-
-  /* Send the read data buffer. */
-  if (cmd == NBD_CMD_READ) {
-    r = conn->send (conn, buf, count);
+  else if (cmd == NBD_CMD_READ && !error) {
+    /* Send the reply header and read data together. */
+    iov[0].iov_base = &reply;
+    iov[0].iov_len = sizeof reply;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = count;
+    r = conn->sendv (conn, iov, 2, 0);
     if (r == -1) {
       nbdkit_error ("write data: %m");
-      return -1;
+      pthread_mutex_unlock (&conn->write_lock);
+      return set_status (conn, -1);
     }
   }
+  else {
+    r = conn->send (conn, &reply, sizeof reply);
+    if (r == -1) {
+      nbdkit_error ("write reply: %m");
+      pthread_mutex_unlock (&conn->write_lock);
+      return set_status (conn, -1);
+    }
+  }
+  pthread_mutex_unlock (&conn->write_lock);
 
   return 1;                     /* command processed ok */
 }
@@ -1051,19 +3138,132 @@ raw_send (struct connection *conn, const void *vbuf, size_t len)
   return 0;
 }
 
+/* Send a list of buffers using a single system call where possible.
+ * If flags contains SEND_MORE, we tell the kernel that more data is
+ * coming, so it doesn't send a partial packet yet.
+ */
+static int
+raw_sendv (struct connection *conn, const struct iovec *iov, int iovcnt,
+           int flags)
+{
+  int sock = conn->sockout;
+  struct iovec vec[iovcnt];
+  struct iovec *v = vec;
+  struct msghdr msg;
+  ssize_t r;
+
+  memcpy (vec, iov, sizeof vec);
+
+  while (iovcnt > 0) {
+    if (!conn->sockout_not_socket) {
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = v;
+      msg.msg_iovlen = iovcnt;
+      r = sendmsg (sock, &msg, (flags & SEND_MORE) ? MSG_MORE : 0);
+      if (r == -1 && errno == ENOTSOCK) {
+        /* Eg. -s mode, where we write to a pipe. */
+        conn->sockout_not_socket = true;
+        continue;
+      }
+    }
+    else
+      r = writev (sock, v, iovcnt);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+
+    /* Skip over whatever was sent. */
+    while (iovcnt > 0 && (size_t) r >= v->iov_len) {
+      r -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (char *) v->iov_base + r;
+      v->iov_len -= r;
+    }
+  }
+
+  return 0;
+}
+
 /* Read buffer from conn->sockin and either succeed completely
  * (returns > 0), read an EOF (returns 0), or fail (returns -1).
+ *
+ * If the connection has a receive buffer, small reads are satisfied
+ * from the buffer, which is refilled with whatever the client has
+ * sent so far (up to RECV_BUFFER_SIZE), so a client pipelining
+ * requests costs one system call per buffer rather than one or two per
+ * request.  Large reads (ie. write payloads) still go directly into
+ * the caller's buffer once the receive buffer is empty.
  */
+static ssize_t
+busy_poll_read (struct connection *conn, void *buf, size_t len)
+{
+  struct timespec start, now;
+  bool spun = false;
+  ssize_t r;
+
+  for (;;) {
+    r = recv (conn->sockin, buf, len, MSG_DONTWAIT);
+    if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      break;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (!spun) {
+      start = now;
+      spun = true;
+    }
+    else if ((now.tv_sec - start.tv_sec) * 1000000 +
+             (now.tv_nsec - start.tv_nsec) / 1000 >= busy_poll) {
+      conn->busy_poll_misses++;
+      return read (conn->sockin, buf, len);
+    }
+  }
+
+  if (spun)
+    conn->busy_poll_hits++;
+  else
+    conn->busy_poll_ready++;
+  return r;
+}
+
 static int
 raw_recv (struct connection *conn, void *vbuf, size_t len)
 {
   int sock = conn->sockin;
   char *buf = vbuf;
+  size_t n;
   ssize_t r;
   bool first_read = true;
+  bool fill;
 
   while (len > 0) {
-    r = read (sock, buf, len);
+    if (conn->recv_head < conn->recv_tail) {
+      n = conn->recv_tail - conn->recv_head;
+      if (n > len)
+        n = len;
+      memcpy (buf, &conn->recv_buf[conn->recv_head], n);
+      conn->recv_head += n;
+      buf += n;
+      len -= n;
+      first_read = false;
+      continue;
+    }
+
+    fill = conn->recv_buf && len < RECV_BUFFER_SIZE;
+    if (fill) {
+      conn->recv_head = conn->recv_tail = 0;
+      if (conn->busy_poll)
+        r = busy_poll_read (conn, conn->recv_buf, RECV_BUFFER_SIZE);
+      else
+        r = read (sock, conn->recv_buf, RECV_BUFFER_SIZE);
+    }
+    else if (conn->busy_poll)
+      r = busy_poll_read (conn, buf, len);
+    else
+      r = read (sock, buf, len);
     if (r == -1) {
       if (errno == EINTR || errno == EAGAIN)
         continue;
@@ -1076,13 +3276,165 @@ raw_recv (struct connection *conn, void *vbuf, size_t len)
       errno = EBADMSG;
       return -1;
     }
-    first_read = false;
-    buf += r;
+    if (fill)
+      conn->recv_tail = r;
+    else {
+      first_read = false;
+      buf += r;
+      len -= r;
+    }
+  }
+
+  return 1;
+}
+
+#ifdef HAVE_SPLICE
+/* Send len bytes waiting in pipefd to conn->sockout using splice(2),
+ * so the data never passes through userspace.  The pipe is left empty
+ * on success.  flags may be SEND_MORE if more of the reply follows.
+ */
+static int
+raw_sendfile (struct connection *conn, int pipefd, size_t len, int flags)
+{
+  int sock = conn->sockout;
+  ssize_t r;
+  bool use_splice = true;
+  unsigned int splice_flags = SPLICE_F_MOVE;
+  char buf[BUFSIZ];
+
+  if (flags & SEND_MORE)
+    splice_flags |= SPLICE_F_MORE;
+
+  while (len > 0) {
+    if (use_splice) {
+      r = splice (pipefd, NULL, sock, NULL, len, splice_flags);
+      if (r == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        /* Not every kind of file descriptor supports splice (eg. a
+         * terminal with -s), so copy the rest.
+         */
+        use_splice = false;
+        continue;
+      }
+    }
+    else {
+      r = read (pipefd, buf, len > BUFSIZ ? BUFSIZ : len);
+      if (r > 0 && raw_send (conn, buf, r) == -1)
+        return -1;
+    }
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  return 0;
+}
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_SPLICE
+/* Move len bytes of write data from conn->sockin into the pipe using
+ * splice(2), so the data never passes through userspace.  *moved is
+ * set to the number of bytes put in the pipe.  Returns 1 if all of
+ * them were, 0 if the pipe filled up first (socket data can take up
+ * more room in a pipe than its length), or -1 on error.
+ */
+static int
+raw_recvfile (struct connection *conn, int pipefd, size_t len, size_t *moved)
+{
+  int sock = conn->sockin;
+  struct pollfd pfd = { .fd = sock, .events = POLLIN };
+  bool waited = false;
+  ssize_t r;
+  size_t n;
+
+  *moved = 0;
+
+  /* Anything already in the receive buffer goes first. */
+  while (len > 0 && conn->recv_head < conn->recv_tail) {
+    n = conn->recv_tail - conn->recv_head;
+    if (n > len)
+      n = len;
+    r = write (pipefd, &conn->recv_buf[conn->recv_head], n);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    conn->recv_head += r;
+    *moved += r;
+    len -= r;
+  }
+
+  while (len > 0) {
+    /* Nothing will empty the pipe while we wait, so don't block on it. */
+    r = splice (sock, NULL, pipefd, NULL, len,
+                SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (r == -1 && errno == EAGAIN) {
+      /* For some sockets this also means that no data has arrived
+       * yet, so wait for some.  If there is data and it still can't
+       * be spliced, the pipe is full.
+       */
+      if (waited)
+        return 0;
+      if (poll (&pfd, 1, -1) == -1 && errno != EINTR)
+        return -1;
+      waited = true;
+      continue;
+    }
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = EBADMSG;          /* partial record read */
+      return -1;
+    }
+    waited = false;
+    *moved += r;
     len -= r;
   }
 
   return 1;
 }
+#endif /* HAVE_SPLICE */
+
+/* Read from the message passed to connection_handle_message.  Data
+ * which the event loop discarded reads as garbage.
+ */
+static int
+msg_recv (struct connection *conn, void *vbuf, size_t len)
+{
+  struct message *msg = conn->msg;
+  char *buf = vbuf;
+  size_t n;
+
+  if (msg == NULL || len > msg->hdr_len + msg->data_len - conn->msg_pos) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if (conn->msg_pos < msg->hdr_len) {
+    n = msg->hdr_len - conn->msg_pos;
+    if (n > len)
+      n = len;
+    memcpy (buf, &msg->hdr[conn->msg_pos], n);
+    conn->msg_pos += n;
+    buf += n;
+    len -= n;
+  }
+  if (len > 0 && msg->data)
+    memcpy (buf, &msg->data[conn->msg_pos - msg->hdr_len], len);
+  conn->msg_pos += len;
+
+  return 1;
+}
 
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
@@ -1090,6 +3442,7 @@ raw_recv (struct connection *conn, void *vbuf, size_t len)
 static void
 raw_close (struct connection *conn)
 {
+  free (conn->recv_buf);
   if (conn->sockin >= 0)
     close (conn->sockin);
   if (conn->sockout >= 0 && conn->sockin != conn->sockout)
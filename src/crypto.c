@@ -51,6 +51,9 @@
 
 #include <gnutls/gnutls.h>
 
+/* Maximum plaintext size of a TLS record. */
+#define TLS_RECORD_SIZE 16384
+
 static gnutls_certificate_credentials_t x509_creds;
 
 static void print_gnutls_error (int err, const char *fs, ...)
@@ -281,10 +284,11 @@ crypto_recv (struct connection *conn, void *vbuf, size_t len)
 }
 
 /* Write buffer to GnuTLS and either succeed completely
- * (returns 0) or fail (returns -1).
+ * (returns 0) or fail (returns -1).  If the session is corked the
+ * data is only buffered.
  */
 static int
-crypto_send (struct connection *conn, const void *vbuf, size_t len)
+send_records (struct connection *conn, const void *vbuf, size_t len)
 {
   gnutls_session_t *session = connection_get_crypto_session (conn);
   const char *buf = vbuf;
@@ -294,7 +298,7 @@ crypto_send (struct connection *conn, const void *vbuf, size_t len)
 
   while (len > 0) {
     r = gnutls_record_send (*session, buf, len);
-    if (r == -1) {
+    if (r < 0) {
       if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
         continue;
       return -1;
@@ -306,6 +310,81 @@ crypto_send (struct connection *conn, const void *vbuf, size_t len)
   return 0;
 }
 
+/* Flush any data held back by an earlier send with SEND_MORE. */
+static int
+uncork (gnutls_session_t *session)
+{
+  int r;
+
+  do
+    r = gnutls_record_uncork (*session, GNUTLS_RECORD_WAIT);
+  while (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN);
+
+  return r < 0 ? -1 : 0;
+}
+
+static int
+crypto_send (struct connection *conn, const void *buf, size_t len)
+{
+  gnutls_session_t *session = connection_get_crypto_session (conn);
+
+  assert (session != NULL);
+
+  if (send_records (conn, buf, len) == -1)
+    return -1;
+  return uncork (session);
+}
+
+/* Send a list of buffers over TLS.  The leading buffers (usually a
+ * small reply header) are coalesced with the start of the payload so
+ * that they go out in a single TLS record, and the rest of the
+ * payload is sent directly.  If flags contains SEND_MORE, the data is
+ * corked and held back until the next send without it.
+ */
+static int
+crypto_sendv (struct connection *conn, const struct iovec *iov, int iovcnt,
+              int flags)
+{
+  gnutls_session_t *session = connection_get_crypto_session (conn);
+  char record[TLS_RECORD_SIZE];
+  size_t n = 0, offset = 0, len;
+  int i = 0;
+
+  assert (session != NULL);
+
+  if (flags & SEND_MORE) {
+    gnutls_record_cork (*session);
+    for (i = 0; i < iovcnt; ++i)
+      if (send_records (conn, iov[i].iov_base, iov[i].iov_len) == -1)
+        return -1;
+    return 0;
+  }
+
+  while (i < iovcnt && n < sizeof record) {
+    len = iov[i].iov_len - offset;
+    if (len > sizeof record - n)
+      len = sizeof record - n;
+    memcpy (&record[n], (const char *) iov[i].iov_base + offset, len);
+    n += len;
+    offset += len;
+    if (offset == iov[i].iov_len) {
+      i++;
+      offset = 0;
+    }
+  }
+  if (send_records (conn, record, n) == -1)
+    return -1;
+
+  for (; i < iovcnt; ++i) {
+    if (send_records (conn, (const char *) iov[i].iov_base + offset,
+                     iov[i].iov_len - offset) == -1)
+      return -1;
+    offset = 0;
+  }
+
+  return uncork (session);
+}
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  */
@@ -383,7 +462,10 @@ crypto_negotiate_tls (struct connection *conn, int sockin, int sockout)
   connection_set_crypto_session (conn, session);
   connection_set_recv (conn, crypto_recv);
   connection_set_send (conn, crypto_send);
+  connection_set_sendv (conn, crypto_sendv);
   connection_set_close (conn, crypto_close);
+  connection_set_sendfile (conn, NULL);
+  connection_set_recvfile (conn, NULL);
 
   /* Perform the handshake. */
   debug ("starting TLS handshake");
@@ -0,0 +1,573 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Event-driven connection engine (--engine=epoll).
+ *
+ * With the default engine every connection has its own thread which
+ * spends most of its life blocked in read(2) waiting for the next
+ * request.  This engine instead uses one thread calling epoll_wait(2)
+ * to find connections with data to read.  That thread reads without
+ * blocking until it has a complete message from the client (a
+ * handshake option, or a request and its write data), and hands the
+ * message to a fixed-size pool of worker threads which call the
+ * plugin and send the reply.  So no worker waits for the next request
+ * from an idle client or for the data of a slow write, and an idle
+ * connection costs only its struct connection, the plugin handle and
+ * a little bookkeeping.  Replies are still sent with blocking writes,
+ * so a client which does not read its replies holds up a worker.
+ *
+ * Each socket is registered with EPOLLONESHOT when the connection is
+ * opened, and re-armed each time the event loop wants more data.
+ * Handshake messages are processed one at a time.  For plugins which
+ * can handle parallel requests, up to --threads requests per
+ * connection can be processed at once.  Otherwise the event loop
+ * stops reading until the reply to the previous request has been
+ * sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <pthread.h>
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Maximum number of events returned by a single call to epoll_wait. */
+#define MAX_EVENTS 64
+
+struct evconn;
+
+/* A unit of work for the worker threads: a complete message, or (if
+ * the connection has not been opened yet) the start of the handshake.
+ */
+struct work {
+  struct work *next;            /* Next in the work queue. */
+  struct evconn *ec;
+  struct message msg;
+};
+
+struct evconn {
+  struct connection *conn;      /* NULL until the connection is opened. */
+  int sock;
+  size_t instance_num;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  /* The message being read, only used by the event loop. */
+  struct work *cur;
+  uint64_t got;                 /* Bytes of cur->msg read so far. */
+  bool discard;                 /* Don't keep the message data. */
+
+  /* Protected by lock. */
+  unsigned refs;
+  unsigned busy;                /* Messages being processed. */
+  bool paused;                  /* Waiting for busy to drop. */
+};
+
+static int epfd = -1;
+static int wakefd[2] = { -1, -1 };
+static pthread_t loop_thread;
+static pthread_t *workers;
+static size_t nr_workers;
+
+/* This lock protects the work queue, the stopping flag and the
+ * reference counts and busy counts of every connection.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct work *queue_head, *queue_tail;
+static bool stopping;
+
+static void
+enqueue (struct work *w)
+{
+  pthread_mutex_lock (&lock);
+  w->next = NULL;
+  if (queue_tail)
+    queue_tail->next = w;
+  else
+    queue_head = w;
+  queue_tail = w;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+}
+
+static void
+free_work (struct work *w)
+{
+  if (w) {
+    bufpool_free (w->msg.data);
+    free (w);
+  }
+}
+
+/* Drop a reference.  The event loop holds one while it is reading
+ * from the connection, and there is one for each message being
+ * processed.  When the last reference goes away the connection is
+ * freed.
+ */
+static void
+put_ref (struct evconn *ec)
+{
+  bool last;
+
+  pthread_mutex_lock (&lock);
+  assert (ec->refs > 0);
+  last = --ec->refs == 0;
+  pthread_mutex_unlock (&lock);
+
+  if (last) {
+    debug ("closing connection");
+    epoll_ctl (epfd, EPOLL_CTL_DEL, ec->sock, NULL);
+    connection_free (ec->conn);   /* also closes the socket */
+    free_work (ec->cur);
+    free (ec);
+  }
+}
+
+/* Stop reading from the connection, dropping the reading reference. */
+static void
+stop_reading (struct evconn *ec)
+{
+  free_work (ec->cur);
+  ec->cur = NULL;
+  put_ref (ec);
+}
+
+/* Wait until the socket is readable again. */
+static void
+rearm (struct evconn *ec)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = ec;
+  if (epoll_ctl (epfd, EPOLL_CTL_MOD, ec->sock, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    stop_reading (ec);
+  }
+}
+
+/* Number of messages from the connection which may be processed at
+ * the same time.
+ */
+static unsigned
+max_busy (struct evconn *ec)
+{
+  if (connection_negotiating (ec->conn) ||
+      plugin_thread_model () < NBDKIT_THREAD_MODEL_PARALLEL)
+    return 1;
+  return nr_workers;
+}
+
+/* Called by the event loop when the socket is readable.  Reads as
+ * much as is available without blocking, queuing each complete
+ * message for the workers.
+ */
+static void
+read_messages (struct evconn *ec)
+{
+  static char scratch[65536];   /* Only used by the event loop thread. */
+  struct message *msg;
+  void *p;
+  size_t want;
+  ssize_t n;
+  int r;
+
+  for (;;) {
+    if (ec->cur == NULL) {
+      pthread_mutex_lock (&lock);
+      if (ec->busy >= max_busy (ec)) {
+        /* The worker which finishes a message will re-arm. */
+        ec->paused = true;
+        pthread_mutex_unlock (&lock);
+        return;
+      }
+      pthread_mutex_unlock (&lock);
+
+      ec->cur = calloc (1, sizeof *ec->cur);
+      if (ec->cur == NULL) {
+        perror ("calloc");
+        stop_reading (ec);
+        return;
+      }
+      ec->cur->ec = ec;
+      ec->cur->msg.hdr_len = connection_header_size (ec->conn);
+      assert (ec->cur->msg.hdr_len <= MAX_MESSAGE_HEADER);
+      ec->got = 0;
+      ec->discard = false;
+    }
+    msg = &ec->cur->msg;
+
+    if (ec->got < msg->hdr_len) {
+      p = &msg->hdr[ec->got];
+      want = msg->hdr_len - ec->got;
+    }
+    else {
+      want = msg->data_len - (ec->got - msg->hdr_len);
+      if (ec->discard) {
+        p = scratch;
+        if (want > sizeof scratch)
+          want = sizeof scratch;
+      }
+      else
+        p = &msg->data[ec->got - msg->hdr_len];
+    }
+
+    if (want > 0) {
+      n = recv (ec->sock, p, want, MSG_DONTWAIT);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          rearm (ec);
+          return;
+        }
+        debug ("recv: %m");
+        stop_reading (ec);
+        return;
+      }
+      if (n == 0) {
+        debug ("client closed input socket");
+        stop_reading (ec);
+        return;
+      }
+      ec->got += n;
+
+      /* Once the header is complete we know how much data follows. */
+      if (ec->got == msg->hdr_len) {
+        r = connection_data_size (ec->conn, msg->hdr, &msg->data_len);
+        if (r == -1) {
+          stop_reading (ec);
+          return;
+        }
+        ec->discard = r == 0;
+        if (!ec->discard && msg->data_len > 0) {
+          msg->data = bufpool_alloc (msg->data_len);
+          if (msg->data == NULL) {
+            perror ("bufpool_alloc");
+            stop_reading (ec);
+            return;
+          }
+        }
+      }
+    }
+
+    if (ec->got == msg->hdr_len + msg->data_len) {
+      pthread_mutex_lock (&lock);
+      ec->busy++;
+      ec->refs++;
+      pthread_mutex_unlock (&lock);
+      enqueue (ec->cur);
+      ec->cur = NULL;
+    }
+  }
+}
+
+static void
+open_connection (struct evconn *ec)
+{
+  struct epoll_event ev;
+
+  debug ("accepted connection");
+
+  threadlocal_set_name (NULL);
+  ec->conn = connection_start (ec->sock, nr_workers);
+  if (!ec->conn) {
+    free (ec);
+    return;
+  }
+
+  /* The socket is added to the epoll set only once, before anything
+   * can be read from it.  From now on the event loop owns the
+   * reference.
+   */
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = ec;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, ec->sock, &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    connection_free (ec->conn);
+    free (ec);
+  }
+}
+
+static void
+process_message (struct work *w)
+{
+  struct evconn *ec = w->ec;
+  bool resume;
+  int r;
+
+  r = connection_handle_message (ec->conn, &w->msg);
+  free_work (w);
+
+  /* Make the event loop notice that the connection is finished. */
+  if (r < 0)
+    shutdown (ec->sock, SHUT_RDWR);
+  else if (r == 0)
+    shutdown (ec->sock, SHUT_RD);
+
+  pthread_mutex_lock (&lock);
+  ec->busy--;
+  resume = ec->paused;
+  ec->paused = false;
+  pthread_mutex_unlock (&lock);
+
+  if (resume)
+    rearm (ec);
+  put_ref (ec);
+}
+
+static void *
+worker_thread (void *arg)
+{
+  struct work *w;
+
+  threadlocal_new_server_thread ();
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (!queue_head && !stopping)
+      pthread_cond_wait (&cond, &lock);
+    if (stopping) {
+      pthread_mutex_unlock (&lock);
+      break;
+    }
+    w = queue_head;
+    queue_head = w->next;
+    if (!queue_head)
+      queue_tail = NULL;
+    pthread_mutex_unlock (&lock);
+
+    threadlocal_set_instance_num (w->ec->instance_num);
+    threadlocal_set_sockaddr ((struct sockaddr *) &w->ec->addr,
+                              w->ec->addrlen);
+    if (!w->ec->conn) {
+      open_connection (w->ec);
+      free (w);
+    }
+    else {
+      threadlocal_set_name (plugin_name ());
+      process_message (w);
+    }
+  }
+
+  return NULL;
+}
+
+static void *
+event_loop (void *arg)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("eventloop");
+
+  /* Buffers for write data are freed by the workers. */
+  bufpool_share ();
+
+  while (!stopping) {
+    n = epoll_wait (epfd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("epoll_wait");
+      exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; ++i) {
+      /* NULL is the wake up pipe, see eventloop_stop. */
+      if (events[i].data.ptr != NULL)
+        read_messages (events[i].data.ptr);
+    }
+  }
+
+  return NULL;
+}
+
+void
+eventloop_start (void)
+{
+  struct epoll_event ev;
+  size_t i;
+  int err;
+
+  nr_workers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror ("epoll_create1");
+    exit (EXIT_FAILURE);
+  }
+
+  if (pipe2 (wakefd, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, wakefd[0], &ev) == -1) {
+    perror ("epoll_ctl");
+    exit (EXIT_FAILURE);
+  }
+
+  workers = calloc (nr_workers, sizeof *workers);
+  if (workers == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_workers; ++i) {
+    err = pthread_create (&workers[i], NULL, worker_thread, NULL);
+    if (err != 0) {
+      fprintf (stderr, "%s: pthread_create: %s\n",
+               program_name, strerror (err));
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  err = pthread_create (&loop_thread, NULL, event_loop, NULL);
+  if (err != 0) {
+    fprintf (stderr, "%s: pthread_create: %s\n",
+             program_name, strerror (err));
+    exit (EXIT_FAILURE);
+  }
+
+  debug ("using epoll engine with %zu worker threads", nr_workers);
+}
+
+/* Called from the accept loop.  The plugin is opened and the start of
+ * the handshake sent by one of the worker threads, which then adds the
+ * connection to the epoll set.
+ */
+void
+eventloop_add_connection (int sock, size_t instance_num,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+  struct evconn *ec;
+  struct work *w;
+
+  ec = calloc (1, sizeof *ec);
+  w = calloc (1, sizeof *w);
+  if (ec == NULL || w == NULL) {
+    perror ("calloc");
+    free (ec);
+    free (w);
+    close (sock);
+    return;
+  }
+  ec->sock = sock;
+  ec->instance_num = instance_num;
+  if (addrlen > sizeof ec->addr)
+    addrlen = sizeof ec->addr;
+  memcpy (&ec->addr, addr, addrlen);
+  ec->addrlen = addrlen;
+  ec->refs = 1;
+  w->ec = ec;
+  enqueue (w);
+}
+
+/* Stop the event loop and worker threads.  Connections which are
+ * still open are abandoned since the server is about to exit.
+ */
+void
+eventloop_stop (void)
+{
+  size_t i;
+  char c = 0;
+
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_broadcast (&cond);
+  pthread_mutex_unlock (&lock);
+
+  if (write (wakefd[1], &c, 1) == -1)
+    perror ("write");
+
+  /* Workers might be blocked in the plugin or on a slow client, so
+   * don't wait for them here.  main() waits (but not forever) for all
+   * threads to finish.
+   */
+  for (i = 0; i < nr_workers; ++i)
+    pthread_detach (workers[i]);
+  pthread_detach (loop_thread);
+  free (workers);
+  workers = NULL;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* epoll is not available on this platform.  main.c rejects
+ * --engine=epoll so these are never called.
+ */
+
+void
+eventloop_start (void)
+{
+  abort ();
+}
+
+void
+eventloop_add_connection (int sock, size_t instance_num,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+  abort ();
+}
+
+void
+eventloop_stop (void)
+{
+  abort ();
+}
+
+#endif /* !HAVE_SYS_EPOLL_H */
@@ -0,0 +1,152 @@
+/* nbdkit
+ * Copyright (C) 2018 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Lists of extents, filled in by the plugin's .extents callback to
+ * answer NBD_CMD_BLOCK_STATUS.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+struct nbdkit_extents {
+  struct extent *extents;
+  size_t nr, allocated;
+
+  uint64_t start, end;          /* Range the caller asked about. */
+  uint64_t next;                /* Where the next extent must start. */
+};
+
+/* Create an empty list of extents for the range [start, end). */
+struct nbdkit_extents *
+extents_new (uint64_t start, uint64_t end)
+{
+  struct nbdkit_extents *exts;
+
+  exts = calloc (1, sizeof *exts);
+  if (exts == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  exts->start = exts->next = start;
+  exts->end = end;
+  return exts;
+}
+
+void
+extents_free (struct nbdkit_extents *exts)
+{
+  if (exts) {
+    free (exts->extents);
+    free (exts);
+  }
+}
+
+size_t
+extents_count (const struct nbdkit_extents *exts)
+{
+  return exts->nr;
+}
+
+struct extent
+extents_get (const struct nbdkit_extents *exts, size_t i)
+{
+  return exts->extents[i];
+}
+
+/* Called by the plugin to add an extent.  Extents must be added in
+ * ascending order with no gaps between them.  Anything before the
+ * start or after the end of the requested range is ignored, and
+ * adjacent extents of the same type are merged.
+ */
+int
+nbdkit_add_extent (struct nbdkit_extents *exts,
+                   uint64_t offset, uint64_t length, uint32_t type)
+{
+  struct extent *p;
+  uint64_t end;
+
+  if (length == 0)
+    return 0;
+
+  if (exts->nr == 0 ? offset > exts->next : offset != exts->next) {
+    nbdkit_error ("nbdkit_add_extent: "
+                  "extents must be added in ascending order and "
+                  "must be contiguous");
+    errno = ERANGE;
+    return -1;
+  }
+  exts->next = offset + length;
+
+  /* Clip to the requested range. */
+  end = offset + length;
+  if (offset < exts->start)
+    offset = exts->start;
+  if (end > exts->end)
+    end = exts->end;
+  if (offset >= end)
+    return 0;
+
+  /* Merge with the previous extent if it has the same type. */
+  if (exts->nr > 0 && exts->extents[exts->nr-1].type == type) {
+    exts->extents[exts->nr-1].length += end - offset;
+    return 0;
+  }
+
+  if (exts->nr >= exts->allocated) {
+    size_t n = exts->allocated ? exts->allocated * 2 : 16;
+
+    p = realloc (exts->extents, n * sizeof *p);
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    exts->extents = p;
+    exts->allocated = n;
+  }
+
+  p = &exts->extents[exts->nr++];
+  p->offset = offset;
+  p->length = end - offset;
+  p->type = type;
+  return 0;
+}
@@ -0,0 +1,198 @@
+/* nbdkit
+ * Copyright (C) 2018 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Flush manager.
+ *
+ * Clients often send NBD_CMD_FLUSH far more often than they write,
+ * and every flush which reaches the plugin usually means an expensive
+ * fdatasync.  This keeps a write generation counter, which is
+ * incremented each time a write-like request completes, and the
+ * generation covered by the last successful flush.  A flush when
+ * nothing has been written since is skipped.  Flushes which arrive
+ * while another flush is running wait for it if it already covers
+ * their writes, or else are grouped together into one flush when it
+ * finishes.
+ *
+ * Normally each connection has its own state, since a flush on one
+ * handle need not persist writes made through other handles.  If the
+ * plugin allows multi-conn then a flush persists writes from all
+ * connections, so those connections share a single state.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+struct flush_state {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool shared;                  /* The state shared by multi-conn clients. */
+  uint64_t write_gen;           /* Number of completed writes. */
+  uint64_t flushed_gen;         /* Writes covered by the last flush. */
+  bool in_progress;             /* A flush is running ... */
+  uint64_t in_progress_gen;     /* ... which covers this many writes. */
+  uint64_t flushes_done;        /* Number of flushes finished. */
+  int last_error;               /* Error from the last failed flush. */
+};
+
+static struct flush_state shared_state = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .shared = true,
+};
+
+struct flush_state *
+flush_state_shared (void)
+{
+  return &shared_state;
+}
+
+struct flush_state *
+flush_state_new (void)
+{
+  struct flush_state *fs;
+
+  fs = calloc (1, sizeof *fs);
+  if (fs == NULL) {
+    perror ("calloc");
+    return NULL;
+  }
+  pthread_mutex_init (&fs->lock, NULL);
+  pthread_cond_init (&fs->cond, NULL);
+  return fs;
+}
+
+void
+flush_state_free (struct flush_state *fs)
+{
+  if (!fs || fs->shared)
+    return;
+
+  pthread_mutex_destroy (&fs->lock);
+  pthread_cond_destroy (&fs->cond);
+  free (fs);
+}
+
+/* Called after a request which may have modified the data (whether
+ * or not it succeeded) has completed.
+ */
+void
+flush_mark_dirty (struct flush_state *fs)
+{
+  pthread_mutex_lock (&fs->lock);
+  fs->write_gen++;
+  pthread_mutex_unlock (&fs->lock);
+}
+
+/* Make every write which completed before this call persistent,
+ * calling plugin_flush only if necessary.  On error returns -1 with
+ * the error available through threadlocal_get_error or errno, as if
+ * plugin_flush had failed.
+ */
+int
+flush_wait (struct flush_state *fs, struct connection *conn)
+{
+  uint64_t target, gen, seq;
+  int r, err;
+
+  pthread_mutex_lock (&fs->lock);
+  target = fs->write_gen;
+
+  for (;;) {
+    if (fs->flushed_gen >= target) {
+      pthread_mutex_unlock (&fs->lock);
+      debug ("flush: no writes since the last flush");
+      return 0;
+    }
+    if (!fs->in_progress)
+      break;
+
+    /* Wait for the running flush.  If it covers our writes then its
+     * result is ours too, otherwise go round and start another.
+     */
+    gen = fs->in_progress_gen;
+    seq = fs->flushes_done;
+    while (fs->flushes_done == seq)
+      pthread_cond_wait (&fs->cond, &fs->lock);
+    if (gen >= target && fs->flushed_gen < target) {
+      err = fs->last_error;
+      pthread_mutex_unlock (&fs->lock);
+      threadlocal_set_error (err);
+      errno = err;
+      return -1;
+    }
+  }
+
+  /* Start a flush covering every write which has completed so far,
+   * including writes by other clients waiting behind us.
+   */
+  fs->in_progress = true;
+  fs->in_progress_gen = gen = fs->write_gen;
+  pthread_mutex_unlock (&fs->lock);
+
+  errno = 0;
+  r = plugin_flush (conn);
+  err = 0;
+  if (r == -1) {
+    err = threadlocal_get_error ();
+    if (!err && plugin_errno_is_preserved ())
+      err = errno;
+    if (!err)
+      err = EIO;
+  }
+
+  pthread_mutex_lock (&fs->lock);
+  fs->in_progress = false;
+  fs->flushes_done++;
+  if (r == 0) {
+    if (fs->flushed_gen < gen)
+      fs->flushed_gen = gen;
+  }
+  else
+    fs->last_error = err;
+  pthread_cond_broadcast (&fs->cond);
+  pthread_mutex_unlock (&fs->lock);
+
+  if (r == -1)
+    errno = err;
+  return r;
+}
@@ -37,6 +37,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
 #include "nbdkit-plugin.h"
@@ -92,6 +93,8 @@
 #endif
 
 /* main.c */
+extern const char *cpus;
+extern const char *numa;
 extern const char *exportname;
 extern const char *ipaddr;
 extern int newstyle;
@@ -101,33 +104,97 @@ extern const char *selinux_label;
 extern int tls;
 extern const char *tls_certificates_dir;
 extern int tls_verify_peer;
+extern unsigned threads;
+extern unsigned connection_threads;
+/* Upper limits for --connection-threads and --listen-shards. */
+#define MAX_CONNECTION_THREADS 4096
+#define MAX_LISTEN_SHARDS 1024
+/* Default stack size of --connection-threads pool threads. */
+#define DEFAULT_THREAD_STACK_SIZE (1024 * 1024)
+extern size_t thread_stack_size;
+extern unsigned busy_poll;
+extern unsigned listen_shards;
+extern int engine;
+extern int io_uring;
 extern char *unixsocket;
 extern int verbose;
 
 extern volatile int quit;
 
+/* affinity.c */
+extern void affinity_init (void);
+extern void affinity_pin_connection (size_t instance_num);
+extern int affinity_cpu_node (int cpu);
+extern int affinity_current_node (void);
+extern void affinity_place_memory (void *addr, size_t len, int node);
+
+/* bufpool.c */
+extern void bufpool_init (void);
+extern void bufpool_cleanup (void);
+extern void *bufpool_alloc (size_t size);
+extern void bufpool_free (void *buf);
+extern void bufpool_share (void);
+
 /* cleanup.c */
 extern void cleanup_free (void *ptr);
+extern void cleanup_bufpool_free (void *ptr);
+extern void cleanup_extents_free (void *ptr);
 #ifdef HAVE_ATTRIBUTE_CLEANUP
 #define CLEANUP_FREE __attribute__((cleanup (cleanup_free)))
+#define CLEANUP_BUFPOOL_FREE __attribute__((cleanup (cleanup_bufpool_free)))
+#define CLEANUP_EXTENTS_FREE __attribute__((cleanup (cleanup_extents_free)))
 #else
 #define CLEANUP_FREE
+#define CLEANUP_BUFPOOL_FREE
+#define CLEANUP_EXTENTS_FREE
 #endif
 
 /* connections.c */
+/* Default number of parallel requests per connection. */
+#define DEFAULT_PARALLEL_REQUESTS 16
 struct connection;
 typedef int (*connection_recv_function) (struct connection *, void *buf, size_t len);
 typedef int (*connection_send_function) (struct connection *, const void *buf, size_t len);
+typedef int (*connection_sendv_function) (struct connection *, const struct iovec *iov, int iovcnt, int flags);
+#define SEND_MORE 1 /* more data to follow, hold back partial packets */
 typedef void (*connection_close_function) (struct connection *);
+typedef int (*connection_sendfile_function) (struct connection *, int pipefd, size_t len, int flags);
+typedef int (*connection_recvfile_function) (struct connection *, int pipefd, size_t len, size_t *moved);
+
+/* A message from the client which the event loop (eventloop.c) has
+ * read in full: a fixed size header followed by 'data_len' bytes of
+ * data, which is NULL if it was discarded, or else was allocated with
+ * bufpool_alloc.
+ */
+#define MAX_MESSAGE_HEADER 32
+struct message {
+  char hdr[MAX_MESSAGE_HEADER];
+  size_t hdr_len;
+  char *data;
+  uint64_t data_len;
+};
 extern int handle_single_connection (int sockin, int sockout);
+extern struct connection *connection_open (int sockin, int sockout, size_t nworkers);
+extern struct connection *connection_start (int sock, size_t nworkers);
+extern bool connection_negotiating (struct connection *conn);
+extern size_t connection_header_size (struct connection *conn);
+extern int connection_data_size (struct connection *conn, const void *hdr, uint64_t *len);
+extern int connection_handle_message (struct connection *conn, struct message *msg);
+extern void connection_free (struct connection *conn);
 extern void connection_set_handle (struct connection *conn, void *handle);
 extern void *connection_get_handle (struct connection *conn);
 extern pthread_mutex_t *connection_get_request_lock (struct connection *conn);
+extern pthread_rwlock_t *connection_get_request_rwlock (struct connection *conn);
 extern void connection_set_crypto_session (struct connection *conn, void *session);
 extern void *connection_get_crypto_session (struct connection *conn);
+extern void connection_set_uring_session (struct connection *conn, void *session);
+extern void *connection_get_uring_session (struct connection *conn);
 extern void connection_set_recv (struct connection *, connection_recv_function);
 extern void connection_set_send (struct connection *, connection_send_function);
+extern void connection_set_sendv (struct connection *, connection_sendv_function);
 extern void connection_set_close (struct connection *, connection_close_function);
+extern void connection_set_sendfile (struct connection *, connection_sendfile_function);
+extern void connection_set_recvfile (struct connection *, connection_recvfile_function);
 
 /* crypto.c */
 #define root_tls_certificates_dir sysconfdir "/pki/" PACKAGE_NAME
@@ -138,7 +205,40 @@ extern int crypto_negotiate_tls (struct connection *conn, int sockin, int sockou
 /* errors.c */
 #define debug nbdkit_debug
 
+/* eventloop.c */
+#define ENGINE_THREADS 0
+#define ENGINE_EPOLL   1
+extern void eventloop_start (void);
+extern void eventloop_add_connection (int sock, size_t instance_num, const struct sockaddr *addr, socklen_t addrlen);
+extern void eventloop_stop (void);
+
+/* extents.c */
+struct extent {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t type;                /* NBDKIT_EXTENT_* */
+};
+extern struct nbdkit_extents *extents_new (uint64_t start, uint64_t end);
+extern void extents_free (struct nbdkit_extents *exts);
+extern size_t extents_count (const struct nbdkit_extents *exts);
+extern struct extent extents_get (const struct nbdkit_extents *exts, size_t i);
+
+/* flush.c */
+struct flush_state;
+extern struct flush_state *flush_state_shared (void);
+extern struct flush_state *flush_state_new (void);
+extern void flush_state_free (struct flush_state *fs);
+extern void flush_mark_dirty (struct flush_state *fs);
+extern int flush_wait (struct flush_state *fs, struct connection *conn);
+
 /* plugins.c */
+struct request_range {
+  uint64_t offset;
+  uint64_t count;
+  bool read;                    /* Request only reads data. */
+  bool write;                   /* Request modifies the range. */
+  struct request_range *next;   /* Private to plugins.c. */
+};
 extern void plugin_register (const char *_filename, void *_dl, struct nbdkit_plugin *(*plugin_init) (void));
 extern void plugin_cleanup (void);
 extern const char *plugin_name (void);
@@ -147,10 +247,11 @@ extern const char *plugin_version (void);
 extern void plugin_dump_fields (void);
 extern void plugin_config (const char *key, const char *value);
 extern void plugin_config_complete (void);
+extern int plugin_thread_model (void);
 extern void plugin_lock_connection (void);
 extern void plugin_unlock_connection (void);
-extern void plugin_lock_request (struct connection *conn);
-extern void plugin_unlock_request (struct connection *conn);
+extern void plugin_lock_request (struct connection *conn, struct request_range *range);
+extern void plugin_unlock_request (struct connection *conn, struct request_range *range);
 extern int plugin_errno_is_preserved (void);
 extern int plugin_open (struct connection *conn, int readonly);
 extern void plugin_close (struct connection *conn);
@@ -159,11 +260,22 @@ extern int plugin_can_write (struct connection *conn);
 extern int plugin_can_flush (struct connection *conn);
 extern int plugin_is_rotational (struct connection *conn);
 extern int plugin_can_trim (struct connection *conn);
+extern int plugin_can_extents (struct connection *conn);
+extern int plugin_can_multi_conn (struct connection *conn);
+extern int plugin_can_fua (struct connection *conn);
+extern int plugin_can_fast_zero (struct connection *conn);
+extern int plugin_block_size (struct connection *conn, uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
 extern int plugin_pread (struct connection *conn, void *buf, uint32_t count, uint64_t offset);
-extern int plugin_pwrite (struct connection *conn, void *buf, uint32_t count, uint64_t offset);
+extern int plugin_has_pread_fd (void);
+extern int plugin_pread_fd (struct connection *conn, uint32_t count, uint64_t offset, int *fd, uint64_t *fd_offset);
+extern int plugin_pwrite (struct connection *conn, void *buf, uint32_t count, uint64_t offset, uint32_t flags);
+extern int plugin_has_pwrite_fd (void);
+extern int plugin_pwrite_fd (struct connection *conn, uint32_t count, uint64_t offset, int *fd, uint64_t *fd_offset);
 extern int plugin_flush (struct connection *conn);
-extern int plugin_trim (struct connection *conn, uint32_t count, uint64_t offset);
-extern int plugin_zero (struct connection *conn, uint32_t count, uint64_t offset, int may_trim);
+extern int plugin_trim (struct connection *conn, uint64_t count, uint64_t offset, uint32_t flags);
+extern int plugin_zero (struct connection *conn, uint64_t count, uint64_t offset, uint32_t flags);
+extern int plugin_cache (struct connection *conn, uint64_t count, uint64_t offset);
+extern int plugin_extents (struct connection *conn, uint64_t count, uint64_t offset, uint32_t flags, struct nbdkit_extents *extents);
 
 /* sockets.c */
 extern int *bind_unix_socket (size_t *);
@@ -181,11 +293,17 @@ extern const char *threadlocal_get_name (void);
 extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
+extern int threadlocal_get_pipe (int *rfd, int *wfd, size_t *size);
+extern void threadlocal_discard_pipe (void);
 /*extern void threadlocal_get_sockaddr ();*/
 extern size_t get_running_threads (void);
 extern void incr_running_threads (void);
 extern void decr_running_threads (void);
 
+/* uring.c */
+extern void uring_init (void);
+extern int uring_setup_connection (struct connection *conn, int sockin, int sockout);
+
 /* Declare program_name. */
 #if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
 #include <errno.h>
@@ -73,20 +73,29 @@ static uid_t parseuser (const char *);
 static gid_t parsegroup (const char *);
 static unsigned int get_socket_activation (void);
 
+unsigned busy_poll;             /* --busy-poll */
+unsigned connection_threads;    /* --connection-threads */
+const char *cpus;               /* --cpus */
+int engine;                     /* --engine : 0=threads 1=epoll */
 int exit_with_parent;           /* --exit-with-parent */
 const char *exportname;         /* -e */
 int foreground;                 /* -f */
 const char *ipaddr;             /* -i */
+int io_uring;                   /* --io-uring */
 int newstyle;                   /* -n */
+const char *numa;               /* --numa */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
 int readonly;                   /* -r */
 char *run;                      /* --run */
 int listen_stdin;               /* -s */
+unsigned listen_shards;         /* --listen-shards */
 const char *selinux_label;      /* --selinux-label */
 int tls;                        /* --tls : 0=off 1=on 2=require */
 const char *tls_certificates_dir; /* --tls-certificates */
 int tls_verify_peer;            /* --tls-verify-peer */
+size_t thread_stack_size = DEFAULT_THREAD_STACK_SIZE; /* --thread-stack-size */
+unsigned threads;               /* -t */
 char *unixsocket;               /* -U */
 const char *user, *group;       /* -u & -g */
 int verbose;                    /* -v */
@@ -99,11 +108,15 @@ static char *random_fifo = NULL;
 
 enum { HELP_OPTION = CHAR_MAX + 1 };
 
-static const char *short_options = "e:fg:i:nop:P:rsu:U:vV";
+static const char *short_options = "e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
   { "help",       0, NULL, HELP_OPTION },
+  { "busy-poll",  1, NULL, 0 },
+  { "connection-threads", 1, NULL, 0 },
+  { "cpus",       1, NULL, 0 },
   { "dump-config",0, NULL, 0 },
   { "dump-plugin",0, NULL, 0 },
+  { "engine",     1, NULL, 0 },
   { "exit-with-parent", 0, NULL, 0 },
   { "export",     1, NULL, 'e' },
   { "export-name",1, NULL, 'e' },
@@ -113,8 +126,11 @@ static const struct option long_options[] = {
   { "group",      1, NULL, 'g' },
   { "ip-addr",    1, NULL, 'i' },
   { "ipaddr",     1, NULL, 'i' },
+  { "io-uring",   0, NULL, 0 },
+  { "listen-shards", 1, NULL, 0 },
   { "new-style",  0, NULL, 'n' },
   { "newstyle",   0, NULL, 'n' },
+  { "numa",       1, NULL, 0 },
   { "old-style",  0, NULL, 'o' },
   { "oldstyle",   0, NULL, 'o' },
   { "pid-file",   1, NULL, 'P' },
@@ -126,6 +142,8 @@ static const struct option long_options[] = {
   { "selinux-label", 1, NULL, 0 },
   { "single",     0, NULL, 's' },
   { "stdin",      0, NULL, 's' },
+  { "thread-stack-size", 1, NULL, 0 },
+  { "threads",    1, NULL, 't' },
   { "tls",        1, NULL, 0 },
   { "tls-certificates", 1, NULL, 0 },
   { "tls-verify-peer", 0, NULL, 0 },
@@ -139,11 +157,15 @@ static const struct option long_options[] = {
 static void
 usage (void)
 {
-  printf ("nbdkit [--dump-config] [--dump-plugin]\n"
-          "       [-e EXPORTNAME] [--exit-with-parent] [-f]\n"
-          "       [-g GROUP] [-i IPADDR]\n"
-          "       [--newstyle] [--oldstyle] [-P PIDFILE] [-p PORT] [-r]\n"
-          "       [--run CMD] [-s] [--selinux-label LABEL]\n"
+  printf ("nbdkit [--busy-poll USECS] [--connection-threads N] [--cpus CPUS]\n"
+          "       [--dump-config] [--dump-plugin]\n"
+          "       [-e EXPORTNAME] [--engine=threads|epoll]\n"
+          "       [--exit-with-parent] [-f]\n"
+          "       [-g GROUP] [-i IPADDR] [--io-uring] [--listen-shards N]\n"
+          "       [--newstyle] [--numa NODES] [--oldstyle]\n"
+          "       [-P PIDFILE] [-p PORT] [-r]\n"
+          "       [--run CMD] [-s] [--selinux-label LABEL] [-t THREADS]\n"
+          "       [--thread-stack-size SIZE]\n"
           "       [--tls=off|on|require] [--tls-certificates /path/to/certificates]\n"
           "       [--tls-verify-peer]\n"
           "       [-U SOCKET] [-u USER] [-v] [-V]\n"
@@ -187,6 +209,7 @@ main (int argc, char *argv[])
   size_t count;
 
   threadlocal_init ();
+  bufpool_init ();
 
   /* The default setting for TLS depends on whether we were
    * compiled with GnuTLS.
@@ -207,7 +230,39 @@ main (int argc, char *argv[])
 
     switch (c) {
     case 0:                     /* options which are long only */
-      if (strcmp (long_options[option_index].name, "dump-config") == 0) {
+      if (strcmp (long_options[option_index].name, "busy-poll") == 0) {
+        char *end;
+
+        errno = 0;
+        busy_poll = strtoul (optarg, &end, 0);
+        if (errno || *end) {
+          fprintf (stderr, "%s: cannot parse '%s' into busy poll time\n",
+                   program_name, optarg);
+          exit (EXIT_FAILURE);
+        }
+      }
+      else if (strcmp (long_options[option_index].name, "connection-threads") == 0) {
+        char *end;
+        unsigned long n;
+
+        errno = 0;
+        n = strtoul (optarg, &end, 0);
+        if (errno || *end) {
+          fprintf (stderr, "%s: cannot parse '%s' into connection threads\n",
+                   program_name, optarg);
+          exit (EXIT_FAILURE);
+        }
+        if (n > MAX_CONNECTION_THREADS) {
+          fprintf (stderr, "%s: --connection-threads must be at most %d\n",
+                   program_name, MAX_CONNECTION_THREADS);
+          exit (EXIT_FAILURE);
+        }
+        connection_threads = n;
+      }
+      else if (strcmp (long_options[option_index].name, "cpus") == 0) {
+        cpus = optarg;
+      }
+      else if (strcmp (long_options[option_index].name, "dump-config") == 0) {
         dump_config ();
         exit (EXIT_SUCCESS);
       }
@@ -224,6 +279,50 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
 #endif
       }
+      else if (strcmp (long_options[option_index].name, "engine") == 0) {
+        if (strcmp (optarg, "threads") == 0)
+          engine = ENGINE_THREADS;
+        else if (strcmp (optarg, "epoll") == 0) {
+#ifdef HAVE_SYS_EPOLL_H
+          engine = ENGINE_EPOLL;
+#else
+          fprintf (stderr, "%s: --engine=epoll is not supported on this platform\n",
+                   program_name);
+          exit (EXIT_FAILURE);
+#endif
+        }
+        else {
+          fprintf (stderr, "%s: --engine flag must be threads|epoll\n",
+                   program_name);
+          exit (EXIT_FAILURE);
+        }
+        break;
+      }
+      else if (strcmp (long_options[option_index].name, "io-uring") == 0) {
+        io_uring = 1;
+        break;
+      }
+      else if (strcmp (long_options[option_index].name, "listen-shards") == 0) {
+        char *end;
+        unsigned long n;
+
+        errno = 0;
+        n = strtoul (optarg, &end, 0);
+        if (errno || *end) {
+          fprintf (stderr, "%s: cannot parse '%s' into listen shards\n",
+                   program_name, optarg);
+          exit (EXIT_FAILURE);
+        }
+        if (n > MAX_LISTEN_SHARDS) {
+          fprintf (stderr, "%s: --listen-shards must be at most %d\n",
+                   program_name, MAX_LISTEN_SHARDS);
+          exit (EXIT_FAILURE);
+        }
+        listen_shards = n;
+      }
+      else if (strcmp (long_options[option_index].name, "numa") == 0) {
+        numa = optarg;
+      }
       else if (strcmp (long_options[option_index].name, "run") == 0) {
         if (socket_activation) {
           fprintf (stderr, "%s: cannot use socket activation with --run flag\n",
@@ -237,6 +336,18 @@ main (int argc, char *argv[])
         selinux_label = optarg;
         break;
       }
+      else if (strcmp (long_options[option_index].name, "thread-stack-size") == 0) {
+        int64_t size = nbdkit_parse_size (optarg);
+
+        if (size == -1)
+          exit (EXIT_FAILURE);
+        if (size != 0 && size < PTHREAD_STACK_MIN) {
+          fprintf (stderr, "%s: --thread-stack-size must be 0 or at least %d\n",
+                   program_name, (int) PTHREAD_STACK_MIN);
+          exit (EXIT_FAILURE);
+        }
+        thread_stack_size = size;
+      }
       else if (strcmp (long_options[option_index].name, "tls") == 0) {
         tls_set_on_cli = 1;
         if (strcmp (optarg, "off") == 0 || strcmp (optarg, "0") == 0)
@@ -327,6 +438,21 @@ main (int argc, char *argv[])
       listen_stdin = 1;
       break;
 
+    case 't':
+      {
+        char *end;
+
+        errno = 0;
+        threads = strtoul (optarg, &end, 0);
+        if (errno || *end) {
+          fprintf (stderr, "%s: cannot parse '%s' into threads\n",
+                   program_name, optarg);
+          exit (EXIT_FAILURE);
+        }
+        /* XXX Worth a maximum limit on threads? */
+      }
+      break;
+
     case 'U':
       if (socket_activation) {
         fprintf (stderr, "%s: cannot use socket activation with -U flag\n",
@@ -413,6 +539,9 @@ main (int argc, char *argv[])
   crypto_init (tls_set_on_cli);
   assert (tls != -1);
 
+  if (io_uring)
+    uring_init ();
+
   /* Implement --exit-with-parent early in case plugin initialization
    * takes a long time and the parent exits during that time.
    */
@@ -485,6 +614,7 @@ main (int argc, char *argv[])
     }
   }
 
+  affinity_init ();
   start_serving ();
 
   /* Wait, but not forever, for all threads to complete. */
@@ -494,6 +624,7 @@ main (int argc, char *argv[])
   debug ("waited %zus for running threads to complete", count);
 
   plugin_cleanup ();
+  bufpool_cleanup ();
 
   free (unixsocket);
   free (pidfile);
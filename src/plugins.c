@@ -38,8 +38,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include <dlfcn.h>
 
@@ -49,8 +51,32 @@
 static pthread_mutex_t connection_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t all_requests_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Maximum read or write request that we will handle. */
-#define MAX_REQUEST_SIZE (64 * 1024 * 1024)
+/* For NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING, the ranges of all
+ * requests which hold or are waiting for the request lock, in order
+ * of arrival.  A request may proceed once no earlier entry conflicts
+ * with it, so disjoint requests run in parallel and conflicting ones
+ * run in the order they arrived.
+ */
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ranges_cond = PTHREAD_COND_INITIALIZER;
+static struct request_range *ranges = NULL;
+
+/* When the plugin can't zero a range itself, zeroes are written from
+ * this read-only region, which is mapped once and shared by all
+ * threads.  Since it is never written, all of its pages map the
+ * kernel's zero page and it uses no memory.  Writes to a file
+ * descriptor repeat the region in an iovec of up to ZERO_REGION_IOVS
+ * elements.
+ */
+#define ZERO_REGION_SIZE (1024 * 1024)
+#define ZERO_REGION_IOVS 64
+static const char *zero_region;
+static pthread_once_t zero_region_once = PTHREAD_ONCE_INIT;
+
+/* Plugin callbacks take 32 bit counts, so requests with larger
+ * (64 bit) lengths are split into pieces of at most this size.
+ */
+#define MAX_PLUGIN_COUNT (UINT32_C(1) << 31)
 
 /* Currently the server can only load one plugin (see TODO).  Hence we
  * can just use globals to store these.
@@ -86,7 +112,7 @@ plugin_register (const char *_filename,
   }
 
   /* Check for incompatible future versions. */
-  if (_plugin->_api_version != 1) {
+  if (_plugin->_api_version < 1 || _plugin->_api_version > 2) {
     fprintf (stderr, "%s: %s: plugin is incompatible with this version of nbdkit (_api_version = %d)\n",
              program_name, filename, _plugin->_api_version);
     exit (EXIT_FAILURE);
@@ -121,7 +147,8 @@ plugin_register (const char *_filename,
              program_name, filename);
     exit (EXIT_FAILURE);
   }
-  if (plugin.pread == NULL) {
+  if (plugin._api_version == 1 ? plugin._pread_old == NULL
+      : plugin.pread == NULL) {
     fprintf (stderr, "%s: %s: plugin must have a .pread callback\n",
              program_name, filename);
     exit (EXIT_FAILURE);
@@ -231,6 +258,12 @@ plugin_dump_fields (void)
   case NBDKIT_THREAD_MODEL_PARALLEL:
     printf ("parallel");
     break;
+  case NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING:
+    printf ("serialize_overlapping");
+    break;
+  case NBDKIT_THREAD_MODEL_SERIALIZE_WRITES:
+    printf ("serialize_writes");
+    break;
   default:
     printf ("%d # unknown thread model!", plugin._thread_model);
     break;
@@ -253,11 +286,29 @@ plugin_dump_fields (void)
   HAS (can_flush);
   HAS (is_rotational);
   HAS (can_trim);
-  HAS (pread);
-  HAS (pwrite);
-  HAS (flush);
-  HAS (trim);
-  HAS (zero);
+  if (plugin._api_version == 1) {
+    if (plugin._pread_old) printf ("has_pread=1\n");
+    if (plugin._pwrite_old) printf ("has_pwrite=1\n");
+    if (plugin._flush_old) printf ("has_flush=1\n");
+    if (plugin._trim_old) printf ("has_trim=1\n");
+    if (plugin._zero_old) printf ("has_zero=1\n");
+  }
+  else {
+    HAS (pread);
+    HAS (pwrite);
+    HAS (flush);
+    HAS (trim);
+    HAS (zero);
+  }
+  HAS (pread_fd);
+  HAS (pwrite_fd);
+  HAS (can_extents);
+  HAS (extents);
+  HAS (block_size);
+  HAS (can_multi_conn);
+  HAS (can_fua);
+  HAS (cache);
+  HAS (can_fast_zero);
 #undef HAS
 }
 
@@ -295,6 +346,14 @@ plugin_config_complete (void)
     exit (EXIT_FAILURE);
 }
 
+int
+plugin_thread_model (void)
+{
+  assert (dl);
+
+  return plugin._thread_model;
+}
+
 /* Handle the thread model. */
 void
 plugin_lock_connection (void)
@@ -318,11 +377,84 @@ plugin_unlock_connection (void)
   }
 }
 
+/* Two requests conflict if their ranges overlap and at least one of
+ * them writes.
+ */
+static bool
+ranges_conflict (const struct request_range *a,
+                 const struct request_range *b)
+{
+  return (a->write || b->write) &&
+    a->offset < b->offset + b->count && b->offset < a->offset + a->count;
+}
+
+static bool
+range_must_wait (const struct request_range *range)
+{
+  const struct request_range *p;
+
+  for (p = ranges; p != range; p = p->next)
+    if (ranges_conflict (p, range))
+      return true;
+  return false;
+}
+
+static void
+lock_range (struct request_range *range)
+{
+  struct request_range **pp;
+
+  pthread_mutex_lock (&ranges_lock);
+  range->next = NULL;
+  for (pp = &ranges; *pp != NULL; pp = &(*pp)->next)
+    ;
+  *pp = range;
+  while (range_must_wait (range))
+    pthread_cond_wait (&ranges_cond, &ranges_lock);
+  pthread_mutex_unlock (&ranges_lock);
+}
+
+static void
+unlock_range (struct request_range *range)
+{
+  struct request_range **pp;
+
+  pthread_mutex_lock (&ranges_lock);
+  for (pp = &ranges; *pp != range; pp = &(*pp)->next)
+    assert (*pp != NULL);
+  *pp = range->next;
+  pthread_cond_broadcast (&ranges_cond);
+  pthread_mutex_unlock (&ranges_lock);
+}
+
+/* 'range' describes the part of the disk which the request touches,
+ * and must stay valid until plugin_unlock_request is called.  It may
+ * be NULL for requests (such as the handshake) which don't touch the
+ * disk contents.
+ */
 void
-plugin_lock_request (struct connection *conn)
+plugin_lock_request (struct connection *conn, struct request_range *range)
 {
   assert (dl);
 
+  if (plugin._thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING &&
+      range) {
+    debug ("acquire range lock: offset=%" PRIu64 " count=%" PRIu64 " %s",
+           range->offset, range->count, range->write ? "write" : "read");
+    lock_range (range);
+  }
+
+  if (plugin._thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_WRITES) {
+    if (range && range->read) {
+      debug ("acquire per-connection request lock for reading");
+      pthread_rwlock_rdlock (connection_get_request_rwlock (conn));
+    }
+    else {
+      debug ("acquire per-connection request lock for writing");
+      pthread_rwlock_wrlock (connection_get_request_rwlock (conn));
+    }
+  }
+
   if (plugin._thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS) {
     debug ("acquire global request lock");
     pthread_mutex_lock (&all_requests_lock);
@@ -335,7 +467,7 @@ plugin_lock_request (struct connection *conn)
 }
 
 void
-plugin_unlock_request (struct connection *conn)
+plugin_unlock_request (struct connection *conn, struct request_range *range)
 {
   assert (dl);
 
@@ -348,6 +480,17 @@ plugin_unlock_request (struct connection *conn)
     debug ("release global request lock");
     pthread_mutex_unlock (&all_requests_lock);
   }
+
+  if (plugin._thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_WRITES) {
+    debug ("release per-connection request lock");
+    pthread_rwlock_unlock (connection_get_request_rwlock (conn));
+  }
+
+  if (plugin._thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING &&
+      range) {
+    debug ("release range lock");
+    unlock_range (range);
+  }
 }
 
 int
@@ -403,6 +546,13 @@ plugin_get_size (struct connection *conn)
   return plugin.get_size (connection_get_handle (conn));
 }
 
+/* Plugins using the version 1 API store the data callbacks in the
+ * "_old" fields of the struct, which have different signatures.
+ */
+#define PLUGIN_HAS(field) \
+  (plugin._api_version == 1 ? plugin._##field##_old != NULL \
+   : plugin.field != NULL)
+
 int
 plugin_can_write (struct connection *conn)
 {
@@ -414,7 +564,7 @@ plugin_can_write (struct connection *conn)
   if (plugin.can_write)
     return plugin.can_write (connection_get_handle (conn));
   else
-    return plugin.pwrite != NULL;
+    return PLUGIN_HAS (pwrite);
 }
 
 int
@@ -428,7 +578,7 @@ plugin_can_flush (struct connection *conn)
   if (plugin.can_flush)
     return plugin.can_flush (connection_get_handle (conn));
   else
-    return plugin.flush != NULL;
+    return PLUGIN_HAS (flush);
 }
 
 int
@@ -456,7 +606,90 @@ plugin_can_trim (struct connection *conn)
   if (plugin.can_trim)
     return plugin.can_trim (connection_get_handle (conn));
   else
-    return plugin.trim != NULL;
+    return PLUGIN_HAS (trim);
+}
+
+int
+plugin_can_extents (struct connection *conn)
+{
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("can_extents");
+
+  if (plugin.can_extents)
+    return plugin.can_extents (connection_get_handle (conn));
+  else
+    return plugin.extents != NULL;
+}
+
+int
+plugin_can_multi_conn (struct connection *conn)
+{
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("can_multi_conn");
+
+  if (plugin.can_multi_conn)
+    return plugin.can_multi_conn (connection_get_handle (conn));
+  else
+    return 0;
+}
+
+int
+plugin_can_fua (struct connection *conn)
+{
+  int r;
+
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("can_fua");
+
+  if (plugin._api_version > 1 && plugin.can_fua)
+    return plugin.can_fua (connection_get_handle (conn));
+
+  /* Otherwise FUA can be emulated with a flush after the write. */
+  r = plugin_can_flush (conn);
+  if (r == -1)
+    return -1;
+  return r ? NBDKIT_FUA_EMULATE : NBDKIT_FUA_NONE;
+}
+
+int
+plugin_can_fast_zero (struct connection *conn)
+{
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("can_fast_zero");
+
+  if (plugin.can_fast_zero)
+    return plugin.can_fast_zero (connection_get_handle (conn));
+  /* Without .zero every fast zero request fails at once, which is
+   * still useful for the client to know.  Otherwise .zero might be
+   * slow.
+   */
+  else
+    return !PLUGIN_HAS (zero);
+}
+
+int
+plugin_block_size (struct connection *conn,
+                   uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("block_size");
+
+  *minimum = *preferred = *maximum = 0;
+  if (plugin.block_size)
+    return plugin.block_size (connection_get_handle (conn),
+                              minimum, preferred, maximum);
+  else
+    return 0;
 }
 
 int
@@ -465,30 +698,129 @@ plugin_pread (struct connection *conn,
 {
   assert (dl);
   assert (connection_get_handle (conn));
-  assert (plugin.pread != NULL);
+  assert (PLUGIN_HAS (pread));
 
   debug ("pread count=%" PRIu32 " offset=%" PRIu64, count, offset);
 
-  return plugin.pread (connection_get_handle (conn), buf, count, offset);
+  if (plugin._api_version == 1)
+    return plugin._pread_old (connection_get_handle (conn), buf, count, offset);
+  else
+    return plugin.pread (connection_get_handle (conn), buf, count, offset, 0);
+}
+
+int
+plugin_has_pread_fd (void)
+{
+  assert (dl);
+
+  return plugin.pread_fd != NULL;
+}
+
+/* Returns 0 and sets *fd to -1 if the plugin can't return a file
+ * descriptor for this range, in which case the caller must fall back
+ * to plugin_pread.
+ */
+int
+plugin_pread_fd (struct connection *conn, uint32_t count, uint64_t offset,
+                 int *fd, uint64_t *fd_offset)
+{
+  int r;
+  int err = 0;
+
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("pread_fd count=%" PRIu32 " offset=%" PRIu64, count, offset);
+
+  *fd = -1;
+  if (plugin.pread_fd == NULL)
+    return 0;
+
+  errno = 0;
+  r = plugin.pread_fd (connection_get_handle (conn), count, offset,
+                       fd, fd_offset);
+  if (r == -1) {
+    err = threadlocal_get_error ();
+    if (!err && plugin_errno_is_preserved ())
+      err = errno;
+    if (err == EOPNOTSUPP) {
+      threadlocal_set_error (0);
+      *fd = -1;
+      return 0;
+    }
+  }
+  return r;
 }
 
+/* NBDKIT_FLAG_FUA may only be passed in flags if plugin_can_fua
+ * returned NBDKIT_FUA_NATIVE, and the same applies to plugin_trim and
+ * plugin_zero.
+ */
 int
 plugin_pwrite (struct connection *conn,
-               void *buf, uint32_t count, uint64_t offset)
+               void *buf, uint32_t count, uint64_t offset, uint32_t flags)
 {
   assert (dl);
   assert (connection_get_handle (conn));
 
-  debug ("pwrite count=%" PRIu32 " offset=%" PRIu64, count, offset);
+  debug ("pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
+         count, offset, !!(flags & NBDKIT_FLAG_FUA));
 
-  if (plugin.pwrite != NULL)
-    return plugin.pwrite (connection_get_handle (conn), buf, count, offset);
+  if (plugin._api_version == 1 && plugin._pwrite_old != NULL)
+    return plugin._pwrite_old (connection_get_handle (conn),
+                               buf, count, offset);
+  else if (plugin._api_version > 1 && plugin.pwrite != NULL)
+    return plugin.pwrite (connection_get_handle (conn),
+                          buf, count, offset, flags);
   else {
     errno = EROFS;
     return -1;
   }
 }
 
+int
+plugin_has_pwrite_fd (void)
+{
+  assert (dl);
+
+  return plugin.pwrite_fd != NULL;
+}
+
+/* As for plugin_pread_fd, *fd is set to -1 if the caller must fall
+ * back to plugin_pwrite.
+ */
+int
+plugin_pwrite_fd (struct connection *conn, uint32_t count, uint64_t offset,
+                  int *fd, uint64_t *fd_offset)
+{
+  int r;
+  int err = 0;
+
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("pwrite_fd count=%" PRIu32 " offset=%" PRIu64, count, offset);
+
+  *fd = -1;
+  if (plugin.pwrite_fd == NULL)
+    return 0;
+
+  errno = 0;
+  r = plugin.pwrite_fd (connection_get_handle (conn), count, offset,
+                        fd, fd_offset);
+  if (r == -1) {
+    err = threadlocal_get_error ();
+    if (!err && plugin_errno_is_preserved ())
+      err = errno;
+    if (err == EOPNOTSUPP) {
+      threadlocal_set_error (0);
+      *fd = -1;
+      return 0;
+    }
+  }
+  return r;
+}
+
 int
 plugin_flush (struct connection *conn)
 {
@@ -497,8 +829,10 @@ plugin_flush (struct connection *conn)
 
   debug ("flush");
 
-  if (plugin.flush != NULL)
-    return plugin.flush (connection_get_handle (conn));
+  if (plugin._api_version == 1 && plugin._flush_old != NULL)
+    return plugin._flush_old (connection_get_handle (conn));
+  else if (plugin._api_version > 1 && plugin.flush != NULL)
+    return plugin.flush (connection_get_handle (conn), 0);
   else {
     errno = EINVAL;
     return -1;
@@ -506,69 +840,269 @@ plugin_flush (struct connection *conn)
 }
 
 int
-plugin_trim (struct connection *conn, uint32_t count, uint64_t offset)
+plugin_trim (struct connection *conn,
+             uint64_t count, uint64_t offset, uint32_t flags)
 {
+  uint32_t n;
+  int r;
+
   assert (dl);
   assert (connection_get_handle (conn));
 
-  debug ("trim count=%" PRIu32 " offset=%" PRIu64, count, offset);
+  debug ("trim count=%" PRIu64 " offset=%" PRIu64 " fua=%d",
+         count, offset, !!(flags & NBDKIT_FLAG_FUA));
 
-  if (plugin.trim != NULL)
-    return plugin.trim (connection_get_handle (conn), count, offset);
-  else {
+  if (!PLUGIN_HAS (trim)) {
     errno = EINVAL;
     return -1;
   }
+
+  while (count > 0) {
+    n = count < MAX_PLUGIN_COUNT ? count : MAX_PLUGIN_COUNT;
+    if (plugin._api_version == 1)
+      r = plugin._trim_old (connection_get_handle (conn), n, offset);
+    else
+      r = plugin.trim (connection_get_handle (conn), n, offset, flags);
+    if (r == -1)
+      return -1;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+static void
+map_zero_region (void)
+{
+  void *p;
+
+  p = mmap (NULL, ZERO_REGION_SIZE, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS,
+            -1, 0);
+  if (p == MAP_FAILED) {
+    nbdkit_error ("mmap: %m");
+    return;
+  }
+  zero_region = p;
+}
+
+/* Write zeroes straight into a file descriptor from .pwrite_fd. */
+static int
+zero_fd (int fd, uint64_t fd_offset, uint32_t count, uint32_t flags)
+{
+  struct iovec iov[ZERO_REGION_IOVS];
+  ssize_t r;
+  size_t n, len;
+
+  while (count > 0) {
+    for (n = len = 0; n < ZERO_REGION_IOVS && len < count; ++n) {
+      iov[n].iov_base = (void *) zero_region;
+      iov[n].iov_len = count - len;
+      if (iov[n].iov_len > ZERO_REGION_SIZE)
+        iov[n].iov_len = ZERO_REGION_SIZE;
+      len += iov[n].iov_len;
+    }
+
+    r = pwritev (fd, iov, n, fd_offset);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("pwritev: %m");
+      threadlocal_set_error (errno);
+      return -1;
+    }
+    count -= r;
+    fd_offset += r;
+  }
+
+  if ((flags & NBDKIT_FLAG_FUA) && fdatasync (fd) == -1) {
+    nbdkit_error ("fdatasync: %m");
+    threadlocal_set_error (errno);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Write zeroes when the plugin can't zero the range itself. */
+static int
+write_zeroes (struct connection *conn,
+              uint32_t count, uint64_t offset, uint32_t flags)
+{
+  uint32_t limit;
+  int fd;
+  uint64_t fd_offset;
+
+  if (plugin_has_pwrite_fd ()) {
+    if (plugin_pwrite_fd (conn, count, offset, &fd, &fd_offset) == -1)
+      return -1;
+    if (fd >= 0)
+      return zero_fd (fd, fd_offset, count, flags);
+  }
+
+  while (count) {
+    limit = count < ZERO_REGION_SIZE ? count : ZERO_REGION_SIZE;
+    if (plugin_pwrite (conn, (void *) zero_region, limit, offset,
+                       flags & NBDKIT_FLAG_FUA) == -1)
+      return -1;
+    count -= limit;
+    offset += limit;
+  }
+
+  return 0;
 }
 
 int
 plugin_zero (struct connection *conn,
-             uint32_t count, uint64_t offset, int may_trim)
+             uint64_t count, uint64_t offset, uint32_t flags)
 {
+  uint32_t n;
+  int r;
+  int err;
+
   assert (dl);
   assert (connection_get_handle (conn));
-  char *buf;
-  uint32_t limit;
-  int result;
-  int err = 0;
 
-  debug ("zero count=%" PRIu32 " offset=%" PRIu64 " may_trim=%d",
-         count, offset, may_trim);
+  debug ("zero count=%" PRIu64 " offset=%" PRIu64
+         " may_trim=%d fua=%d fast=%d",
+         count, offset, !!(flags & NBDKIT_FLAG_MAY_TRIM),
+         !!(flags & NBDKIT_FLAG_FUA), !!(flags & NBDKIT_FLAG_FAST_ZERO));
 
-  if (!count)
-    return 0;
-  if (plugin.zero) {
+  /* Let the plugin zero as much of the range as it can. */
+  while (count > 0 && PLUGIN_HAS (zero)) {
+    n = count < MAX_PLUGIN_COUNT ? count : MAX_PLUGIN_COUNT;
     errno = 0;
-    result = plugin.zero (connection_get_handle (conn), count, offset, may_trim);
-    if (result == -1) {
+    if (plugin._api_version == 1)
+      r = plugin._zero_old (connection_get_handle (conn), n, offset,
+                            !!(flags & NBDKIT_FLAG_MAY_TRIM));
+    else
+      r = plugin.zero (connection_get_handle (conn), n, offset, flags);
+    if (r == -1) {
       err = threadlocal_get_error ();
       if (!err && plugin_errno_is_preserved ())
         err = errno;
+      if (err != EOPNOTSUPP && err != ENOTSUP)
+        return -1;
+      break;
     }
-    if (result == 0 || err != EOPNOTSUPP)
-      return result;
+    count -= n;
+    offset += n;
   }
+  if (count == 0)
+    return 0;
 
-  assert (plugin.pwrite);
+  /* Writing zeroes is never fast. */
+  if (flags & NBDKIT_FLAG_FAST_ZERO) {
+    threadlocal_set_error (ENOTSUP);
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  assert (PLUGIN_HAS (pwrite));
   threadlocal_set_error (0);
-  limit = count < MAX_REQUEST_SIZE ? count : MAX_REQUEST_SIZE;
-  buf = calloc (limit, 1);
+  pthread_once (&zero_region_once, map_zero_region);
+  if (!zero_region) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  while (count > 0) {
+    n = count < MAX_PLUGIN_COUNT ? count : MAX_PLUGIN_COUNT;
+    if (write_zeroes (conn, n, offset, flags) == -1)
+      return -1;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+/* Without a .cache callback, data is read in chunks of this size and
+ * discarded.
+ */
+#define CACHE_CHUNK_SIZE (4 * 1024 * 1024)
+
+int
+plugin_cache (struct connection *conn, uint64_t count, uint64_t offset)
+{
+  CLEANUP_BUFPOOL_FREE char *buf = NULL;
+  uint32_t n, limit;
+  int r;
+  int err;
+
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("cache count=%" PRIu64 " offset=%" PRIu64, count, offset);
+
+  while (count > 0 && plugin.cache) {
+    n = count < MAX_PLUGIN_COUNT ? count : MAX_PLUGIN_COUNT;
+    errno = 0;
+    r = plugin.cache (connection_get_handle (conn), n, offset, 0);
+    if (r == -1) {
+      err = threadlocal_get_error ();
+      if (!err && plugin_errno_is_preserved ())
+        err = errno;
+      if (err != EOPNOTSUPP)
+        return -1;
+      threadlocal_set_error (0);
+      break;
+    }
+    count -= n;
+    offset += n;
+  }
+  if (count == 0)
+    return 0;
+
+  limit = count < CACHE_CHUNK_SIZE ? count : CACHE_CHUNK_SIZE;
+  buf = bufpool_alloc (limit);
   if (!buf) {
     errno = ENOMEM;
     return -1;
   }
 
   while (count) {
-    result = plugin.pwrite (connection_get_handle (conn), buf, limit, offset);
-    if (result < 0)
-      break;
+    if (plugin_pread (conn, buf, limit, offset) == -1)
+      return -1;
     count -= limit;
+    offset += limit;
     if (count < limit)
       limit = count;
   }
 
-  err = errno;
-  free (buf);
-  errno = err;
-  return result;
+  return 0;
+}
+
+int
+plugin_extents (struct connection *conn,
+                uint64_t count, uint64_t offset, uint32_t flags,
+                struct nbdkit_extents *extents)
+{
+  int r;
+
+  assert (dl);
+  assert (connection_get_handle (conn));
+
+  debug ("extents count=%" PRIu64 " offset=%" PRIu64 " req_one=%d",
+         count, offset, !!(flags & NBDKIT_FLAG_REQ_ONE));
+
+  /* Without the callback the whole range is reported as data. */
+  if (plugin.extents == NULL)
+    return nbdkit_add_extent (extents, offset, count, 0);
+
+  /* The reply may describe less than the whole range, so just ask
+   * the plugin about the first part of a very large request.
+   */
+  if (count > MAX_PLUGIN_COUNT)
+    count = MAX_PLUGIN_COUNT;
+
+  errno = 0;
+  r = plugin.extents (connection_get_handle (conn), count, offset, flags,
+                      extents);
+  if (r == 0 && extents_count (extents) == 0) {
+    nbdkit_error ("extents: plugin must return at least one extent");
+    errno = EINVAL;
+    return -1;
+  }
+  return r;
 }
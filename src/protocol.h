@@ -75,6 +75,32 @@ struct fixed_new_option_reply {
 
 #define NBD_REP_MAGIC UINT64_C(0x3e889045565a9)
 
+/* Payload of NBD_REP_INFO for NBD_INFO_EXPORT. */
+struct fixed_new_option_reply_info_export {
+  uint16_t info;                /* NBD_INFO_EXPORT */
+  uint64_t exportsize;          /* size of export */
+  uint16_t eflags;              /* per-export flags */
+} __attribute__((packed));
+
+/* Payload of NBD_REP_INFO for NBD_INFO_BLOCK_SIZE. */
+struct fixed_new_option_reply_info_block_size {
+  uint16_t info;                /* NBD_INFO_BLOCK_SIZE */
+  uint32_t minimum;             /* minimum block size */
+  uint32_t preferred;           /* preferred block size */
+  uint32_t maximum;             /* maximum block size */
+} __attribute__((packed));
+
+#define NBD_INFO_EXPORT      0
+#define NBD_INFO_NAME        1
+#define NBD_INFO_DESCRIPTION 2
+#define NBD_INFO_BLOCK_SIZE  3
+
+/* Payload of NBD_REP_META_CONTEXT. */
+struct fixed_new_option_reply_meta_context {
+  uint32_t context_id;          /* metadata context ID */
+  /* followed by a string */
+} __attribute__((packed));
+
 /* New-style handshake server reply. */
 struct new_handshake_finish {
   uint64_t exportsize;        /* in network byte order */
@@ -94,15 +120,27 @@ struct new_handshake_finish {
 #define NBD_FLAG_ROTATIONAL        (1 << 4)
 #define NBD_FLAG_SEND_TRIM         (1 << 5)
 #define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_SEND_DF           (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN    (1 << 8)
+#define NBD_FLAG_SEND_CACHE        (1 << 10)
+#define NBD_FLAG_SEND_FAST_ZERO    (1 << 11)
 
 /* NBD options (new style handshake only). */
 #define NBD_OPT_EXPORT_NAME  1
 #define NBD_OPT_ABORT        2
 #define NBD_OPT_LIST         3
 #define NBD_OPT_STARTTLS     5
+#define NBD_OPT_INFO         6
+#define NBD_OPT_GO           7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT 10
+#define NBD_OPT_EXTENDED_HEADERS 11
 
 #define NBD_REP_ACK          1
 #define NBD_REP_SERVER       2
+#define NBD_REP_INFO         3
+#define NBD_REP_META_CONTEXT 4
 #define NBD_REP_ERR_UNSUP    0x80000001
 #define NBD_REP_ERR_POLICY   0x80000002
 #define NBD_REP_ERR_INVALID  0x80000003
@@ -118,6 +156,17 @@ struct request {
   uint32_t count;               /* Request length. */
 } __attribute__((packed));
 
+/* Extended request (client -> server), used instead of struct request
+ * once extended headers have been negotiated.
+ */
+struct request_ext {
+  uint32_t magic;               /* NBD_EXTENDED_REQUEST_MAGIC. */
+  uint32_t type;                /* Request type. */
+  uint64_t handle;              /* Opaque handle. */
+  uint64_t offset;              /* Request offset. */
+  uint64_t count;               /* Request length. */
+} __attribute__((packed));
+
 /* Reply (server -> client). */
 struct reply {
   uint32_t magic;               /* NBD_REPLY_MAGIC. */
@@ -125,18 +174,102 @@ struct reply {
   uint64_t handle;              /* Opaque handle. */
 } __attribute__((packed));
 
+/* Structured reply chunk (server -> client). */
+struct structured_reply {
+  uint32_t magic;               /* NBD_STRUCTURED_REPLY_MAGIC. */
+  uint16_t flags;               /* NBD_REPLY_FLAG_* */
+  uint16_t type;                /* NBD_REPLY_TYPE_* */
+  uint64_t handle;              /* Opaque handle. */
+  uint32_t length;              /* Length of payload which follows. */
+} __attribute__((packed));
+
+/* Extended reply chunk (server -> client), used instead of struct
+ * structured_reply once extended headers have been negotiated.
+ */
+struct structured_reply_ext {
+  uint32_t magic;               /* NBD_EXTENDED_REPLY_MAGIC. */
+  uint16_t flags;               /* NBD_REPLY_FLAG_* */
+  uint16_t type;                /* NBD_REPLY_TYPE_* */
+  uint64_t handle;              /* Opaque handle. */
+  uint64_t offset;              /* Offset of the request. */
+  uint64_t length;              /* Length of payload which follows. */
+} __attribute__((packed));
+
+struct structured_reply_offset_data {
+  uint64_t offset;              /* offset */
+  /* Followed by data. */
+} __attribute__((packed));
+
+struct structured_reply_offset_hole {
+  uint64_t offset;
+  uint32_t length;              /* Length of hole. */
+} __attribute__((packed));
+
+struct block_descriptor {
+  uint32_t length;              /* length of block */
+  uint32_t status_flags;        /* block type (hole etc) */
+} __attribute__((packed));
+
+/* Payload of NBD_REPLY_TYPE_BLOCK_STATUS. */
+struct structured_reply_block_status {
+  uint32_t context_id;          /* metadata context ID */
+  /* followed by array of block_descriptor */
+} __attribute__((packed));
+
+struct block_descriptor_ext {
+  uint64_t length;              /* length of block */
+  uint64_t status_flags;        /* block type (hole etc) */
+} __attribute__((packed));
+
+/* Payload of NBD_REPLY_TYPE_BLOCK_STATUS_EXT. */
+struct structured_reply_block_status_ext {
+  uint32_t context_id;          /* metadata context ID */
+  uint32_t count;               /* number of descriptors */
+  /* followed by array of block_descriptor_ext */
+} __attribute__((packed));
+
+struct structured_reply_error {
+  uint32_t error;               /* NBD_E* error number */
+  uint16_t len;                 /* Length of human readable error. */
+  /* Followed by human readable error string. */
+} __attribute__((packed));
+
 #define NBD_REQUEST_MAGIC 0x25609513
 #define NBD_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define NBD_EXTENDED_REQUEST_MAGIC 0x21e41c71
+#define NBD_EXTENDED_REPLY_MAGIC 0x6e8a278c
+
+/* Structured reply flags. */
+#define NBD_REPLY_FLAG_DONE (1<<0)
+
+/* Structured reply types. */
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_BLOCK_STATUS_EXT 6
+#define NBD_REPLY_TYPE_ERROR        ((1<<15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1<<15) + 2)
+
+/* Flags in block_descriptor for the "base:allocation" context. */
+#define NBD_STATE_HOLE (1<<0)
+#define NBD_STATE_ZERO (1<<1)
 
 #define NBD_CMD_READ              0
 #define NBD_CMD_WRITE             1
 #define NBD_CMD_DISC              2 /* Disconnect. */
 #define NBD_CMD_FLUSH             3
 #define NBD_CMD_TRIM              4
+#define NBD_CMD_CACHE             5
 #define NBD_CMD_WRITE_ZEROES      6
+#define NBD_CMD_BLOCK_STATUS      7
 #define NBD_CMD_MASK_COMMAND 0xffff
 #define NBD_CMD_FLAG_FUA     (1<<16)
 #define NBD_CMD_FLAG_NO_HOLE (2<<16)
+#define NBD_CMD_FLAG_DF      (4<<16)
+#define NBD_CMD_FLAG_REQ_ONE (8<<16)
+#define NBD_CMD_FLAG_FAST_ZERO (16<<16)
 
 /* Error codes (previously errno).
  * See http://git.qemu.org/?p=qemu.git;a=commitdiff;h=ca4414804114fd0095b317785bc0b51862e62ebb
@@ -147,6 +280,7 @@ struct reply {
 #define NBD_ENOMEM     12
 #define NBD_EINVAL     22
 #define NBD_ENOSPC     28
+#define NBD_ENOTSUP    95
 #define NBD_ESHUTDOWN 108
 
 #endif /* NBDKIT_PROTOCOL_H */
@@ -45,6 +45,10 @@
 #include <poll.h>
 #include <errno.h>
 #include <assert.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <fcntl.h>
 
 #ifdef HAVE_SELINUX_SELINUX_H
 #include <selinux/selinux.h>
@@ -55,6 +59,11 @@
 #include "nbdkit-plugin.h"
 #include "internal.h"
 
+/* Number of listening sockets per TCP/IP address (--listen-shards).
+ * Socket i belongs to shard i % nr_shards.
+ */
+static size_t nr_shards = 1;
+
 static void
 set_selinux_label (void)
 {
@@ -139,15 +148,71 @@ bind_unix_socket (size_t *nr_socks)
   return ret;
 }
 
+/* Create a listening socket for one address.  Returns -1 if the
+ * address is in use.
+ */
+static int
+bind_tcpip_address (struct addrinfo *a)
+{
+  int sock, opt;
+
+  set_selinux_label ();
+
+  sock = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+  if (sock == -1) {
+    perror ("socket");
+    exit (EXIT_FAILURE);
+  }
+
+  opt = 1;
+  if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
+    perror ("setsockopt: SO_REUSEADDR");
+
+#ifdef SO_REUSEPORT
+  if (nr_shards > 1 &&
+      setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) == -1) {
+    perror ("setsockopt: SO_REUSEPORT");
+    exit (EXIT_FAILURE);
+  }
+#endif
+
+#ifdef IPV6_V6ONLY
+  if (a->ai_family == PF_INET6) {
+    if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
+      perror ("setsockopt: IPv6 only");
+  }
+#endif
+
+  if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
+    if (errno == EADDRINUSE) {
+      close (sock);
+      clear_selinux_label ();
+      return -1;
+    }
+    perror ("bind");
+    exit (EXIT_FAILURE);
+  }
+
+  if (listen (sock, SOMAXCONN) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+  clear_selinux_label ();
+
+  return sock;
+}
+
 int *
 bind_tcpip_socket (size_t *nr_socks)
 {
   struct addrinfo *ai = NULL;
   struct addrinfo hints;
   struct addrinfo *a;
-  int err, opt;
+  int err;
   int *socks = NULL;
   bool addr_in_use = false;
+  size_t shard;
 
   if (port == NULL)
     port = "10809";
@@ -166,54 +231,40 @@ bind_tcpip_socket (size_t *nr_socks)
     exit (EXIT_FAILURE);
   }
 
+  if (listen_shards > 1) {
+#ifdef SO_REUSEPORT
+    nr_shards = listen_shards;
+#else
+    fprintf (stderr, "%s: --listen-shards is not supported on this platform\n",
+             program_name);
+    exit (EXIT_FAILURE);
+#endif
+  }
+
   *nr_socks = 0;
 
   for (a = ai; a != NULL; a = a->ai_next) {
-    int sock;
-
-    set_selinux_label ();
-
-    sock = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
-    if (sock == -1) {
-      perror ("socket");
+    /* With --listen-shards, each address gets one socket per shard,
+     * and the kernel spreads incoming connections over them.
+     */
+    socks = realloc (socks, sizeof (int) * (*nr_socks + nr_shards));
+    if (!socks) {
+      perror ("realloc");
       exit (EXIT_FAILURE);
     }
 
-    opt = 1;
-    if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
-      perror ("setsockopt: SO_REUSEADDR");
-
-#ifdef IPV6_V6ONLY
-    if (a->ai_family == PF_INET6) {
-      if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
-        perror ("setsockopt: IPv6 only");
+    for (shard = 0; shard < nr_shards; ++shard) {
+      socks[*nr_socks + shard] = bind_tcpip_address (a);
+      if (socks[*nr_socks + shard] == -1)
+        break;
     }
-#endif
-
-    if (bind (sock, a->ai_addr, a->ai_addrlen) == -1) {
-      if (errno == EADDRINUSE) {
-        addr_in_use = true;
-        close (sock);
-        continue;
-      }
-      perror ("bind");
-      exit (EXIT_FAILURE);
-    }
-
-    if (listen (sock, SOMAXCONN) == -1) {
-      perror ("listen");
-      exit (EXIT_FAILURE);
+    if (shard < nr_shards) {
+      addr_in_use = true;
+      while (shard > 0)
+        close (socks[*nr_socks + --shard]);
+      continue;
     }
-
-    clear_selinux_label ();
-
-    (*nr_socks)++;
-    socks = realloc (socks, sizeof (int) * (*nr_socks));
-    if (!socks) {
-      perror ("realloc");
-      exit (EXIT_FAILURE);
-    }
-    socks[*nr_socks - 1] = sock;
+    *nr_socks += nr_shards;
   }
 
   freeaddrinfo (ai);
@@ -243,41 +294,219 @@ free_listening_sockets (int *socks, size_t nr_socks)
 struct thread_data {
   int sock;
   size_t instance_num;
-  struct sockaddr addr;
+  size_t shard;                 /* Shard which accepted the connection. */
+  struct sockaddr_storage addr;
   socklen_t addrlen;
 };
 
-static void *
-start_thread (void *datav)
+static void
+init_thread_attr (pthread_attr_t *attrs)
 {
-  struct thread_data *data = datav;
+  pthread_attr_init (attrs);
+  pthread_attr_setdetachstate (attrs, PTHREAD_CREATE_DETACHED);
+}
+
+static void pin_to_shard (size_t shard);
 
+static void
+serve_connection (struct thread_data *data)
+{
   debug ("accepted connection");
 
+  if (nr_shards > 1)
+    pin_to_shard (data->shard);
+  else
+    affinity_pin_connection (data->instance_num);
+
   /* Set thread-local data. */
-  threadlocal_new_server_thread ();
   threadlocal_set_instance_num (data->instance_num);
-  threadlocal_set_sockaddr (&data->addr, data->addrlen);
+  threadlocal_set_sockaddr ((struct sockaddr *) &data->addr,
+                            data->addrlen);
 
   handle_single_connection (data->sock, data->sock);
+}
+
+static void *
+start_thread (void *datav)
+{
+  struct thread_data *data = datav;
+
+  threadlocal_new_server_thread ();
+  serve_connection (data);
+  free (data);
+
+  return NULL;
+}
+
+/* With --connection-threads, a pool of threads is started up front
+ * and accepted sockets are handed to idle ones through a lock-free
+ * ring (a bounded queue with a sequence number per slot), so the
+ * accept loop never blocks and no thread is created per connection.
+ * A thread is reserved before a socket is queued, so sockets never
+ * wait behind long-lived connections: if no pool thread is idle,
+ * accept_connection starts a thread for the connection as before.
+ */
+struct pool_slot {
+  size_t seq;                   /* Updated atomically. */
+  struct thread_data data;
+};
+
+static struct pool_slot *pool_ring;
+static size_t pool_size;
+static size_t pool_head, pool_tail; /* Updated atomically. */
+static size_t pool_idle;            /* Updated atomically. */
+static bool pool_stopping;          /* Updated atomically. */
+static sem_t pool_sem;
+
+static bool
+pool_enqueue (const struct thread_data *data)
+{
+  struct pool_slot *slot;
+  size_t idle, pos;
+  ssize_t diff;
+
+  idle = __atomic_load_n (&pool_idle, __ATOMIC_RELAXED);
+  do {
+    if (idle == 0)
+      return false;
+  } while (!__atomic_compare_exchange_n (&pool_idle, &idle, idle - 1, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  pos = __atomic_load_n (&pool_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &pool_ring[pos % pool_size];
+    diff = (ssize_t) (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&pool_tail, &pos, pos + 1, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0) {        /* Full. */
+      __atomic_add_fetch (&pool_idle, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    else
+      pos = __atomic_load_n (&pool_tail, __ATOMIC_RELAXED);
+  }
+
+  slot->data = *data;
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post (&pool_sem);
+  return true;
+}
+
+static void
+pool_dequeue (struct thread_data *data)
+{
+  struct pool_slot *slot;
+  size_t pos;
+
+  /* The semaphore guarantees that this slot has been claimed by a
+   * producer, but it may not have finished filling it in yet.
+   */
+  pos = __atomic_fetch_add (&pool_head, 1, __ATOMIC_RELAXED);
+  slot = &pool_ring[pos % pool_size];
+  while (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    sched_yield ();
+  *data = slot->data;
+  __atomic_store_n (&slot->seq, pos + pool_size, __ATOMIC_RELEASE);
+}
+
+static void *
+pool_thread (void *arg)
+{
+  struct thread_data data;
+
+  threadlocal_new_server_thread ();
+
+  for (;;) {
+    threadlocal_set_name (NULL);
+    __atomic_add_fetch (&pool_idle, 1, __ATOMIC_RELAXED);
+    while (sem_wait (&pool_sem) == -1 && errno == EINTR)
+      ;
+    if (__atomic_load_n (&pool_stopping, __ATOMIC_RELAXED))
+      break;
+    pool_dequeue (&data);
+    serve_connection (&data);
+  }
 
   return NULL;
 }
 
 static void
-accept_connection (int listen_sock)
+pool_start (void)
+{
+  pthread_attr_t attrs;
+  pthread_t thread;
+  size_t i;
+  int err;
+
+  pool_size = connection_threads;
+  pool_ring = calloc (pool_size, sizeof *pool_ring);
+  if (pool_ring == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < pool_size; ++i)
+    pool_ring[i].seq = i;
+  if (sem_init (&pool_sem, 0, 0) == -1) {
+    perror ("sem_init");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Pool threads get a smaller stack than the default (usually 8MB),
+   * which is far more than most plugins need.  Plugins written in
+   * other languages may need more, which is why this is configurable.
+   */
+  init_thread_attr (&attrs);
+  if (thread_stack_size > 0)
+    pthread_attr_setstacksize (&attrs, thread_stack_size);
+  for (i = 0; i < pool_size; ++i) {
+    err = pthread_create (&thread, &attrs, pool_thread, NULL);
+    if (err != 0) {
+      fprintf (stderr, "%s: pthread_create: %s\n",
+               program_name, strerror (err));
+      exit (EXIT_FAILURE);
+    }
+  }
+  pthread_attr_destroy (&attrs);
+
+  debug ("started %zu connection threads", pool_size);
+}
+
+/* Wake up the idle pool threads so they exit.  Busy ones exit when
+ * their connection finishes.  Like the event loop, we don't wait for
+ * them here: main() waits (but not forever) for all threads to finish.
+ * The ring and semaphore are never freed since threads may still be
+ * using them.
+ */
+static void
+pool_stop (void)
+{
+  size_t i;
+
+  __atomic_store_n (&pool_stopping, true, __ATOMIC_RELAXED);
+  for (i = 0; i < pool_size; ++i)
+    sem_post (&pool_sem);
+}
+
+static void
+accept_connection (int listen_sock, size_t shard)
 {
   int err;
   pthread_attr_t attrs;
   pthread_t thread;
-  struct thread_data thread_data;
-  static size_t instance_num = 1;
+  struct thread_data thread_data, *data;
+  static size_t instance_num = 0; /* Updated atomically. */
 
-  thread_data.instance_num = instance_num++;
+  thread_data.instance_num =
+    __atomic_add_fetch (&instance_num, 1, __ATOMIC_RELAXED);
+  thread_data.shard = shard;
   thread_data.addrlen = sizeof thread_data.addr;
  again:
   thread_data.sock = accept (listen_sock,
-                             &thread_data.addr, &thread_data.addrlen);
+                             (struct sockaddr *) &thread_data.addr,
+                             &thread_data.addrlen);
   if (thread_data.sock == -1) {
     if (errno == EINTR || errno == EAGAIN)
       goto again;
@@ -285,17 +514,34 @@ accept_connection (int listen_sock)
     return;
   }
 
+  if (engine == ENGINE_EPOLL) {
+    eventloop_add_connection (thread_data.sock, thread_data.instance_num,
+                              (struct sockaddr *) &thread_data.addr,
+                              thread_data.addrlen);
+    return;
+  }
+
+  if (connection_threads > 0 && pool_enqueue (&thread_data))
+    return;
+
   /* Start a thread to handle this connection.  Note we always do this
    * even for non-threaded plugins.  There are mutexes in plugins.c
    * which ensure that non-threaded plugins are handled correctly.
    */
-  pthread_attr_init (&attrs);
-  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
-  err = pthread_create (&thread, &attrs, start_thread, &thread_data);
+  data = malloc (sizeof *data);
+  if (data == NULL) {
+    perror ("malloc");
+    close (thread_data.sock);
+    return;
+  }
+  *data = thread_data;
+  init_thread_attr (&attrs);
+  err = pthread_create (&thread, &attrs, start_thread, data);
   pthread_attr_destroy (&attrs);
   if (err != 0) {
     fprintf (stderr, "%s: pthread_create: %s\n", program_name, strerror (err));
     close (thread_data.sock);
+    free (data);
     return;
   }
 
@@ -304,10 +550,86 @@ accept_connection (int listen_sock)
    */
 }
 
-void
-accept_incoming_connections (int *socks, size_t nr_socks)
+/* With --listen-shards, shard 0 is served by the main thread and
+ * each other shard by its own accept thread.  Each shard is pinned to
+ * a share of the CPUs we are allowed to run on, and so are the threads
+ * handling the connections it accepts.
+ */
+struct shard {
+  pthread_t thread;
+  int *socks;
+  size_t nr_socks;
+#ifdef HAVE_SCHED_GETAFFINITY
+  cpu_set_t cpus;
+#endif
+};
+
+static struct shard *shards;
+static bool pin_shards;         /* Updated atomically. */
+static int shards_wakefd[2] = { -1, -1 };
+
+static void
+pin_to_shard (size_t shard)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+  if (__atomic_load_n (&pin_shards, __ATOMIC_ACQUIRE) &&
+      sched_setaffinity (0, sizeof shards[shard].cpus,
+                         &shards[shard].cpus) == -1)
+    perror ("sched_setaffinity");
+#endif
+}
+
+#ifdef HAVE_SCHED_GETAFFINITY
+static int
+compare_cpu_nodes (const void *av, const void *bv)
+{
+  const int a = *(const int *) av, b = *(const int *) bv;
+  int r = affinity_cpu_node (a) - affinity_cpu_node (b);
+
+  return r ? r : a - b;
+}
+#endif
+
+/* Split the allowed CPUs into one contiguous block per shard, taking
+ * them in NUMA node order so that a shard's CPUs (and its connections'
+ * buffers) stay on one node where possible.
+ */
+static void
+init_shard_cpus (void)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+  cpu_set_t allowed;
+  int order[CPU_SETSIZE];
+  size_t cpu, n = 0, shard, lo, hi;
+
+  if (sched_getaffinity (0, sizeof allowed, &allowed) == -1) {
+    perror ("sched_getaffinity");
+    return;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET (cpu, &allowed))
+      order[n++] = cpu;
+  if (n == 0)
+    return;
+  qsort (order, n, sizeof order[0], compare_cpu_nodes);
+
+  for (shard = 0; shard < nr_shards; ++shard) {
+    lo = shard * n / nr_shards;
+    hi = (shard + 1) * n / nr_shards;
+    /* If there are more shards than CPUs, shards share CPUs. */
+    if (hi == lo)
+      hi = lo + 1;
+    for (; lo < hi; ++lo)
+      CPU_SET (order[lo], &shards[shard].cpus);
+  }
+  __atomic_store_n (&pin_shards, true, __ATOMIC_RELEASE);
+#endif
+}
+
+static void
+accept_loop (int *socks, size_t nr_socks, size_t shard)
 {
-  struct pollfd fds[nr_socks];
+  struct pollfd fds[nr_socks + 1];
   size_t i;
   int r;
 
@@ -317,8 +639,12 @@ accept_incoming_connections (int *socks, size_t nr_socks)
       fds[i].events = POLLIN;
       fds[i].revents = 0;
     }
+    /* Ignored by poll if there are no shards. */
+    fds[nr_socks].fd = shards_wakefd[0];
+    fds[nr_socks].events = POLLIN;
+    fds[nr_socks].revents = 0;
 
-    r = poll (fds, nr_socks, -1);
+    r = poll (fds, nr_socks + 1, -1);
     if (r == -1) {
       if (errno == EINTR || errno == EAGAIN)
         continue;
@@ -328,7 +654,134 @@ accept_incoming_connections (int *socks, size_t nr_socks)
 
     for (i = 0; i < nr_socks; ++i) {
       if (fds[i].revents & POLLIN)
-        accept_connection (fds[i].fd);
+        accept_connection (fds[i].fd, shard);
+    }
+  }
+}
+
+static void *
+shard_thread (void *arg)
+{
+  size_t shard = (uintptr_t) arg;
+  sigset_t sigs;
+
+  /* Leave the quit signals to the main thread, which wakes us up
+   * through shards_wakefd.
+   */
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGQUIT);
+  sigaddset (&sigs, SIGTERM);
+  sigaddset (&sigs, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+  pin_to_shard (shard);
+  accept_loop (shards[shard].socks, shards[shard].nr_socks, shard);
+  return NULL;
+}
+
+static void
+shards_start (int *socks, size_t nr_socks)
+{
+  size_t i;
+  int err;
+
+  shards = calloc (nr_shards, sizeof *shards);
+  if (shards == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_shards; ++i) {
+    shards[i].socks = malloc (sizeof (int) * nr_socks / nr_shards);
+    if (shards[i].socks == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
     }
   }
+  for (i = 0; i < nr_socks; ++i) {
+    struct shard *sh = &shards[i % nr_shards];
+    sh->socks[sh->nr_socks++] = socks[i];
+  }
+  init_shard_cpus ();
+
+  if (pipe2 (shards_wakefd, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 1; i < nr_shards; ++i) {
+    err = pthread_create (&shards[i].thread, NULL, shard_thread,
+                          (void *) (uintptr_t) i);
+    if (err != 0) {
+      fprintf (stderr, "%s: pthread_create: %s\n",
+               program_name, strerror (err));
+      exit (EXIT_FAILURE);
+    }
+  }
+  pin_to_shard (0);
+
+  debug ("accepting connections on %zu shards", nr_shards);
+}
+
+/* Stop the accept threads.  Connection threads which are still
+ * starting up may call pin_to_shard after this, so stop pinning first,
+ * and never free the shards (like the connection thread pool, main()
+ * only waits a limited time for all threads to finish).
+ */
+static void
+shards_stop (void)
+{
+  size_t i;
+  char c = 0;
+
+  __atomic_store_n (&pin_shards, false, __ATOMIC_RELEASE);
+  if (write (shards_wakefd[1], &c, 1) == -1)
+    perror ("write");
+  for (i = 1; i < nr_shards; ++i)
+    pthread_join (shards[i].thread, NULL);
+  for (i = 0; i < nr_shards; ++i) {
+    free (shards[i].socks);
+    shards[i].socks = NULL;
+  }
+  close (shards_wakefd[0]);
+  close (shards_wakefd[1]);
+  shards_wakefd[0] = shards_wakefd[1] = -1;
+}
+
+void
+accept_incoming_connections (int *socks, size_t nr_socks)
+{
+  /* The event loop multiplexes connections over a pool of threads,
+   * which doesn't make sense if the plugin can only handle one
+   * connection at a time.
+   */
+  if (engine == ENGINE_EPOLL &&
+      plugin_thread_model () == NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS) {
+    debug ("plugin serializes connections, using threads engine");
+    engine = ENGINE_THREADS;
+  }
+  /* The event loop reads from the socket itself, so it can't be used
+   * once the data goes through GnuTLS or io_uring.
+   */
+  if (engine == ENGINE_EPOLL && (tls > 0 || io_uring)) {
+    debug ("TLS or io_uring is enabled, using threads engine");
+    engine = ENGINE_THREADS;
+  }
+  if (engine == ENGINE_EPOLL)
+    eventloop_start ();
+  else if (connection_threads > 0)
+    pool_start ();
+
+  if (nr_shards > 1) {
+    shards_start (socks, nr_socks);
+    accept_loop (shards[0].socks, shards[0].nr_socks, 0);
+    shards_stop ();
+  }
+  else
+    accept_loop (socks, nr_socks, 0);
+
+  if (engine == ENGINE_EPOLL)
+    eventloop_stop ();
+  else if (connection_threads > 0)
+    pool_stop ();
 }
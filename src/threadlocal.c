@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <pthread.h>
 
@@ -60,6 +61,8 @@ struct threadlocal {
   struct sockaddr *addr;
   socklen_t addrlen;
   int err;
+  int pipe[2];                  /* Used for splice(2), or -1 if not open. */
+  size_t pipe_size;
 };
 
 static pthread_key_t threadlocal_key;
@@ -70,6 +73,10 @@ free_threadlocal (void *threadlocalv)
   struct threadlocal *threadlocal = threadlocalv;
 
   free (threadlocal->addr);
+  if (threadlocal->pipe[0] >= 0) {
+    close (threadlocal->pipe[0]);
+    close (threadlocal->pipe[1]);
+  }
   free (threadlocal);
 
   decr_running_threads ();
@@ -100,6 +107,7 @@ threadlocal_new_server_thread (void)
     perror ("malloc");
     exit (EXIT_FAILURE);
   }
+  threadlocal->pipe[0] = threadlocal->pipe[1] = -1;
   pthread_setspecific (threadlocal_key, threadlocal);
 }
 
@@ -182,6 +190,63 @@ threadlocal_get_error (void)
   return threadlocal ? threadlocal->err : 0;
 }
 
+/* Largest pipe we'll ask for.  Bigger pipes mean fewer trips round
+ * the splice loop, and let larger requests be held in the pipe.
+ */
+#define PIPE_SIZE (1024 * 1024)
+
+/* Get this thread's pipe, creating it the first time.  The pipe is
+ * used for splice(2) and must be empty again when the caller has
+ * finished with it, or else discarded using threadlocal_discard_pipe.
+ * *size is set to how much can be put in the pipe without blocking.
+ */
+int
+threadlocal_get_pipe (int *rfd, int *wfd, size_t *size)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  int r;
+
+  if (!threadlocal) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  if (threadlocal->pipe[0] == -1) {
+    if (pipe2 (threadlocal->pipe, O_CLOEXEC) == -1) {
+      threadlocal->pipe[0] = threadlocal->pipe[1] = -1;
+      return -1;
+    }
+    r = 65536;
+#ifdef F_SETPIPE_SZ
+    /* Not fatal if this fails, we just get a smaller pipe. */
+    if (fcntl (threadlocal->pipe[1], F_SETPIPE_SZ, PIPE_SIZE) > 0)
+      r = fcntl (threadlocal->pipe[1], F_GETPIPE_SZ);
+#endif
+    /* The pipe holds whole pages, so data spliced from a file at an
+     * unaligned offset may need one more page than its length.
+     */
+    threadlocal->pipe_size = r - sysconf (_SC_PAGESIZE);
+  }
+
+  *rfd = threadlocal->pipe[0];
+  *wfd = threadlocal->pipe[1];
+  *size = threadlocal->pipe_size;
+  return 0;
+}
+
+/* Throw away this thread's pipe and anything left in it. */
+void
+threadlocal_discard_pipe (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal && threadlocal->pipe[0] >= 0) {
+    close (threadlocal->pipe[0]);
+    close (threadlocal->pipe[1]);
+    threadlocal->pipe[0] = threadlocal->pipe[1] = -1;
+  }
+}
+
 /* These functions keep track of the number of running threads. */
 static pthread_mutex_t running_threads_lock = PTHREAD_MUTEX_INITIALIZER;
 static size_t running_threads = 0;
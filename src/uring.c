@@ -0,0 +1,675 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* io_uring transport (--io-uring).
+ *
+ * Once the handshake has finished, plain (non-TLS) socket connections
+ * switch to doing their socket I/O through io_uring(7).  Each
+ * connection gets two small rings, one used only by the thread holding
+ * the read lock and one used only by the thread holding the write
+ * lock, so no extra locking is needed.  The socket is registered with
+ * both rings so the kernel does not have to look up the file on every
+ * operation.
+ *
+ * Receiving uses a single multishot IORING_OP_RECV into a ring of
+ * provided buffers.  It stays armed while the client is sending, so
+ * data which has already arrived is picked up from the completion
+ * queue without any system call, and io_uring_enter(2) is only called
+ * to wait for more.
+ *
+ * Sends marked SEND_MORE are copied into a registered staging buffer
+ * instead of being written straight away.  The next send which is
+ * not marked SEND_MORE submits the staged data and its own data as
+ * linked operations with a single io_uring_enter(2), so a reply made
+ * up of several pieces costs one system call.
+ *
+ * This talks to the kernel directly rather than using liburing, since
+ * we only need a tiny subset of it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "nbdkit-plugin.h"
+#include "internal.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+  defined(IORING_RECV_MULTISHOT)
+
+/* Provided receive buffers.  The total is the same as the receive
+ * buffer used without io_uring.
+ */
+#define RECV_BUFFERS 16
+#define RECV_BUFFER_SIZE (16 * 1024)
+#define RECV_BUFFER_GROUP 0
+
+/* Size of the registered send staging buffer. */
+#define SEND_STAGING_SIZE (64 * 1024)
+
+/* The send ring has at most two linked operations in flight.  The
+ * receive ring has one multishot receive in flight, but its completion
+ * queue must have room for a completion for every provided buffer.
+ */
+#define SEND_ENTRIES 2
+#define RECV_ENTRIES 1
+#define RECV_CQ_ENTRIES (2 * RECV_BUFFERS)
+
+/* Registered file indexes. */
+#define FILE_IN 0
+#define FILE_OUT 1
+
+struct ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+struct uring_session {
+  int sockin, sockout;
+
+  /* Used with the read lock held. */
+  struct ring recv_ring;
+  struct io_uring_buf_ring *buf_ring; /* Provided buffer ring. */
+  char *recv_bufs;              /* RECV_BUFFERS * RECV_BUFFER_SIZE */
+  bool recv_armed;              /* Multishot receive is in flight. */
+  int cur_bid;                  /* Buffer being consumed, or -1. */
+  size_t cur_pos, cur_len;
+
+  /* Used with the write lock held. */
+  struct ring send_ring;
+  char *staging;                /* Registered staging buffer. */
+  size_t staged;
+};
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                  NULL, 0);
+}
+
+static int
+sys_io_uring_register (int fd, unsigned opcode, const void *arg,
+                       unsigned nr_args)
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+ring_free (struct ring *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+    munmap (ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr)
+    munmap (ring->sq_ptr, ring->sq_len);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  memset (ring, 0, sizeof *ring);
+  ring->fd = -1;
+}
+
+/* Create a ring and register the connection's file descriptors with
+ * it.  If cq_entries is not zero it sets the size of the completion
+ * queue.  On error this returns -1 with errno set.
+ */
+static int
+ring_init (struct ring *ring, unsigned entries, unsigned cq_entries,
+           int sockin, int sockout)
+{
+  struct io_uring_params p;
+  int fds[2] = { sockin, sockout };
+  char *sq;
+
+  memset (ring, 0, sizeof *ring);
+  memset (&p, 0, sizeof p);
+  if (cq_entries) {
+    p.flags |= IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+  }
+  ring->fd = sys_io_uring_setup (entries, &p);
+  if (ring->fd == -1)
+    return -1;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len)
+      ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+  }
+
+  ring->sq_ptr = mmap (NULL, ring->sq_len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto err;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else {
+    ring->cq_ptr = mmap (NULL, ring->cq_len, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto err;
+    }
+  }
+  ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto err;
+  }
+
+  sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+  if (sys_io_uring_register (ring->fd, IORING_REGISTER_FILES, fds, 2) == -1)
+    goto err;
+
+  return 0;
+
+ err:
+  {
+    int saved_errno = errno;
+    ring_free (ring);
+    errno = saved_errno;
+  }
+  return -1;
+}
+
+/* Queue an operation on a registered file.  It is not submitted until
+ * the next call to ring_wait.
+ */
+static void
+ring_queue (struct ring *ring, int opcode, int file, void *buf, size_t len,
+            unsigned sqe_flags, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
+
+  if (len > 0x7ffff000)
+    len = 0x7ffff000;
+
+  tail = *ring->sq_tail;
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset (sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  sqe->flags = IOSQE_FIXED_FILE | sqe_flags;
+  sqe->fd = file;
+  if (opcode != IORING_OP_RECV)
+    sqe->off = (uint64_t) -1;   /* current position, ie. none for sockets */
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit any queued operations and wait for the next completion,
+ * returning its result and setting *flags and *user_data.  Only
+ * enters the kernel if there is something to submit or nothing has
+ * completed yet.  Returns -errno if io_uring_enter fails.
+ */
+static int
+ring_wait (struct ring *ring, unsigned *flags, uint64_t *user_data)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, to_submit;
+  int res;
+
+  for (;;) {
+    to_submit =
+      *ring->sq_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+    head = *ring->cq_head;
+    if (to_submit == 0 &&
+        head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+      break;
+    if (sys_io_uring_enter (ring->fd, to_submit, 1,
+                            IORING_ENTER_GETEVENTS) == -1 &&
+        errno != EINTR)
+      return -errno;
+  }
+
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  res = cqe->res;
+  if (flags)
+    *flags = cqe->flags;
+  if (user_data)
+    *user_data = cqe->user_data;
+  __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return res;
+}
+
+/* Hand a provided buffer back to the kernel. */
+static void
+recycle_buffer (struct uring_session *s, int bid)
+{
+  struct io_uring_buf_ring *br = s->buf_ring;
+  unsigned short tail = br->tail;
+  struct io_uring_buf *b = &br->bufs[tail & (RECV_BUFFERS - 1)];
+
+  b->addr = (uintptr_t) &s->recv_bufs[bid * RECV_BUFFER_SIZE];
+  b->len = RECV_BUFFER_SIZE;
+  b->bid = bid;
+  __atomic_store_n (&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+uring_recv (struct connection *conn, void *vbuf, size_t len)
+{
+  struct uring_session *s = connection_get_uring_session (conn);
+  struct io_uring_sqe *sqe;
+  char *buf = vbuf;
+  size_t n;
+  unsigned flags;
+  int r;
+  bool first_read = true;
+
+  while (len > 0) {
+    if (s->cur_bid >= 0) {
+      n = s->cur_len - s->cur_pos;
+      if (n > len)
+        n = len;
+      memcpy (buf, &s->recv_bufs[s->cur_bid * RECV_BUFFER_SIZE + s->cur_pos],
+              n);
+      s->cur_pos += n;
+      buf += n;
+      len -= n;
+      first_read = false;
+      if (s->cur_pos == s->cur_len) {
+        recycle_buffer (s, s->cur_bid);
+        s->cur_bid = -1;
+      }
+      continue;
+    }
+
+    /* The multishot receive stops if it runs out of buffers (or on
+     * some errors), so arm it again.  This is submitted along with
+     * the wait below.
+     */
+    if (!s->recv_armed) {
+      ring_queue (&s->recv_ring, IORING_OP_RECV, FILE_IN, NULL, 0,
+                  IOSQE_BUFFER_SELECT, 0);
+      sqe = &s->recv_ring.sqes[(*s->recv_ring.sq_tail - 1) &
+                               *s->recv_ring.sq_mask];
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->buf_group = RECV_BUFFER_GROUP;
+      s->recv_armed = true;
+    }
+
+    flags = 0;
+    r = ring_wait (&s->recv_ring, &flags, NULL);
+    if (!(flags & IORING_CQE_F_MORE))
+      s->recv_armed = false;
+    if (r > 0) {
+      s->cur_bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      s->cur_pos = 0;
+      s->cur_len = r;
+      continue;
+    }
+    if (r < 0) {
+      if (r == -EINTR || r == -EAGAIN || r == -ENOBUFS)
+        continue;
+      errno = -r;
+      return -1;
+    }
+    if (first_read)
+      return 0;
+    /* Partial record read.  This is an error. */
+    errno = EBADMSG;
+    return -1;
+  }
+
+  return 1;
+}
+
+/* Write the whole buffer with single operations.  Only used to finish
+ * off after a short write.
+ */
+static int
+send_all (struct uring_session *s, const char *buf, size_t len)
+{
+  int r;
+
+  while (len > 0) {
+    ring_queue (&s->send_ring, IORING_OP_WRITE, FILE_OUT, (void *) buf, len,
+                0, 0);
+    r = ring_wait (&s->send_ring, NULL, NULL);
+    if (r < 0) {
+      if (r == -EINTR || r == -EAGAIN)
+        continue;
+      errno = -r;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Send the buffers.  With SEND_MORE they are only copied to the
+ * staging buffer if they fit.  Otherwise anything staged and the
+ * buffers are submitted together as linked operations.
+ */
+static int
+uring_sendv (struct connection *conn, const struct iovec *iov, int iovcnt,
+             int flags)
+{
+  struct uring_session *s = connection_get_uring_session (conn);
+  size_t total = 0, staged_sent = 0, iov_sent = 0;
+  bool iov_done = false;
+  uint64_t which;
+  int i, r, nr;
+
+  for (i = 0; i < iovcnt; ++i)
+    total += iov[i].iov_len;
+
+  if ((flags & SEND_MORE) && total <= SEND_STAGING_SIZE - s->staged) {
+    for (i = 0; i < iovcnt; ++i) {
+      memcpy (&s->staging[s->staged], iov[i].iov_base, iov[i].iov_len);
+      s->staged += iov[i].iov_len;
+    }
+    return 0;
+  }
+
+  nr = 0;
+  if (s->staged > 0) {
+    ring_queue (&s->send_ring, IORING_OP_WRITE_FIXED, FILE_OUT,
+                s->staging, s->staged, IOSQE_IO_LINK, 1);
+    nr++;
+  }
+  ring_queue (&s->send_ring, IORING_OP_WRITEV, FILE_OUT,
+              (void *) iov, iovcnt, 0, 2);
+  nr++;
+
+  while (nr > 0) {
+    which = 0;
+    r = ring_wait (&s->send_ring, NULL, &which);
+    if (which == 0) {           /* io_uring_enter itself failed */
+      errno = -r;
+      return -1;
+    }
+    nr--;
+    if (r < 0 && r != -ECANCELED && r != -EINTR && r != -EAGAIN) {
+      errno = -r;
+      return -1;
+    }
+    if (which == 1)
+      staged_sent = r > 0 ? r : 0;
+    else {
+      iov_done = r >= 0;
+      iov_sent = r > 0 ? r : 0;
+    }
+  }
+
+  /* A short write breaks the link, so the rest is written here. */
+  if (staged_sent < s->staged) {
+    if (send_all (s, &s->staging[staged_sent], s->staged - staged_sent) == -1)
+      return -1;
+    iov_sent = 0;
+    iov_done = false;
+  }
+  s->staged = 0;
+  if (!iov_done)
+    iov_sent = 0;
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov_sent >= iov[i].iov_len) {
+      iov_sent -= iov[i].iov_len;
+      continue;
+    }
+    if (send_all (s, (char *) iov[i].iov_base + iov_sent,
+                  iov[i].iov_len - iov_sent) == -1)
+      return -1;
+    iov_sent = 0;
+  }
+
+  return 0;
+}
+
+static int
+uring_send (struct connection *conn, const void *buf, size_t len)
+{
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+
+  return uring_sendv (conn, &iov, 1, 0);
+}
+
+static void
+free_session (struct uring_session *s)
+{
+  ring_free (&s->recv_ring);
+  ring_free (&s->send_ring);
+  if (s->buf_ring)
+    munmap (s->buf_ring, RECV_BUFFERS * sizeof (struct io_uring_buf));
+  free (s->recv_bufs);
+  free (s->staging);
+  free (s);
+}
+
+static void
+uring_close (struct connection *conn)
+{
+  struct uring_session *s = connection_get_uring_session (conn);
+
+  if (s->sockin >= 0)
+    close (s->sockin);
+  if (s->sockout >= 0 && s->sockin != s->sockout)
+    close (s->sockout);
+  free_session (s);
+}
+
+/* Check that the kernel supports everything we need.  Provided buffer
+ * rings and multishot receive are the newest features used.
+ */
+void
+uring_init (void)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t probe_len;
+  int fd;
+  bool ok;
+
+  memset (&p, 0, sizeof p);
+  fd = sys_io_uring_setup (SEND_ENTRIES, &p);
+  if (fd == -1) {
+    fprintf (stderr, "%s: --io-uring: io_uring_setup: %m\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  probe_len = sizeof *probe + 256 * sizeof (struct io_uring_probe_op);
+  probe = calloc (1, probe_len);
+  if (probe == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  ok = (p.features & IORING_FEAT_FAST_POLL) &&
+    sys_io_uring_register (fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+    probe->last_op >= IORING_OP_RECV &&
+    (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+  free (probe);
+  close (fd);
+  if (!ok) {
+    fprintf (stderr, "%s: --io-uring: this kernel's io_uring is too old\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Switch a connection over to io_uring.  This is called after the
+ * handshake, so nothing is buffered yet.  If it fails the connection
+ * keeps using the plain socket functions.
+ */
+int
+uring_setup_connection (struct connection *conn, int sockin, int sockout)
+{
+  struct uring_session *s;
+  struct io_uring_buf_reg reg;
+  struct iovec iov;
+  int type, i, err;
+  socklen_t len = sizeof type;
+
+  /* Receiving needs a socket, not a pipe (-s). */
+  if (getsockopt (sockin, SOL_SOCKET, SO_TYPE, &type, &len) == -1) {
+    debug ("io_uring: not a socket, not using io_uring");
+    return -1;
+  }
+
+  s = calloc (1, sizeof *s);
+  if (s == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  s->sockin = sockin;
+  s->sockout = sockout;
+  s->recv_ring.fd = s->send_ring.fd = -1;
+  s->cur_bid = -1;
+
+  err = posix_memalign ((void **) &s->recv_bufs, 4096,
+                        RECV_BUFFERS * RECV_BUFFER_SIZE);
+  if (err == 0)
+    err = posix_memalign ((void **) &s->staging, 4096, SEND_STAGING_SIZE);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("posix_memalign: %m");
+    free_session (s);
+    return -1;
+  }
+
+  if (ring_init (&s->recv_ring, RECV_ENTRIES, RECV_CQ_ENTRIES,
+                 sockin, sockout) == -1 ||
+      ring_init (&s->send_ring, SEND_ENTRIES, 0, sockin, sockout) == -1) {
+    nbdkit_error ("io_uring_setup: %m");
+    free_session (s);
+    return -1;
+  }
+
+  iov.iov_base = s->staging;
+  iov.iov_len = SEND_STAGING_SIZE;
+  if (sys_io_uring_register (s->send_ring.fd, IORING_REGISTER_BUFFERS,
+                             &iov, 1) == -1) {
+    nbdkit_error ("io_uring_register: %m");
+    free_session (s);
+    return -1;
+  }
+
+  /* Set up the provided buffer ring and give it all the buffers. */
+  s->buf_ring = mmap (NULL, RECV_BUFFERS * sizeof (struct io_uring_buf),
+                      PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (s->buf_ring == MAP_FAILED) {
+    s->buf_ring = NULL;
+    nbdkit_error ("mmap: %m");
+    free_session (s);
+    return -1;
+  }
+  memset (&reg, 0, sizeof reg);
+  reg.ring_addr = (uintptr_t) s->buf_ring;
+  reg.ring_entries = RECV_BUFFERS;
+  reg.bgid = RECV_BUFFER_GROUP;
+  if (sys_io_uring_register (s->recv_ring.fd, IORING_REGISTER_PBUF_RING,
+                             &reg, 1) == -1) {
+    nbdkit_error ("io_uring_register: %m");
+    free_session (s);
+    return -1;
+  }
+  for (i = 0; i < RECV_BUFFERS; ++i)
+    recycle_buffer (s, i);
+
+  connection_set_uring_session (conn, s);
+  connection_set_recv (conn, uring_recv);
+  connection_set_send (conn, uring_send);
+  connection_set_sendv (conn, uring_sendv);
+  connection_set_close (conn, uring_close);
+  connection_set_sendfile (conn, NULL);
+  connection_set_recvfile (conn, NULL);
+
+  return 0;
+}
+
+#else /* io_uring not available */
+
+void
+uring_init (void)
+{
+  fprintf (stderr, "%s: --io-uring is not supported on this platform\n",
+           program_name);
+  exit (EXIT_FAILURE);
+}
+
+int
+uring_setup_connection (struct connection *conn, int sockin, int sockout)
+{
+  abort ();
+}
+
+#endif /* io_uring not available */
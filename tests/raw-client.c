@@ -0,0 +1,528 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+read_all (int sock, void *vbuf, size_t len)
+{
+  char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (sock, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      fail ("read: %m");
+    }
+    if (r == 0)
+      fail ("server closed the connection");
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+write_all (int sock, const void *vbuf, size_t len)
+{
+  const char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      fail ("write: %m");
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+/* Send an option and read its replies up to the final one, which is
+ * returned.  The payload of any NBD_REP_INFO reply about the export is
+ * used to fill in the export size and flags, and the number of
+ * NBD_REP_META_CONTEXT replies is returned in *nr_contexts.
+ */
+static uint32_t
+send_option (struct raw_client *client, uint32_t option,
+             const void *data, uint32_t len, size_t *nr_contexts)
+{
+  struct new_option opt;
+  struct fixed_new_option_reply reply;
+  struct fixed_new_option_reply_info_export export;
+  uint32_t reply_type, replylen;
+  char *payload;
+
+  opt.version = htobe64 (NEW_VERSION);
+  opt.option = htobe32 (option);
+  opt.optlen = htobe32 (len);
+  write_all (client->sock, &opt, sizeof opt);
+  write_all (client->sock, data, len);
+
+  if (nr_contexts)
+    *nr_contexts = 0;
+
+  for (;;) {
+    read_all (client->sock, &reply, sizeof reply);
+    if (be64toh (reply.magic) != NBD_REP_MAGIC)
+      fail ("option %" PRIu32 ": bad reply magic", option);
+    if (be32toh (reply.option) != option)
+      fail ("option %" PRIu32 ": reply is for option %" PRIu32,
+            option, be32toh (reply.option));
+    reply_type = be32toh (reply.reply);
+    replylen = be32toh (reply.replylen);
+    payload = malloc (replylen + 1);
+    if (payload == NULL)
+      fail ("malloc: %m");
+    read_all (client->sock, payload, replylen);
+
+    if (reply_type == NBD_REP_INFO && replylen == sizeof export) {
+      memcpy (&export, payload, sizeof export);
+      if (be16toh (export.info) == NBD_INFO_EXPORT) {
+        client->exportsize = be64toh (export.exportsize);
+        client->eflags = be16toh (export.eflags);
+      }
+    }
+    else if (reply_type == NBD_REP_META_CONTEXT && nr_contexts)
+      ++*nr_contexts;
+    free (payload);
+
+    if (reply_type != NBD_REP_INFO && reply_type != NBD_REP_META_CONTEXT)
+      return reply_type;
+  }
+}
+
+void
+raw_connect (struct raw_client *client, int options)
+{
+  struct sockaddr_un addr;
+  struct new_handshake handshake;
+  const char *sockpath = server[0] + strlen ("unix:");
+  uint32_t cflags;
+  char data[64];
+  uint32_t u32;
+  uint16_t u16;
+  size_t len, nr_contexts;
+
+  memset (client, 0, sizeof *client);
+  client->next_handle = 1;
+
+  client->sock = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (client->sock == -1)
+    fail ("socket: %m");
+  addr.sun_family = AF_UNIX;
+  len = strlen (sockpath);
+  memcpy (addr.sun_path, sockpath, len+1 /* trailing \0 */);
+  if (connect (client->sock, (struct sockaddr *) &addr, sizeof addr) == -1)
+    fail ("%s: %m", sockpath);
+
+  read_all (client->sock, &handshake, sizeof handshake);
+  if (memcmp (handshake.nbdmagic, "NBDMAGIC", 8) != 0 ||
+      be64toh (handshake.version) != NEW_VERSION)
+    fail ("server is not using the newstyle protocol (use -n)");
+  if (!(be16toh (handshake.gflags) & NBD_FLAG_FIXED_NEWSTYLE))
+    fail ("server is not using the fixed newstyle protocol");
+  cflags = htobe32 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  write_all (client->sock, &cflags, sizeof cflags);
+
+  if ((options & RAW_STRUCTURED_REPLIES) &&
+      send_option (client, NBD_OPT_STRUCTURED_REPLY,
+                   NULL, 0, NULL) != NBD_REP_ACK)
+    fail ("NBD_OPT_STRUCTURED_REPLY was not accepted");
+
+  if (options & RAW_EXTENDED_HEADERS) {
+    if (send_option (client, NBD_OPT_EXTENDED_HEADERS,
+                     NULL, 0, NULL) != NBD_REP_ACK)
+      fail ("NBD_OPT_EXTENDED_HEADERS was not accepted");
+    client->extended_headers = true;
+  }
+
+  if (options & RAW_BASE_ALLOCATION) {
+    /* Export name "", then one query. */
+    len = 0;
+    u32 = htobe32 (0);
+    memcpy (&data[len], &u32, 4); len += 4;
+    u32 = htobe32 (1);
+    memcpy (&data[len], &u32, 4); len += 4;
+    u32 = htobe32 (15);
+    memcpy (&data[len], &u32, 4); len += 4;
+    memcpy (&data[len], "base:allocation", 15); len += 15;
+    if (send_option (client, NBD_OPT_SET_META_CONTEXT,
+                     data, len, &nr_contexts) != NBD_REP_ACK ||
+        nr_contexts != 1)
+      fail ("NBD_OPT_SET_META_CONTEXT did not select base:allocation");
+  }
+
+  /* Export name "" and no information requests. */
+  u32 = htobe32 (0);
+  memcpy (&data[0], &u32, 4);
+  u16 = htobe16 (0);
+  memcpy (&data[4], &u16, 2);
+  if (send_option (client, NBD_OPT_GO, data, 6, NULL) != NBD_REP_ACK)
+    fail ("NBD_OPT_GO failed");
+  if (client->exportsize == 0)
+    fail ("server did not send the export size");
+}
+
+static void
+send_request (struct raw_client *client, uint64_t handle,
+              uint32_t flags, uint16_t type, uint64_t offset, uint64_t count)
+{
+  struct request request;
+  struct request_ext request_ext;
+
+  if (client->extended_headers) {
+    request_ext.magic = htobe32 (NBD_EXTENDED_REQUEST_MAGIC);
+    request_ext.type = htobe32 (flags | type);
+    request_ext.handle = htobe64 (handle);
+    request_ext.offset = htobe64 (offset);
+    request_ext.count = htobe64 (count);
+    write_all (client->sock, &request_ext, sizeof request_ext);
+  }
+  else {
+    if (count > UINT32_MAX)
+      fail ("count too large without extended headers");
+    request.magic = htobe32 (NBD_REQUEST_MAGIC);
+    request.type = htobe32 (flags | type);
+    request.handle = htobe64 (handle);
+    request.offset = htobe64 (offset);
+    request.count = htobe32 (count);
+    write_all (client->sock, &request, sizeof request);
+  }
+}
+
+/* Parse the payload of a block status chunk. */
+static void
+parse_block_status (uint16_t type, const char *payload, uint64_t len,
+                    struct raw_extent **extents, size_t *nr_extents)
+{
+  struct structured_reply_block_status_ext bs_ext;
+  struct block_descriptor d;
+  struct block_descriptor_ext d_ext;
+  size_t i, n, hdrlen;
+
+  if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+    hdrlen = sizeof bs_ext;
+    if (len < hdrlen)
+      fail ("block status chunk is too short");
+    memcpy (&bs_ext, payload, hdrlen);
+    n = (len - hdrlen) / sizeof d_ext;
+    if (n != be32toh (bs_ext.count) || (len - hdrlen) % sizeof d_ext)
+      fail ("block status chunk has the wrong number of descriptors");
+  }
+  else {
+    hdrlen = sizeof (struct structured_reply_block_status);
+    if (len < hdrlen || (len - hdrlen) % sizeof d)
+      fail ("block status chunk has the wrong length");
+    n = (len - hdrlen) / sizeof d;
+  }
+  if (n == 0)
+    fail ("block status chunk has no descriptors");
+
+  *extents = malloc (n * sizeof **extents);
+  if (*extents == NULL)
+    fail ("malloc: %m");
+  for (i = 0; i < n; ++i) {
+    if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+      memcpy (&d_ext, &payload[hdrlen + i * sizeof d_ext], sizeof d_ext);
+      (*extents)[i].length = be64toh (d_ext.length);
+      (*extents)[i].flags = be64toh (d_ext.status_flags);
+    }
+    else {
+      memcpy (&d, &payload[hdrlen + i * sizeof d], sizeof d);
+      (*extents)[i].length = be32toh (d.length);
+      (*extents)[i].flags = be32toh (d.status_flags);
+    }
+  }
+  *nr_extents = n;
+}
+
+/* Read the reply to the request with the given handle. */
+static uint32_t
+recv_reply (struct raw_client *client, uint64_t handle, uint16_t type,
+            uint64_t offset, uint64_t count, void *data,
+            struct raw_extent **extents, size_t *nr_extents,
+            uint16_t *reply_type)
+{
+  uint32_t magic, error = NBD_SUCCESS;
+  struct reply reply;
+  struct structured_reply chunk;
+  struct structured_reply_ext chunk_ext;
+  struct structured_reply_offset_data od;
+  struct structured_reply_offset_hole oh;
+  uint16_t chunk_flags, chunk_type;
+  uint64_t chunk_handle, len, pos;
+  char *payload;
+
+  if (type == NBD_CMD_READ)
+    client->hole_bytes = 0;
+
+  read_all (client->sock, &magic, sizeof magic);
+  magic = be32toh (magic);
+
+  if (magic == NBD_REPLY_MAGIC) {
+    if (client->extended_headers)
+      fail ("simple reply sent after extended headers were negotiated");
+    memcpy (&reply, &magic, sizeof magic);
+    read_all (client->sock, (char *) &reply + sizeof magic,
+              sizeof reply - sizeof magic);
+    if (be64toh (reply.handle) != handle)
+      fail ("reply has the wrong handle");
+    error = be32toh (reply.error);
+    if (error == NBD_SUCCESS && type == NBD_CMD_READ)
+      read_all (client->sock, data, count);
+    return error;
+  }
+
+  for (;;) {
+    if (magic == NBD_EXTENDED_REPLY_MAGIC && client->extended_headers) {
+      read_all (client->sock, (char *) &chunk_ext + sizeof magic,
+                sizeof chunk_ext - sizeof magic);
+      chunk_flags = be16toh (chunk_ext.flags);
+      chunk_type = be16toh (chunk_ext.type);
+      chunk_handle = be64toh (chunk_ext.handle);
+      len = be64toh (chunk_ext.length);
+      if (be64toh (chunk_ext.offset) != offset)
+        fail ("extended reply chunk has the wrong offset");
+    }
+    else if (magic == NBD_STRUCTURED_REPLY_MAGIC && !client->extended_headers) {
+      read_all (client->sock, (char *) &chunk + sizeof magic,
+                sizeof chunk - sizeof magic);
+      chunk_flags = be16toh (chunk.flags);
+      chunk_type = be16toh (chunk.type);
+      chunk_handle = be64toh (chunk.handle);
+      len = be32toh (chunk.length);
+    }
+    else
+      fail ("unexpected reply magic 0x%" PRIx32, magic);
+    if (chunk_handle != handle)
+      fail ("reply chunk has the wrong handle");
+
+    payload = malloc (len + 1);
+    if (payload == NULL)
+      fail ("malloc: %m");
+    read_all (client->sock, payload, len);
+
+    switch (chunk_type) {
+    case NBD_REPLY_TYPE_NONE:
+      break;
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+      memcpy (&od, payload, sizeof od);
+      pos = be64toh (od.offset) - offset;
+      if (type != NBD_CMD_READ || len < sizeof od ||
+          pos + len - sizeof od > count)
+        fail ("bad NBD_REPLY_TYPE_OFFSET_DATA chunk");
+      memcpy ((char *) data + pos, payload + sizeof od, len - sizeof od);
+      break;
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+      memcpy (&oh, payload, sizeof oh);
+      pos = be64toh (oh.offset) - offset;
+      if (type != NBD_CMD_READ || len != sizeof oh ||
+          pos + be32toh (oh.length) > count)
+        fail ("bad NBD_REPLY_TYPE_OFFSET_HOLE chunk");
+      memset ((char *) data + pos, 0, be32toh (oh.length));
+      client->hole_bytes += be32toh (oh.length);
+      break;
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+    case NBD_REPLY_TYPE_BLOCK_STATUS_EXT:
+      if (type != NBD_CMD_BLOCK_STATUS || extents == NULL)
+        fail ("unexpected block status chunk");
+      parse_block_status (chunk_type, payload, len, extents, nr_extents);
+      *reply_type = chunk_type;
+      break;
+    case NBD_REPLY_TYPE_ERROR:
+    case NBD_REPLY_TYPE_ERROR_OFFSET:
+      if (len < sizeof (struct structured_reply_error))
+        fail ("error chunk is too short");
+      memcpy (&error, payload, sizeof error);
+      error = be32toh (error);
+      break;
+    default:
+      fail ("unknown reply chunk type %" PRIu16, chunk_type);
+    }
+    free (payload);
+
+    if (chunk_flags & NBD_REPLY_FLAG_DONE)
+      return error;
+
+    read_all (client->sock, &magic, sizeof magic);
+    magic = be32toh (magic);
+  }
+}
+
+uint64_t
+raw_send_request (struct raw_client *client, uint32_t flags, uint16_t type,
+                  uint64_t offset, uint64_t count, const void *data)
+{
+  uint64_t handle = client->next_handle++;
+
+  send_request (client, handle, flags, type, offset, count);
+  if (type == NBD_CMD_WRITE)
+    write_all (client->sock, data, count);
+  return handle;
+}
+
+uint32_t
+raw_request (struct raw_client *client, uint32_t flags, uint16_t type,
+             uint64_t offset, uint64_t count, void *data)
+{
+  uint64_t handle;
+
+  handle = raw_send_request (client, flags, type, offset, count, data);
+  return recv_reply (client, handle, type, offset, count, data,
+                     NULL, NULL, NULL);
+}
+
+uint32_t
+raw_recv_reply (struct raw_client *client, uint64_t *handle)
+{
+  uint32_t magic, error = NBD_SUCCESS;
+  struct reply reply;
+  struct structured_reply chunk;
+  struct structured_reply_ext chunk_ext;
+  uint16_t chunk_flags, chunk_type;
+  uint64_t len;
+  char *payload;
+
+  read_all (client->sock, &magic, sizeof magic);
+  magic = be32toh (magic);
+
+  if (magic == NBD_REPLY_MAGIC) {
+    if (client->extended_headers)
+      fail ("simple reply sent after extended headers were negotiated");
+    memcpy (&reply, &magic, sizeof magic);
+    read_all (client->sock, (char *) &reply + sizeof magic,
+              sizeof reply - sizeof magic);
+    *handle = be64toh (reply.handle);
+    return be32toh (reply.error);
+  }
+
+  for (;;) {
+    if (magic == NBD_EXTENDED_REPLY_MAGIC && client->extended_headers) {
+      read_all (client->sock, (char *) &chunk_ext + sizeof magic,
+                sizeof chunk_ext - sizeof magic);
+      chunk_flags = be16toh (chunk_ext.flags);
+      chunk_type = be16toh (chunk_ext.type);
+      *handle = be64toh (chunk_ext.handle);
+      len = be64toh (chunk_ext.length);
+    }
+    else if (magic == NBD_STRUCTURED_REPLY_MAGIC && !client->extended_headers) {
+      read_all (client->sock, (char *) &chunk + sizeof magic,
+                sizeof chunk - sizeof magic);
+      chunk_flags = be16toh (chunk.flags);
+      chunk_type = be16toh (chunk.type);
+      *handle = be64toh (chunk.handle);
+      len = be32toh (chunk.length);
+    }
+    else
+      fail ("unexpected reply magic 0x%" PRIx32, magic);
+
+    payload = malloc (len + 1);
+    if (payload == NULL)
+      fail ("malloc: %m");
+    read_all (client->sock, payload, len);
+    if (chunk_type == NBD_REPLY_TYPE_ERROR ||
+        chunk_type == NBD_REPLY_TYPE_ERROR_OFFSET) {
+      if (len < sizeof (struct structured_reply_error))
+        fail ("error chunk is too short");
+      memcpy (&error, payload, sizeof error);
+      error = be32toh (error);
+    }
+    free (payload);
+
+    if (chunk_flags & NBD_REPLY_FLAG_DONE)
+      return error;
+
+    /* Chunks of different replies are never interleaved. */
+    read_all (client->sock, &magic, sizeof magic);
+    magic = be32toh (magic);
+  }
+}
+
+uint32_t
+raw_block_status (struct raw_client *client, uint32_t flags,
+                  uint64_t offset, uint64_t count,
+                  struct raw_extent **extents, size_t *nr_extents,
+                  uint16_t *reply_type)
+{
+  uint64_t handle = client->next_handle++;
+  uint32_t error;
+
+  *extents = NULL;
+  *nr_extents = 0;
+  send_request (client, handle, flags, NBD_CMD_BLOCK_STATUS, offset, count);
+  error = recv_reply (client, handle, NBD_CMD_BLOCK_STATUS, offset, count,
+                      NULL, extents, nr_extents, reply_type);
+  if (error == NBD_SUCCESS && *extents == NULL)
+    fail ("block status reply had no descriptors");
+  return error;
+}
+
+void
+raw_disconnect (struct raw_client *client)
+{
+  send_request (client, client->next_handle++, 0, NBD_CMD_DISC, 0, 0);
+  close (client->sock);
+}
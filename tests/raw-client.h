@@ -0,0 +1,107 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A minimal NBD client which talks to nbdkit over its Unix socket.
+ * This is for tests which need to send requests that qemu can't send,
+ * or look at the replies in more detail than qemu shows.  Start the
+ * server with test_start_nbdkit first.
+ *
+ * Any protocol error is fatal: these functions print a message and
+ * exit with a failure status.
+ */
+
+#ifndef NBDKIT_RAW_CLIENT_H
+#define NBDKIT_RAW_CLIENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Options for raw_connect. */
+#define RAW_STRUCTURED_REPLIES 1
+#define RAW_EXTENDED_HEADERS   2
+#define RAW_BASE_ALLOCATION    4
+
+struct raw_client {
+  int sock;
+  bool extended_headers;
+  uint64_t exportsize;
+  uint16_t eflags;
+  uint64_t next_handle;
+  uint64_t hole_bytes;          /* Bytes of the last read sent as holes. */
+};
+
+/* One block status descriptor, whichever form it was sent in. */
+struct raw_extent {
+  uint64_t length;
+  uint32_t flags;
+};
+
+extern void raw_connect (struct raw_client *client, int options);
+extern void raw_disconnect (struct raw_client *client);
+
+/* Send a request and wait for its reply, returning the NBD error
+ * (NBD_SUCCESS or NBD_E*).  'data' is the payload of a write, or
+ * receives the data of a read.
+ */
+extern uint32_t raw_request (struct raw_client *client,
+                             uint32_t flags, uint16_t type,
+                             uint64_t offset, uint64_t count, void *data);
+
+/* Send a request (and the payload of a write) without waiting for the
+ * reply, returning its handle.  Several requests can be sent before
+ * collecting their replies, which may arrive in any order, with
+ * raw_recv_reply.
+ */
+extern uint64_t raw_send_request (struct raw_client *client,
+                                  uint32_t flags, uint16_t type,
+                                  uint64_t offset, uint64_t count,
+                                  const void *data);
+
+/* Read the next reply, whichever request it is for, setting *handle
+ * and returning the NBD error.  The data of reads is discarded.  Since
+ * a simple reply doesn't say how much data follows, no reads may be
+ * outstanding unless structured replies were negotiated.
+ */
+extern uint32_t raw_recv_reply (struct raw_client *client, uint64_t *handle);
+
+/* Send NBD_CMD_BLOCK_STATUS.  On success the extents are returned in
+ * a malloc'd array and *reply_type is set to the type of reply chunk
+ * which carried them.
+ */
+extern uint32_t raw_block_status (struct raw_client *client, uint32_t flags,
+                                  uint64_t offset, uint64_t count,
+                                  struct raw_extent **extents,
+                                  size_t *nr_extents, uint16_t *reply_type);
+
+#endif /* NBDKIT_RAW_CLIENT_H */
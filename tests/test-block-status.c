@@ -0,0 +1,353 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test NBD_CMD_BLOCK_STATUS with the base:allocation context against
+ * the file plugin, which finds holes using SEEK_DATA/SEEK_HOLE.  Also
+ * test FUA writes and fast zero requests, which the file plugin
+ * handles itself.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+#define K 1024
+#define FILE_SIZE (1024*K)
+
+static char filename[] = "/tmp/nbdkitbsXXXXXX";
+
+/* The file has two data regions; everything else is a hole. */
+static const struct raw_extent expected[] = {
+  {  64*K, NBD_STATE_HOLE|NBD_STATE_ZERO },
+  {  64*K, 0 },
+  { 384*K, NBD_STATE_HOLE|NBD_STATE_ZERO },
+  {  64*K, 0 },
+  { 448*K, NBD_STATE_HOLE|NBD_STATE_ZERO },
+};
+#define NR_EXPECTED (sizeof expected / sizeof expected[0])
+
+static void
+cleanup (void)
+{
+  unlink (filename);
+}
+
+static void
+create_file (void)
+{
+  char buf[64*K];
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  atexit (cleanup);
+
+  memset (buf, 0x55, sizeof buf);
+  if (ftruncate (fd, FILE_SIZE) == -1 ||
+      pwrite (fd, buf, sizeof buf, 64*K) != sizeof buf ||
+      pwrite (fd, buf, sizeof buf, 512*K) != sizeof buf ||
+      fsync (fd) == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+}
+
+/* Skip the test unless the filesystem reports exactly the holes we
+ * made, since some filesystems don't support SEEK_DATA/SEEK_HOLE or
+ * allocate in larger units.
+ */
+static void
+check_filesystem (void)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  uint64_t offset = 0;
+  size_t i;
+  off_t pos;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_EXPECTED; ++i) {
+    if (expected[i].flags & NBD_STATE_HOLE)
+      pos = lseek (fd, offset, SEEK_DATA);
+    else
+      pos = lseek (fd, offset, SEEK_HOLE);
+    if (pos == -1 && errno == ENXIO)
+      pos = FILE_SIZE;
+    offset += expected[i].length;
+    if (pos != offset)
+      goto skip;
+  }
+  close (fd);
+  return;
+
+ skip:
+  close (fd);
+#endif
+  fprintf (stderr, "%s: test skipped because the filesystem "
+           "does not report holes exactly\n", program_name);
+  exit (77);
+}
+
+static void
+check_extents (const char *what, uint32_t error,
+               const struct raw_extent *extents, size_t nr_extents,
+               const struct raw_extent *want, size_t nr_want)
+{
+  size_t i;
+
+  if (error != NBD_SUCCESS) {
+    fprintf (stderr, "%s FAILED: %s: error %" PRIu32 "\n",
+             program_name, what, error);
+    exit (EXIT_FAILURE);
+  }
+  if (nr_extents != nr_want) {
+    fprintf (stderr, "%s FAILED: %s: got %zu extents, expected %zu\n",
+             program_name, what, nr_extents, nr_want);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_want; ++i) {
+    if (extents[i].length != want[i].length ||
+        extents[i].flags != want[i].flags) {
+      fprintf (stderr, "%s FAILED: %s: extent %zu is "
+               "(%" PRIu64 ", %" PRIu32 "), expected (%" PRIu64 ", %" PRIu32 ")\n",
+               program_name, what, i,
+               extents[i].length, extents[i].flags,
+               want[i].length, want[i].flags);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+/* Read the range and check every byte is 'byte'. */
+static void
+check_data (struct raw_client *client, const char *what,
+            uint64_t offset, uint32_t count, char byte)
+{
+  char *buf;
+  uint32_t error;
+  size_t i;
+
+  buf = malloc (count);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  error = raw_request (client, 0, NBD_CMD_READ, offset, count, buf);
+  if (error != NBD_SUCCESS) {
+    fprintf (stderr, "%s FAILED: %s: read: error %" PRIu32 "\n",
+             program_name, what, error);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < count; ++i) {
+    if (buf[i] != byte) {
+      fprintf (stderr, "%s FAILED: %s: unexpected data at offset %" PRIu64
+               "\n", program_name, what, offset + i);
+      exit (EXIT_FAILURE);
+    }
+  }
+  free (buf);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  struct raw_extent *extents;
+  size_t nr_extents;
+  uint16_t reply_type;
+  uint32_t error;
+  char file_param[sizeof filename + 5];
+  char *buf;
+  size_t i;
+
+  create_file ();
+  check_filesystem ();
+
+  snprintf (file_param, sizeof file_param, "file=%s", filename);
+  if (test_start_nbdkit ("-n", "file", file_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, RAW_STRUCTURED_REPLIES | RAW_BASE_ALLOCATION);
+  if (client.exportsize != FILE_SIZE) {
+    fprintf (stderr, "%s FAILED: export size is %" PRIu64 "\n",
+             program_name, client.exportsize);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The whole file. */
+  error = raw_block_status (&client, 0, 0, FILE_SIZE,
+                            &extents, &nr_extents, &reply_type);
+  check_extents ("whole file", error, extents, nr_extents,
+                 expected, NR_EXPECTED);
+  if (reply_type != NBD_REPLY_TYPE_BLOCK_STATUS) {
+    fprintf (stderr, "%s FAILED: reply type %" PRIu16 "\n",
+             program_name, reply_type);
+    exit (EXIT_FAILURE);
+  }
+  free (extents);
+
+  /* A range starting and ending in the middle of extents. */
+  {
+    const struct raw_extent want[] = {
+      {  32*K, 0 },
+      { 384*K, NBD_STATE_HOLE|NBD_STATE_ZERO },
+      {  32*K, 0 },
+    };
+
+    error = raw_block_status (&client, 0, 96*K, 448*K,
+                              &extents, &nr_extents, &reply_type);
+    check_extents ("middle", error, extents, nr_extents, want, 3);
+    free (extents);
+  }
+
+  /* NBD_CMD_FLAG_REQ_ONE returns only the first extent, for both a
+   * hole and data.
+   */
+  for (i = 0; i < NR_EXPECTED; ++i) {
+    uint64_t offset = 0;
+    size_t j;
+
+    for (j = 0; j < i; ++j)
+      offset += expected[j].length;
+    error = raw_block_status (&client, NBD_CMD_FLAG_REQ_ONE,
+                              offset, FILE_SIZE - offset,
+                              &extents, &nr_extents, &reply_type);
+    check_extents ("REQ_ONE", error, extents, nr_extents, &expected[i], 1);
+    free (extents);
+  }
+
+  /* Holes read as zeroes and data reads back. */
+  buf = malloc (128*K);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0xaa, 128*K);
+  error = raw_request (&client, 0, NBD_CMD_READ, 0, 128*K, buf);
+  if (error != NBD_SUCCESS) {
+    fprintf (stderr, "%s FAILED: read: error %" PRIu32 "\n",
+             program_name, error);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 128*K; ++i) {
+    if (buf[i] != (i < 64*K ? 0 : 0x55)) {
+      fprintf (stderr, "%s FAILED: unexpected data at offset %zu\n",
+               program_name, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* FUA writes, over data and over a hole. */
+  if (!(client.eflags & NBD_FLAG_SEND_FUA)) {
+    fprintf (stderr, "%s FAILED: export flags 0x%" PRIx16 " are missing FUA\n",
+             program_name, client.eflags);
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0x77, 128*K);
+  error = raw_request (&client, NBD_CMD_FLAG_FUA, NBD_CMD_WRITE,
+                       512*K + 4*K, 60*K, buf);
+  if (error == NBD_SUCCESS)
+    error = raw_request (&client, NBD_CMD_FLAG_FUA, NBD_CMD_WRITE,
+                         768*K, 128*K, buf);
+  if (error != NBD_SUCCESS) {
+    fprintf (stderr, "%s FAILED: FUA write: error %" PRIu32 "\n",
+             program_name, error);
+    exit (EXIT_FAILURE);
+  }
+  check_data (&client, "FUA write", 512*K, 4*K, 0x55);
+  check_data (&client, "FUA write", 512*K + 4*K, 60*K, 0x77);
+  check_data (&client, "FUA write", 768*K, 128*K, 0x77);
+  free (buf);
+
+  /* Fast zeroes either succeed, or fail with ENOTSUP if the
+   * filesystem can't do them, without touching the data.
+   */
+  if (!(client.eflags & NBD_FLAG_SEND_FAST_ZERO)) {
+    fprintf (stderr, "%s FAILED: export flags 0x%" PRIx16
+             " are missing fast zero\n", program_name, client.eflags);
+    exit (EXIT_FAILURE);
+  }
+  error = raw_request (&client, NBD_CMD_FLAG_FAST_ZERO, NBD_CMD_WRITE_ZEROES,
+                       64*K, 64*K, NULL);
+  if (error != NBD_SUCCESS && error != NBD_ENOTSUP) {
+    fprintf (stderr, "%s FAILED: fast zero: error %" PRIu32 "\n",
+             program_name, error);
+    exit (EXIT_FAILURE);
+  }
+  check_data (&client, "fast zero", 64*K, 64*K,
+              error == NBD_SUCCESS ? 0 : 0x55);
+  error = raw_request (&client,
+                       NBD_CMD_FLAG_FAST_ZERO | NBD_CMD_FLAG_NO_HOLE,
+                       NBD_CMD_WRITE_ZEROES, 768*K, 128*K, NULL);
+  if (error != NBD_SUCCESS && error != NBD_ENOTSUP) {
+    fprintf (stderr, "%s FAILED: fast zero with NO_HOLE: error %" PRIu32 "\n",
+             program_name, error);
+    exit (EXIT_FAILURE);
+  }
+  check_data (&client, "fast zero with NO_HOLE", 768*K, 128*K,
+              error == NBD_SUCCESS ? 0 : 0x77);
+
+  raw_disconnect (&client);
+
+  /* Without the meta context block status is an error. */
+  raw_connect (&client, RAW_STRUCTURED_REPLIES);
+  error = raw_block_status (&client, 0, 0, FILE_SIZE,
+                            &extents, &nr_extents, &reply_type);
+  if (error != NBD_EINVAL) {
+    fprintf (stderr, "%s FAILED: block status without base:allocation "
+             "returned %" PRIu32 "\n", program_name, error);
+    exit (EXIT_FAILURE);
+  }
+  raw_disconnect (&client);
+
+  exit (EXIT_SUCCESS);
+}
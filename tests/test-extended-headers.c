@@ -0,0 +1,243 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test requests with 64-bit lengths after NBD_OPT_EXTENDED_HEADERS.
+ * test-log-plugin records what the server asks it to do, so we can
+ * check that large trim and zero requests reach the plugin in full.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nbdkit-plugin.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+#include "test-log-plugin.h"
+
+#define GB (UINT64_C(1024)*1024*1024)
+#define EXPORT_SIZE (8*GB)
+#define MAX_PLUGIN_COUNT (2*GB)
+
+static char logname[] = "/tmp/nbdkitlogXXXXXX";
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (logname);
+}
+
+/* Check that the plugin was called for 'op' over exactly the range
+ * [offset, offset+count) in ascending order, with no call larger than
+ * the plugin API allows, and then empty the log.
+ */
+static void
+check_log (const char *op, uint64_t offset, uint64_t count, uint32_t flags)
+{
+  FILE *fp;
+  char line_op[16];
+  uint64_t line_offset, pos = offset;
+  uint32_t line_count, line_flags;
+  size_t nr_calls = 0;
+
+  fp = fopen (logname, "r");
+  if (fp == NULL) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+  while (fscanf (fp, "%15s %" SCNu64 " %" SCNu32 " %" SCNu32,
+                 line_op, &line_offset, &line_count, &line_flags) == 4) {
+    if (strcmp (line_op, op) != 0)
+      fail ("%s: unexpected %s call in the log", op, line_op);
+    if (line_offset != pos)
+      fail ("%s: call at offset %" PRIu64 ", expected %" PRIu64,
+            op, line_offset, pos);
+    if (line_count == 0 || line_count > MAX_PLUGIN_COUNT)
+      fail ("%s: call with count %" PRIu32, op, line_count);
+    if (line_flags != flags)
+      fail ("%s: call with flags 0x%" PRIx32 ", expected 0x%" PRIx32,
+            op, line_flags, flags);
+    pos += line_count;
+    nr_calls++;
+  }
+  fclose (fp);
+
+  if (pos != offset + count)
+    fail ("%s: plugin calls covered %" PRIu64 " bytes, expected %" PRIu64,
+          op, pos - offset, count);
+  if (nr_calls < (count + MAX_PLUGIN_COUNT - 1) / MAX_PLUGIN_COUNT)
+    fail ("%s: too few plugin calls (%zu)", op, nr_calls);
+
+  if (truncate (logname, 0) == -1) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+expect_error (const char *what, uint32_t error, uint32_t expected)
+{
+  if (error != expected)
+    fail ("%s: error %" PRIu32 ", expected %" PRIu32, what, error, expected);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  struct raw_extent *extents;
+  size_t nr_extents;
+  uint16_t reply_type;
+  uint32_t error;
+  char log_param[sizeof logname + 4];
+  unsigned char *buf;
+  size_t i;
+  int fd;
+
+  fd = mkstemp (logname);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup);
+
+  snprintf (log_param, sizeof log_param, "log=%s", logname);
+  if (test_start_nbdkit ("-n", ".libs/test-log-plugin.so",
+                         "size=8G", log_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, RAW_EXTENDED_HEADERS | RAW_BASE_ALLOCATION);
+  if (client.exportsize != EXPORT_SIZE)
+    fail ("export size is %" PRIu64, client.exportsize);
+  if ((client.eflags & (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES)) !=
+      (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES))
+    fail ("export flags 0x%" PRIx16 " are missing trim or zero",
+          client.eflags);
+
+  /* Trim and zero requests over 4GB are split into several plugin
+   * calls which together cover the whole range.
+   */
+  error = raw_request (&client, 0, NBD_CMD_TRIM, 512, 5*GB, NULL);
+  expect_error ("trim", error, NBD_SUCCESS);
+  check_log ("trim", 512, 5*GB, 0);
+
+  error = raw_request (&client, 0, NBD_CMD_WRITE_ZEROES,
+                       4*GB - 4096, 4*GB + 4096, NULL);
+  expect_error ("zero", error, NBD_SUCCESS);
+  check_log ("zero", 4*GB - 4096, 4*GB + 4096, NBDKIT_FLAG_MAY_TRIM);
+
+  error = raw_request (&client, NBD_CMD_FLAG_NO_HOLE, NBD_CMD_WRITE_ZEROES,
+                       0, EXPORT_SIZE, NULL);
+  expect_error ("zero with NO_HOLE", error, NBD_SUCCESS);
+  check_log ("zero", 0, EXPORT_SIZE, 0);
+
+  /* The plugin has no extents callback, so the whole export is
+   * reported as data in a single descriptor longer than 4GB.
+   */
+  error = raw_block_status (&client, 0, 0, EXPORT_SIZE,
+                            &extents, &nr_extents, &reply_type);
+  expect_error ("block status", error, NBD_SUCCESS);
+  if (reply_type != NBD_REPLY_TYPE_BLOCK_STATUS_EXT)
+    fail ("block status reply type %" PRIu16, reply_type);
+  if (nr_extents != 1 ||
+      extents[0].length != EXPORT_SIZE || extents[0].flags != 0)
+    fail ("block status returned %zu extents, the first is "
+          "(%" PRIu64 ", %" PRIu32 ")",
+          nr_extents, extents[0].length, extents[0].flags);
+  free (extents);
+
+  /* Reads and writes above 4GB. */
+  buf = malloc (65536);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  error = raw_request (&client, 0, NBD_CMD_READ, 6*GB + 100, 65536, buf);
+  expect_error ("read", error, NBD_SUCCESS);
+  for (i = 0; i < 65536; ++i) {
+    if (buf[i] != test_log_byte (6*GB + 100 + i))
+      fail ("read: unexpected data at offset %zu", i);
+  }
+
+  /* The zeroes the plugin returns are sent as a hole. */
+  error = raw_request (&client, 0, NBD_CMD_READ,
+                       TEST_LOG_HOLE_OFFSET - 4096, 65536, buf);
+  expect_error ("read over a hole", error, NBD_SUCCESS);
+  for (i = 0; i < 65536; ++i) {
+    if (buf[i] != test_log_byte (TEST_LOG_HOLE_OFFSET - 4096 + i))
+      fail ("read over a hole: unexpected data at offset %zu", i);
+  }
+  if (client.hole_bytes != 65536 - 4096)
+    fail ("read over a hole: %" PRIu64 " bytes were sent as holes, "
+          "expected %d", client.hole_bytes, 65536 - 4096);
+
+  error = raw_request (&client, 0, NBD_CMD_WRITE, 5*GB, 65536, buf);
+  expect_error ("write", error, NBD_SUCCESS);
+  check_log ("pwrite", 5*GB, 65536, 0);
+  free (buf);
+
+  /* Ranges which only fit in 64 bits are still checked. */
+  error = raw_request (&client, 0, NBD_CMD_TRIM, 4*GB, 4*GB + 1, NULL);
+  expect_error ("trim past the end", error, NBD_EIO);
+  error = raw_block_status (&client, 0, 1, EXPORT_SIZE,
+                            &extents, &nr_extents, &reply_type);
+  expect_error ("block status past the end", error, NBD_EIO);
+  error = raw_request (&client, 0, NBD_CMD_READ, 0, 4*GB + 4096, NULL);
+  expect_error ("read over the maximum size", error, NBD_ENOMEM);
+  check_log ("none", 0, 0, 0);  /* nothing reached the plugin */
+
+  raw_disconnect (&client);
+  exit (EXIT_SUCCESS);
+}
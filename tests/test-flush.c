@@ -0,0 +1,232 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* Test that flushes are skipped when nothing has been written since
+ * the last flush, but never otherwise.  test-log-plugin records the
+ * calls which reach the plugin.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nbdkit-plugin.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+#define FAIL_OFFSET 65536
+
+static char logname[] = "/tmp/nbdkitlogXXXXXX";
+
+struct call {
+  const char *op;
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;
+};
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (logname);
+}
+
+/* Check the log holds exactly the expected calls, then empty it. */
+static void
+check_log (const char *what, const struct call *want, size_t nr_want)
+{
+  FILE *fp;
+  char op[16];
+  uint64_t offset;
+  uint32_t count, flags;
+  size_t n = 0;
+
+  fp = fopen (logname, "r");
+  if (fp == NULL) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+  while (fscanf (fp, "%15s %" SCNu64 " %" SCNu32 " %" SCNu32,
+                 op, &offset, &count, &flags) == 4) {
+    if (n >= nr_want)
+      fail ("%s: unexpected %s call in the log", what, op);
+    if (strcmp (op, want[n].op) != 0 ||
+        offset != want[n].offset || count != want[n].count ||
+        flags != want[n].flags)
+      fail ("%s: call %zu was %s (%" PRIu64 ", %" PRIu32 ", 0x%" PRIx32
+            "), expected %s (%" PRIu64 ", %" PRIu32 ", 0x%" PRIx32 ")",
+            what, n, op, offset, count, flags,
+            want[n].op, want[n].offset, want[n].count, want[n].flags);
+    n++;
+  }
+  fclose (fp);
+  if (n != nr_want)
+    fail ("%s: the plugin was called %zu times, expected %zu",
+          what, n, nr_want);
+
+  if (truncate (logname, 0) == -1) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+request (struct raw_client *client, uint32_t type,
+         uint64_t offset, uint32_t count, void *buf, uint32_t expected)
+{
+  uint32_t error;
+
+  error = raw_request (client, 0, type, offset, count, buf);
+  if (error != expected)
+    fail ("request type %" PRIu32 ": error %" PRIu32 ", expected %" PRIu32,
+          type, error, expected);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  char log_param[sizeof logname + 4];
+  char fail_param[32];
+  char buf[4096];
+  int fd;
+
+  fd = mkstemp (logname);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup);
+  memset (buf, 0, sizeof buf);
+
+  snprintf (log_param, sizeof log_param, "log=%s", logname);
+  snprintf (fail_param, sizeof fail_param, "fail=%d", FAIL_OFFSET);
+  if (test_start_nbdkit ("-n", ".libs/test-log-plugin.so",
+                         "size=1M", log_param, fail_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, 0);
+  if (!(client.eflags & NBD_FLAG_SEND_FLUSH))
+    fail ("export flags 0x%" PRIx16 " are missing flush", client.eflags);
+
+  /* Nothing has been written yet. */
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  check_log ("flush before any write", NULL, 0);
+
+  /* A flush after a write always reaches the plugin, and only the
+   * first of several back-to-back flushes does.
+   */
+  request (&client, NBD_CMD_WRITE, 0, 4096, buf, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  {
+    const struct call want[] = {
+      { "pwrite", 0, 4096, 0 },
+      { "flush", 0, 0, 0 },
+    };
+    check_log ("write then flushes", want, 2);
+  }
+
+  request (&client, NBD_CMD_WRITE, 8192, 4096, buf, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_WRITE, 8192, 4096, buf, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  {
+    const struct call want[] = {
+      { "pwrite", 8192, 4096, 0 },
+      { "flush", 0, 0, 0 },
+      { "pwrite", 8192, 4096, 0 },
+      { "flush", 0, 0, 0 },
+    };
+    check_log ("alternating writes and flushes", want, 4);
+  }
+
+  /* Trim and zero count as writes. */
+  request (&client, NBD_CMD_TRIM, 0, 4096, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_WRITE_ZEROES, 4096, 4096, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  {
+    const struct call want[] = {
+      { "trim", 0, 4096, 0 },
+      { "flush", 0, 0, 0 },
+      { "zero", 4096, 4096, NBDKIT_FLAG_MAY_TRIM },
+      { "flush", 0, 0, 0 },
+    };
+    check_log ("trim and zero", want, 4);
+  }
+
+  /* A write which fails may still have changed the data, so the next
+   * flush is not skipped.
+   */
+  request (&client, NBD_CMD_WRITE, FAIL_OFFSET, 4096, buf, NBD_ENOSPC);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  {
+    const struct call want[] = {
+      { "pwrite", FAIL_OFFSET, 4096, 0 },
+      { "flush", 0, 0, 0 },
+    };
+    check_log ("failed write", want, 2);
+  }
+
+  /* Reads don't make a flush necessary. */
+  request (&client, NBD_CMD_READ, 0, 4096, buf, NBD_SUCCESS);
+  request (&client, NBD_CMD_FLUSH, 0, 0, NULL, NBD_SUCCESS);
+  check_log ("read then flush", NULL, 0);
+
+  raw_disconnect (&client);
+  exit (EXIT_SUCCESS);
+}
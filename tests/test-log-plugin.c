@@ -0,0 +1,243 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A plugin for tests which check what the server asks plugins to do.
+ * Each write, trim, zero and flush call is appended to the file named
+ * by the log parameter as one line of text, eg:
+ *
+ *   trim 1024 2147483648 0
+ *
+ * giving the operation, offset, count and flags.  Reads return a
+ * pattern which depends on the offset (see test_log_byte).  If the
+ * fail parameter is given, writes which include that offset are
+ * logged and then fail with ENOSPC.  With zero=0, zero calls fail
+ * with EOPNOTSUPP without being logged, so the server falls back to
+ * writing zeroes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define NBDKIT_API_VERSION 2
+
+#include <nbdkit-plugin.h>
+
+#include "test-log-plugin.h"
+
+static int64_t size = 0;
+static int64_t fail_offset = -1;
+static int can_zero = 1;
+static char *logname = NULL;
+static int logfd = -1;
+
+static void
+log_unload (void)
+{
+  if (logfd >= 0)
+    close (logfd);
+  free (logname);
+}
+
+static int
+log_config (const char *key, const char *value)
+{
+  if (strcmp (key, "size") == 0) {
+    size = nbdkit_parse_size (value);
+    if (size == -1)
+      return -1;
+  }
+  else if (strcmp (key, "fail") == 0) {
+    fail_offset = nbdkit_parse_size (value);
+    if (fail_offset == -1)
+      return -1;
+  }
+  else if (strcmp (key, "zero") == 0)
+    can_zero = strcmp (value, "0") != 0;
+  else if (strcmp (key, "log") == 0) {
+    logname = nbdkit_absolute_path (value);
+    if (!logname)
+      return -1;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+log_config_complete (void)
+{
+  if (size == 0 || logname == NULL) {
+    nbdkit_error ("you must supply the size and log parameters");
+    return -1;
+  }
+
+  logfd = open (logname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+  if (logfd == -1) {
+    nbdkit_error ("%s: %m", logname);
+    return -1;
+  }
+
+  return 0;
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static void *
+log_open (int readonly)
+{
+  /* There is no per-connection state, so return anything non-NULL. */
+  return &size;
+}
+
+static int64_t
+log_get_size (void *handle)
+{
+  return size;
+}
+
+static int
+log_can_trim (void *handle)
+{
+  return 1;
+}
+
+static int
+log_can_fast_zero (void *handle)
+{
+  return 1;
+}
+
+static int
+log_can_fua (void *handle)
+{
+  return NBDKIT_FUA_NATIVE;
+}
+
+/* Write one line to the log, in a single write so lines from
+ * parallel requests don't interleave.
+ */
+static int
+log_call (const char *op, uint64_t offset, uint32_t count, uint32_t flags)
+{
+  char line[128];
+  int len;
+
+  len = snprintf (line, sizeof line, "%s %" PRIu64 " %" PRIu32 " %" PRIu32 "\n",
+                  op, offset, count, flags);
+  if (write (logfd, line, len) != len) {
+    nbdkit_error ("%s: %m", logname);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+log_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+           uint32_t flags)
+{
+  unsigned char *p = buf;
+  uint32_t i;
+
+  for (i = 0; i < count; ++i)
+    p[i] = test_log_byte (offset + i);
+  return 0;
+}
+
+static int
+log_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
+{
+  if (log_call ("pwrite", offset, count, flags) == -1)
+    return -1;
+  if (fail_offset >= 0 &&
+      offset <= fail_offset && fail_offset < offset + count) {
+    nbdkit_error ("pwrite: injected failure at offset %" PRIi64, fail_offset);
+    errno = ENOSPC;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+log_flush (void *handle, uint32_t flags)
+{
+  return log_call ("flush", 0, 0, flags);
+}
+
+static int
+log_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  return log_call ("trim", offset, count, flags);
+}
+
+static int
+log_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  if (!can_zero) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  return log_call ("zero", offset, count, flags);
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "testlog",
+  .version           = PACKAGE_VERSION,
+  .unload            = log_unload,
+  .config            = log_config,
+  .config_complete   = log_config_complete,
+  .open              = log_open,
+  .get_size          = log_get_size,
+  .can_trim          = log_can_trim,
+  .can_fua           = log_can_fua,
+  .can_fast_zero     = log_can_fast_zero,
+  .pread             = log_pread,
+  .pwrite            = log_pwrite,
+  .flush             = log_flush,
+  .trim              = log_trim,
+  .zero              = log_zero,
+  .errno_is_preserved = 1,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
@@ -0,0 +1,58 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_TEST_LOG_PLUGIN_H
+#define NBDKIT_TEST_LOG_PLUGIN_H
+
+#include <stdint.h>
+
+/* test-log-plugin reads zeroes in this range, so the server can send
+ * it as a hole.
+ */
+#define TEST_LOG_HOLE_OFFSET (UINT64_C(7) << 30)
+#define TEST_LOG_HOLE_SIZE (128 * 1024)
+
+/* The byte which test-log-plugin returns when reading at offset.  It
+ * depends on the high bits so reads above 4GB can be told apart from
+ * reads of the same offset modulo 4GB.
+ */
+static inline uint8_t
+test_log_byte (uint64_t offset)
+{
+  if (offset >= TEST_LOG_HOLE_OFFSET &&
+      offset < TEST_LOG_HOLE_OFFSET + TEST_LOG_HOLE_SIZE)
+    return 0;
+  return (offset % 251) ^ (offset >> 32);
+}
+
+#endif /* NBDKIT_TEST_LOG_PLUGIN_H */
@@ -0,0 +1,83 @@
+#!/bin/bash -
+# nbdkit
+# Copyright (C) 2017 Red Hat Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Run the tests which use the small NBD client in raw-client.c again
+# with the epoll engine and with io_uring.
+
+set -e
+source ./functions.sh
+
+tests="
+  test-block-status
+  test-extended-headers
+  test-flush
+  test-serialize-overlapping
+  test-serialize-writes
+  test-write-streaming
+  test-zero-fua
+"
+
+# Run each test given with the options in $NBDKIT_TEST_SERVER_ARGS.
+run ()
+{
+    local t r
+
+    for t in "$@"; do
+        echo "$0: running $t with $NBDKIT_TEST_SERVER_ARGS"
+        r=0
+        ./$t || r=$?
+        if [ $r -eq 77 ]; then
+            echo "$0: $t skipped"
+        elif [ $r -ne 0 ]; then
+            echo "$0: $t failed with $NBDKIT_TEST_SERVER_ARGS"
+            exit 1
+        fi
+    done
+}
+
+# The event loop reads the whole of each request before handing it to
+# a worker, so writes are never streamed to the plugin in chunks.
+export NBDKIT_TEST_SERVER_ARGS="--engine=epoll"
+if nbdkit $NBDKIT_TEST_SERVER_ARGS --dump-config >/dev/null; then
+    run $(echo $tests | sed 's/test-write-streaming//')
+else
+    echo "$0: skipping --engine=epoll, not supported on this platform"
+fi
+
+# --io-uring fails at start up if the kernel can't do it.
+export NBDKIT_TEST_SERVER_ARGS="--io-uring"
+if nbdkit $NBDKIT_TEST_SERVER_ARGS -U - file file=/dev/null --run true; then
+    run $tests
+else
+    echo "$0: skipping --io-uring, not supported by this kernel"
+fi
@@ -0,0 +1,147 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* Test NBDKIT_THREAD_MODEL_SERIALIZE_OVERLAPPING: requests sent
+ * together on one connection must never be in the plugin at the same
+ * time if they overlap and one of them writes, while requests to
+ * disjoint ranges must run in parallel.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+#define K 1024
+#define NR_REQUESTS 10
+
+static char logname[] = "/tmp/nbdkitlogXXXXXX";
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (logname);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  char log_param[sizeof logname + 4];
+  static char buf[64*K];
+  uint64_t handle;
+  uint32_t error;
+  FILE *fp;
+  char op[16];
+  uint64_t offset;
+  uint32_t count;
+  unsigned reads, writes, conflicts;
+  size_t i, n = 0, parallel = 0;
+  int fd;
+
+  fd = mkstemp (logname);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup);
+
+  snprintf (log_param, sizeof log_param, "log=%s", logname);
+  if (test_start_nbdkit ("-n", ".libs/test-serialize-overlapping-plugin.so",
+                         "size=2M", log_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, RAW_STRUCTURED_REPLIES);
+
+  /* Four writes to the same range and two reads which overlap them,
+   * and four writes to ranges which don't overlap anything.
+   */
+  for (i = 0; i < 4; ++i) {
+    raw_send_request (&client, 0, NBD_CMD_WRITE, 0, 64*K, buf);
+    raw_send_request (&client, 0, NBD_CMD_WRITE, (1024 + 64*i)*K, 64*K, buf);
+  }
+  for (i = 0; i < 2; ++i)
+    raw_send_request (&client, 0, NBD_CMD_READ, 32*K, 64*K, NULL);
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    error = raw_recv_reply (&client, &handle);
+    if (error != NBD_SUCCESS)
+      fail ("request %" PRIu64 ": error %" PRIu32, handle, error);
+  }
+  raw_disconnect (&client);
+
+  fp = fopen (logname, "r");
+  if (fp == NULL) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+  while (fscanf (fp, "%15s %" SCNu64 " %" SCNu32 " %u %u %u",
+                 op, &offset, &count, &reads, &writes, &conflicts) == 6) {
+    if (conflicts > 0)
+      fail ("%s at offset %" PRIu64 " ran alongside %u conflicting requests",
+            op, offset, conflicts);
+    if (reads + writes > 0)
+      parallel++;
+    n++;
+  }
+  fclose (fp);
+
+  if (n != NR_REQUESTS)
+    fail ("the plugin was called %zu times, expected %d", n, NR_REQUESTS);
+  if (parallel == 0)
+    fail ("no requests ran in parallel");
+
+  exit (EXIT_SUCCESS);
+}
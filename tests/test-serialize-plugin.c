@@ -0,0 +1,232 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* A plugin for tests of the thread models which let some requests run
+ * in parallel.  It is built once for each thread model, which is set
+ * by defining THREAD_MODEL on the command line.
+ *
+ * Each read and write sleeps for delay milliseconds (default 200) so
+ * that requests sent together are in the plugin at the same time.  As
+ * each one starts, a line is appended to the file named by the log
+ * parameter, eg:
+ *
+ *   pwrite 65536 4096 1 2 0
+ *
+ * giving the operation, offset and count, then the number of other
+ * reads and writes in the plugin at that moment, and how many of those
+ * overlap this request where at least one of the two is a write.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#define NBDKIT_API_VERSION 2
+
+#include <nbdkit-plugin.h>
+
+#ifndef THREAD_MODEL
+#error "THREAD_MODEL must be defined when building this plugin"
+#endif
+
+#define MAX_IN_FLIGHT 64
+
+struct in_flight {
+  bool used;
+  bool write;
+  uint64_t offset;
+  uint32_t count;
+};
+
+static int64_t size = 0;
+static unsigned delay_ms = 200;
+static char *logname = NULL;
+static int logfd = -1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct in_flight in_flight[MAX_IN_FLIGHT];
+
+static void
+serialize_unload (void)
+{
+  if (logfd >= 0)
+    close (logfd);
+  free (logname);
+}
+
+static int
+serialize_config (const char *key, const char *value)
+{
+  if (strcmp (key, "size") == 0) {
+    size = nbdkit_parse_size (value);
+    if (size == -1)
+      return -1;
+  }
+  else if (strcmp (key, "delay") == 0) {
+    if (sscanf (value, "%u", &delay_ms) != 1) {
+      nbdkit_error ("could not parse delay '%s'", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "log") == 0) {
+    logname = nbdkit_absolute_path (value);
+    if (!logname)
+      return -1;
+  }
+  else {
+    nbdkit_error ("unknown parameter '%s'", key);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+serialize_config_complete (void)
+{
+  if (size == 0 || logname == NULL) {
+    nbdkit_error ("you must supply the size and log parameters");
+    return -1;
+  }
+
+  logfd = open (logname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+  if (logfd == -1) {
+    nbdkit_error ("%s: %m", logname);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *
+serialize_open (int readonly)
+{
+  /* There is no per-connection state, so return anything non-NULL. */
+  return &size;
+}
+
+static int64_t
+serialize_get_size (void *handle)
+{
+  return size;
+}
+
+/* Record the request as in the plugin, log what else is, sleep, and
+ * then remove it again.
+ */
+static int
+call (const char *op, bool is_write, uint64_t offset, uint32_t count)
+{
+  struct in_flight *self = NULL;
+  unsigned reads = 0, writes = 0, conflicts = 0;
+  char line[128];
+  size_t i;
+  int len;
+
+  pthread_mutex_lock (&lock);
+  for (i = 0; i < MAX_IN_FLIGHT; ++i) {
+    if (!in_flight[i].used) {
+      if (self == NULL)
+        self = &in_flight[i];
+      continue;
+    }
+    if (in_flight[i].write)
+      writes++;
+    else
+      reads++;
+    if ((is_write || in_flight[i].write) &&
+        offset < in_flight[i].offset + in_flight[i].count &&
+        in_flight[i].offset < offset + count)
+      conflicts++;
+  }
+  if (self == NULL) {
+    pthread_mutex_unlock (&lock);
+    nbdkit_error ("too many requests in flight");
+    return -1;
+  }
+  self->used = true;
+  self->write = is_write;
+  self->offset = offset;
+  self->count = count;
+
+  len = snprintf (line, sizeof line,
+                  "%s %" PRIu64 " %" PRIu32 " %u %u %u\n",
+                  op, offset, count, reads, writes, conflicts);
+  if (write (logfd, line, len) != len)
+    nbdkit_error ("%s: %m", logname);
+  pthread_mutex_unlock (&lock);
+
+  usleep (delay_ms * 1000);
+
+  pthread_mutex_lock (&lock);
+  self->used = false;
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+static int
+serialize_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+                 uint32_t flags)
+{
+  memset (buf, 0, count);
+  return call ("pread", false, offset, count);
+}
+
+static int
+serialize_pwrite (void *handle, const void *buf, uint32_t count,
+                  uint64_t offset, uint32_t flags)
+{
+  return call ("pwrite", true, offset, count);
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "testserialize",
+  .version           = PACKAGE_VERSION,
+  .unload            = serialize_unload,
+  .config            = serialize_config,
+  .config_complete   = serialize_config_complete,
+  .open              = serialize_open,
+  .get_size          = serialize_get_size,
+  .pread             = serialize_pread,
+  .pwrite            = serialize_pwrite,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
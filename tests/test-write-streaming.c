@@ -0,0 +1,276 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that writes larger than 1MB are passed to the plugin in 1MB
+ * chunks, with FUA on every chunk, that a chunk which fails stops the
+ * rest of the request from being written, and that a client which
+ * disconnects part way through the payload only has the chunks it
+ * sent completely written.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <nbdkit-plugin.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+#define M (1024*1024)
+#define FAIL_OFFSET (33*M + 5)
+
+static char logname[] = "/tmp/nbdkitlogXXXXXX";
+
+struct call {
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;
+};
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (logname);
+}
+
+/* Read the pwrite calls from the log into calls[], returning how many
+ * there were.
+ */
+static size_t
+read_log (struct call *calls, size_t max)
+{
+  FILE *fp;
+  char op[16];
+  size_t n = 0;
+
+  fp = fopen (logname, "r");
+  if (fp == NULL) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+  while (n < max &&
+         fscanf (fp, "%15s %" SCNu64 " %" SCNu32 " %" SCNu32,
+                 op, &calls[n].offset, &calls[n].count,
+                 &calls[n].flags) == 4) {
+    if (strcmp (op, "pwrite") != 0)
+      fail ("unexpected %s call in the log", op);
+    n++;
+  }
+  fclose (fp);
+  return n;
+}
+
+/* Check the log holds exactly the expected calls, then empty it. */
+static void
+check_log (const char *what, const struct call *want, size_t nr_want)
+{
+  struct call calls[16];
+  size_t i, n;
+
+  n = read_log (calls, sizeof calls / sizeof calls[0]);
+  if (n != nr_want)
+    fail ("%s: the plugin was called %zu times, expected %zu",
+          what, n, nr_want);
+  for (i = 0; i < n; ++i) {
+    if (calls[i].offset != want[i].offset ||
+        calls[i].count != want[i].count ||
+        calls[i].flags != want[i].flags)
+      fail ("%s: call %zu was pwrite (%" PRIu64 ", %" PRIu32 ", 0x%" PRIx32
+            "), expected pwrite (%" PRIu64 ", %" PRIu32 ", 0x%" PRIx32 ")",
+            what, i, calls[i].offset, calls[i].count, calls[i].flags,
+            want[i].offset, want[i].count, want[i].flags);
+  }
+
+  if (truncate (logname, 0) == -1) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+write_all (int sock, const void *vbuf, size_t len)
+{
+  const char *buf = vbuf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, buf, len);
+    if (r == -1) {
+      perror ("write");
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  struct request request;
+  uint32_t error;
+  char log_param[sizeof logname + 4];
+  char fail_param[32];
+  char *buf;
+  struct call calls[16];
+  time_t start;
+  size_t n;
+  int fd;
+
+  fd = mkstemp (logname);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup);
+
+  buf = calloc (1, 4*M);
+  if (buf == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  snprintf (log_param, sizeof log_param, "log=%s", logname);
+  snprintf (fail_param, sizeof fail_param, "fail=%d", FAIL_OFFSET);
+  if (test_start_nbdkit ("-n", ".libs/test-log-plugin.so",
+                         "size=64M", log_param, fail_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, 0);
+
+  /* FUA is passed to the plugin on every chunk. */
+  error = raw_request (&client, NBD_CMD_FLAG_FUA, NBD_CMD_WRITE,
+                       M, 3*M + M/2, buf);
+  if (error != NBD_SUCCESS)
+    fail ("FUA write: error %" PRIu32, error);
+  {
+    const struct call want[] = {
+      { 1*M, M, NBDKIT_FLAG_FUA },
+      { 2*M, M, NBDKIT_FLAG_FUA },
+      { 3*M, M, NBDKIT_FLAG_FUA },
+      { 4*M, M/2, NBDKIT_FLAG_FUA },
+    };
+    check_log ("FUA write", want, 4);
+  }
+
+  error = raw_request (&client, 0, NBD_CMD_WRITE, 8*M, 2*M + 1, buf);
+  if (error != NBD_SUCCESS)
+    fail ("write: error %" PRIu32, error);
+  {
+    const struct call want[] = {
+      { 8*M, M, 0 },
+      { 9*M, M, 0 },
+      { 10*M, 1, 0 },
+    };
+    check_log ("write", want, 3);
+  }
+
+  /* The second chunk fails, so the rest of the request is discarded
+   * and the client gets the error.  The connection is still usable
+   * afterwards.
+   */
+  error = raw_request (&client, 0, NBD_CMD_WRITE, 32*M, 4*M, buf);
+  if (error != NBD_ENOSPC)
+    fail ("failing write: error %" PRIu32 ", expected ENOSPC", error);
+  error = raw_request (&client, 0, NBD_CMD_WRITE, 0, 4096, buf);
+  if (error != NBD_SUCCESS)
+    fail ("write after failure: error %" PRIu32, error);
+  {
+    const struct call want[] = {
+      { 32*M, M, 0 },
+      { 33*M, M, 0 },
+      { 0, 4096, 0 },
+    };
+    check_log ("failing write", want, 3);
+  }
+  raw_disconnect (&client);
+
+  /* Send the first one and a half chunks of a write, then hang up. */
+  raw_connect (&client, 0);
+  request.magic = htobe32 (NBD_REQUEST_MAGIC);
+  request.type = htobe32 (NBD_CMD_WRITE);
+  request.handle = htobe64 (1);
+  request.offset = htobe64 (16*M);
+  request.count = htobe32 (3*M);
+  write_all (client.sock, &request, sizeof request);
+  write_all (client.sock, buf, M + M/2);
+  close (client.sock);
+
+  /* Only the complete chunk is written.  Wait for it, then check that
+   * the server is still serving new connections and that nothing
+   * else was written.
+   */
+  start = time (NULL);
+  while (read_log (calls, 1) == 0) {
+    if (time (NULL) - start > 30)
+      fail ("short write: timed out waiting for the first chunk");
+    usleep (100000);
+  }
+  raw_connect (&client, 0);
+  error = raw_request (&client, 0, NBD_CMD_READ, 0, 4096, buf);
+  if (error != NBD_SUCCESS)
+    fail ("read after short write: error %" PRIu32, error);
+  raw_disconnect (&client);
+  sleep (1);
+  n = read_log (calls, 16);
+  if (n != 1 || calls[0].offset != 16*M || calls[0].count != M)
+    fail ("short write: the plugin was called %zu times", n);
+
+  free (buf);
+  exit (EXIT_SUCCESS);
+}
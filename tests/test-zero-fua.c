@@ -0,0 +1,175 @@
+/* nbdkit
+ * Copyright (C) 2017 Red Hat Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/* Test that when the plugin cannot zero a range itself and the server
+ * writes zeroes instead, FUA is passed to the plugin on every write,
+ * not only the last, including across the pieces that very large
+ * requests are split into.  Fast zero requests must fail with ENOTSUP
+ * rather than writing anything.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nbdkit-plugin.h>
+
+#include "protocol.h"
+#include "test.h"
+#include "raw-client.h"
+
+#define M (UINT64_C(1024)*1024)
+#define GB (1024*M)
+#define ZERO_REGION_SIZE M
+
+static char logname[] = "/tmp/nbdkitlogXXXXXX";
+
+static void __attribute__((noreturn, format (printf, 1, 2)))
+fail (const char *fs, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "%s FAILED: ", program_name);
+  va_start (args, fs);
+  vfprintf (stderr, fs, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (logname);
+}
+
+/* Check that the range [offset, offset+count) was written by pwrite
+ * calls in ascending order, each with the given flags, and then empty
+ * the log.
+ */
+static void
+check_log (const char *what, uint64_t offset, uint64_t count, uint32_t flags)
+{
+  FILE *fp;
+  char op[16];
+  uint64_t line_offset, pos = offset;
+  uint32_t line_count, line_flags;
+
+  fp = fopen (logname, "r");
+  if (fp == NULL) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+  while (fscanf (fp, "%15s %" SCNu64 " %" SCNu32 " %" SCNu32,
+                 op, &line_offset, &line_count, &line_flags) == 4) {
+    if (strcmp (op, "pwrite") != 0)
+      fail ("%s: unexpected %s call in the log", what, op);
+    if (line_offset != pos)
+      fail ("%s: pwrite at offset %" PRIu64 ", expected %" PRIu64,
+            what, line_offset, pos);
+    if (line_count == 0 || line_count > ZERO_REGION_SIZE)
+      fail ("%s: pwrite with count %" PRIu32, what, line_count);
+    if (line_flags != flags)
+      fail ("%s: pwrite at offset %" PRIu64 " with flags 0x%" PRIx32
+            ", expected 0x%" PRIx32,
+            what, line_offset, line_flags, flags);
+    pos += line_count;
+  }
+  fclose (fp);
+
+  if (pos != offset + count)
+    fail ("%s: pwrite calls covered %" PRIu64 " bytes, expected %" PRIu64,
+          what, pos - offset, count);
+
+  if (truncate (logname, 0) == -1) {
+    perror (logname);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct raw_client client;
+  uint32_t error;
+  char log_param[sizeof logname + 4];
+  int fd;
+
+  fd = mkstemp (logname);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup);
+
+  snprintf (log_param, sizeof log_param, "log=%s", logname);
+  if (test_start_nbdkit ("-n", ".libs/test-log-plugin.so",
+                         "size=8G", "zero=0", log_param, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  raw_connect (&client, 0);
+  if ((client.eflags & (NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_FAST_ZERO)) !=
+      (NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_FAST_ZERO))
+    fail ("export flags 0x%" PRIx16 " are missing FUA or fast zero",
+          client.eflags);
+
+  /* This is split into two calls to .zero, and each falls back to
+   * writing zeroes.
+   */
+  error = raw_request (&client, NBD_CMD_FLAG_FUA, NBD_CMD_WRITE_ZEROES,
+                       GB, 3*GB + 4096, NULL);
+  if (error != NBD_SUCCESS)
+    fail ("FUA zero: error %" PRIu32, error);
+  check_log ("FUA zero", GB, 3*GB + 4096, NBDKIT_FLAG_FUA);
+
+  error = raw_request (&client, 0, NBD_CMD_WRITE_ZEROES,
+                       5*GB + 512, 2*M + 512, NULL);
+  if (error != NBD_SUCCESS)
+    fail ("zero: error %" PRIu32, error);
+  check_log ("zero", 5*GB + 512, 2*M + 512, 0);
+
+  error = raw_request (&client, NBD_CMD_FLAG_FAST_ZERO, NBD_CMD_WRITE_ZEROES,
+                       GB, 4096, NULL);
+  if (error != NBD_ENOTSUP)
+    fail ("fast zero: error %" PRIu32 ", expected ENOTSUP", error);
+  check_log ("fast zero", GB, 0, 0);
+
+  raw_disconnect (&client);
+  exit (EXIT_SUCCESS);
+}
@@ -109,6 +109,7 @@ test_start_nbdkit (const char *arg, ...)
     const char *p;
     const int MAX_ARGS = 64;
     const char *argv[MAX_ARGS+1];
+    char *extra, *saveptr;
     va_list args;
 
     argv[0] = "nbdkit";
@@ -118,8 +119,27 @@ test_start_nbdkit (const char *arg, ...)
     argv[4] = pidpath;
     argv[5] = "-f";
     argv[6] = "-v";
-    argv[7] = arg;
-    i = 8;
+    i = 7;
+
+    /* Extra server options, eg. to run the test with another engine. */
+    extra = getenv ("NBDKIT_TEST_SERVER_ARGS");
+    if (extra) {
+      extra = strdup (extra);
+      if (extra == NULL) {
+        perror ("strdup");
+        _exit (EXIT_FAILURE);
+      }
+      for (p = strtok_r (extra, " ", &saveptr); p != NULL;
+           p = strtok_r (NULL, " ", &saveptr)) {
+        if (i >= MAX_ARGS)
+          abort ();
+        argv[i] = p;
+        ++i;
+      }
+    }
+
+    argv[i] = arg;
+    ++i;
 
     va_start (args, arg);
     while ((p = va_arg (args, const char *)) != NULL) {
@@ -42,6 +42,10 @@
 extern pid_t pid;               /* PID of nbdkit process. */
 extern const char *server[2];   /* server parameter for add_drive */
 
+/* Start nbdkit with the given arguments, followed by NULL.  Any
+ * options in $NBDKIT_TEST_SERVER_ARGS (separated by spaces) are
+ * added before them.
+ */
 extern int test_start_nbdkit (const char *arg, ...);
 
 /* Declare program_name. */